@@ -0,0 +1,76 @@
+#include <atomic>
+
+#include "rb_fastproto_init.h"
+#include "rb_fastproto_arena.h"
+
+namespace rb_fastproto_gen {
+    namespace {
+        // How much memory each thread's arena keeps between calls. It is allocated up front as the
+        // arena's initial block, which Arena::Reset() hangs on to while freeing everything else.
+        std::atomic<size_t> arena_high_water_mark(64 * 1024);
+
+        struct ThreadArena {
+            std::unique_ptr<char[]> initial_block;
+            size_t initial_block_size = 0;
+            // Declared after initial_block, so it's destroyed before the block it points to
+            std::unique_ptr<google::protobuf::Arena> arena;
+            bool in_use = false;
+        };
+
+        thread_local ThreadArena thread_arena;
+    }
+
+    ScopedThreadArena::ScopedThreadArena() {
+        if (thread_arena.in_use) {
+            private_arena.reset(new google::protobuf::Arena());
+            arena = private_arena.get();
+            return;
+        }
+
+        // (Re)build the arena if this thread hasn't got one yet, or the high-water mark changed
+        size_t high_water_mark = arena_high_water_mark.load(std::memory_order_relaxed);
+        if (!thread_arena.arena || thread_arena.initial_block_size != high_water_mark) {
+            thread_arena.arena.reset();
+            thread_arena.initial_block.reset(high_water_mark > 0 ? new char[high_water_mark] : nullptr);
+            // The initial block stays for the life of the thread, so the GC is told about it once
+            rb_gc_adjust_memory_usage(static_cast<ssize_t>(high_water_mark) - static_cast<ssize_t>(thread_arena.initial_block_size));
+            thread_arena.initial_block_size = high_water_mark;
+
+            google::protobuf::ArenaOptions options;
+            options.initial_block = thread_arena.initial_block.get();
+            options.initial_block_size = high_water_mark;
+            thread_arena.arena.reset(new google::protobuf::Arena(options));
+        }
+
+        thread_arena.in_use = true;
+        arena = thread_arena.arena.get();
+    }
+
+    // Whatever the arena allocated beyond its initial block is given back by the reset (or by
+    // deleting a private arena). It only lives for the one call, so unlike the initial block it
+    // isn't reported to the GC.
+    ScopedThreadArena::~ScopedThreadArena() {
+        if (!private_arena) {
+            thread_arena.arena->Reset();
+            thread_arena.in_use = false;
+        }
+    }
+
+    static VALUE fastproto_arena_high_water_mark(VALUE self) {
+        return SIZET2NUM(arena_high_water_mark.load(std::memory_order_relaxed));
+    }
+
+    static VALUE fastproto_set_arena_high_water_mark(VALUE self, VALUE bytes) {
+        CHECK_INTEGER_S(bytes);
+        if (NUM2LL(bytes) < 0) {
+            rb_raise(rb_eArgError, "arena_high_water_mark must not be negative");
+        }
+        arena_high_water_mark.store(NUM2SIZET(bytes), std::memory_order_relaxed);
+        return bytes;
+    }
+
+    void define_arena_methods() {
+        rb_define_singleton_method(rb_fastproto_module, "arena_high_water_mark", RUBY_METHOD_FUNC(&fastproto_arena_high_water_mark), 0);
+        rb_define_singleton_method(rb_fastproto_module, "arena_high_water_mark=", RUBY_METHOD_FUNC(&fastproto_set_arena_high_water_mark), 1);
+    }
+}
@@ -0,0 +1,38 @@
+#include <ruby/ruby.h>
+#include <memory>
+#include <google/protobuf/arena.h>
+
+#ifndef __RB_FASTPROTO_ARENA_H
+#define __RB_FASTPROTO_ARENA_H
+
+namespace rb_fastproto_gen {
+    // Hands out a per-thread protobuf arena to allocate intermediate C++ messages on, for as long
+    // as this object is in scope. The arena is reset rather than freed when it goes out of scope,
+    // so its memory is reused by the next call. Anything allocated beyond
+    // Fastproto.arena_high_water_mark bytes is given back to the system by the reset, so one
+    // unusually large message doesn't pin that much memory to the thread forever.
+    //
+    // If the thread's arena is already in use further up the stack, a private arena is used
+    // instead.
+    class ScopedThreadArena {
+    public:
+        ScopedThreadArena();
+        ~ScopedThreadArena();
+
+        ScopedThreadArena(const ScopedThreadArena&) = delete;
+        ScopedThreadArena& operator=(const ScopedThreadArena&) = delete;
+
+        google::protobuf::Arena* get() const {
+            return arena;
+        }
+
+    private:
+        google::protobuf::Arena* arena;
+        std::unique_ptr<google::protobuf::Arena> private_arena;
+    };
+
+    // Defines Fastproto.arena_high_water_mark and Fastproto.arena_high_water_mark=
+    void define_arena_methods();
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include <climits>
+
+#include "rb_fastproto_backing.h"
+#include "rb_fastproto_gvl.h"
+
+namespace rb_fastproto_gen {
+    namespace {
+        struct ParseArgs {
+            google::protobuf::MessageLite* proto;
+            const char* data;
+            size_t size;
+            bool parsed;
+            bool done;
+
+            void run() {
+                parsed = proto->ParsePartialFromArray(data, static_cast<int>(size));
+            }
+        };
+
+        struct SerializeArgs {
+            const google::protobuf::MessageLite* proto;
+            uint8_t* target;
+            bool done;
+
+            void run() {
+                proto->SerializeWithCachedSizesToArray(target);
+            }
+        };
+    }
+
+    bool parse_backing_without_gvl(google::protobuf::MessageLite* proto, const char* data, size_t size) {
+        if (size > INT_MAX) {
+            return false;
+        }
+        ParseArgs args = { proto, data, size, false, false };
+        call_without_gvl(&args, size >= BACKING_GVL_THRESHOLD);
+        return args.parsed;
+    }
+
+    void serialize_backing_without_gvl(const google::protobuf::MessageLite* proto, uint8_t* target, size_t size) {
+        SerializeArgs args = { proto, target, false };
+        call_without_gvl(&args, size >= BACKING_GVL_THRESHOLD);
+    }
+
+    VALUE backing_to_string(const google::protobuf::MessageLite &proto) {
+        size_t size = proto.ByteSizeLong();
+        VALUE str = rb_str_new(nullptr, size);
+        proto.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(RSTRING_PTR(str)));
+        return str;
+    }
+}
@@ -0,0 +1,28 @@
+#include <ruby/ruby.h>
+#include <cstddef>
+#include <cstdint>
+#include <google/protobuf/message_lite.h>
+
+#ifndef __RB_FASTPROTO_BACKING_H
+#define __RB_FASTPROTO_BACKING_H
+
+namespace rb_fastproto_gen {
+    // libprotobuf calls made by messages generated with storage=cpp. Anything at least
+    // BACKING_GVL_THRESHOLD bytes long is parsed or serialized with the GVL released; smaller
+    // messages aren't worth the cost of giving it up and taking it back. Neither call can raise,
+    // so the caller can keep track of what it owns across them.
+    const size_t BACKING_GVL_THRESHOLD = 16 * 1024;
+
+    // ParsePartialFromArray, so a missing required field is no more of an error than it is to
+    // parse_wire. False if size bytes at data aren't a valid message.
+    bool parse_backing_without_gvl(google::protobuf::MessageLite* proto, const char* data, size_t size);
+
+    // Writes proto to target, which has room for the ByteSizeLong() that was just called on it.
+    void serialize_backing_without_gvl(const google::protobuf::MessageLite* proto, uint8_t* target, size_t size);
+
+    // proto's wire format as a binary String, for handing a message over to a type that isn't
+    // backed by a C++ message of its own.
+    VALUE backing_to_string(const google::protobuf::MessageLite &proto);
+}
+
+#endif
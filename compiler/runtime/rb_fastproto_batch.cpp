@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "rb_fastproto_batch.h"
+#include "rb_fastproto_gvl.h"
+
+namespace rb_fastproto_gen {
+    namespace {
+        // Copies are handed out one at a time, so a few big ones don't hold everyone else up
+        struct Batch {
+            const DeferredCopy* copies;
+            size_t count;
+            std::atomic<size_t> next_copy;
+
+            void work() {
+                for (size_t i = next_copy++; i < count; i = next_copy++) {
+                    write_raw(copies[i].target, copies[i].data, copies[i].size);
+                }
+            }
+        };
+
+        // Threads that wait for a batch to help with. One batch has the pool at a time; a
+        // serialize_many that finds it busy writes its batch by itself instead of waiting.
+        class WorkerPool {
+        public:
+            explicit WorkerPool(size_t size) : batch(nullptr), openings(0), helping(0), started(0) {
+                // The workers never run ruby code, so they don't take any of its signals either
+                sigset_t all_signals;
+                sigset_t old_signals;
+                sigfillset(&all_signals);
+                pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+                try {
+                    for (; started < size; started++) {
+                        std::thread(&WorkerPool::work, this).detach();
+                    }
+                } catch (const std::system_error &) {
+                }
+                pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+            }
+
+            size_t size() const {
+                return started;
+            }
+
+            // Works through current with up to helpers workers. False, having done nothing, if
+            // another batch has the pool.
+            bool run(Batch &current, size_t helpers) {
+                std::unique_lock<std::mutex> busy_lock(busy, std::try_to_lock);
+                if (!busy_lock.owns_lock()) {
+                    return false;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    batch = &current;
+                    openings = helpers;
+                }
+                wake.notify_all();
+                current.work();
+
+                // Workers that haven't woken up yet would find nothing left to do
+                std::unique_lock<std::mutex> lock(mutex);
+                openings = 0;
+                finished.wait(lock, [this] { return helping == 0; });
+                batch = nullptr;
+                return true;
+            }
+
+        private:
+            std::mutex busy;
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::condition_variable finished;
+            Batch* batch;
+            size_t openings;
+            size_t helping;
+            size_t started;
+
+            void work() {
+                std::unique_lock<std::mutex> lock(mutex);
+                for (;;) {
+                    wake.wait(lock, [this] { return openings > 0; });
+                    openings--;
+                    helping++;
+                    Batch* current = batch;
+                    lock.unlock();
+                    current->work();
+                    lock.lock();
+                    if (--helping == 0) {
+                        finished.notify_one();
+                    }
+                }
+            }
+        };
+
+        WorkerPool* pool = nullptr;
+        pid_t pool_pid = 0;
+
+        // Only called with the GVL held, which is what keeps two threads from making a pool at
+        // once. A child process has none of its parent's threads, so it makes a pool of its own;
+        // the parent's is left alone, since its locks may have been held by them at the fork.
+        WorkerPool* worker_pool() {
+            if (pool == nullptr || pool_pid != getpid()) {
+                size_t cores = std::max(1u, std::thread::hardware_concurrency());
+                pool = new(std::nothrow) WorkerPool(cores - 1);
+                pool_pid = getpid();
+            }
+            return pool;
+        }
+
+        struct WriteCopiesArgs {
+            Batch* batch;
+            WorkerPool* pool;
+            size_t helpers;
+            bool done;
+
+            void run() {
+                if (helpers == 0 || !pool->run(*batch, helpers)) {
+                    batch->work();
+                }
+            }
+        };
+    }
+
+    thread_local SerializeBatch* deferring_batch = nullptr;
+
+    void SerializeBatch::write_copies() {
+        // Nothing can be allocated between taking the first pointer and the last copy being made
+        size_t total_size = 0;
+        for (auto &copy : copies) {
+            copy.source = rb_str_new_frozen(copy.source);
+            total_size += copy.size;
+        }
+        for (auto &copy : copies) {
+            copy.data = RSTRING_PTR(copy.source);
+        }
+
+        Batch batch;
+        batch.copies = copies.data();
+        batch.count = copies.size();
+        batch.next_copy = 0;
+
+        WriteCopiesArgs args = { &batch, nullptr, 0, false };
+        size_t helpers = batch.count == 0 ? 0 : std::min(batch.count - 1, total_size / SERIALIZE_MANY_BYTES_PER_THREAD);
+        if (helpers > 0) {
+            args.pool = worker_pool();
+            args.helpers = args.pool == nullptr ? 0 : std::min(helpers, args.pool->size());
+        }
+        call_without_gvl(&args, total_size >= SERIALIZE_MANY_GVL_THRESHOLD);
+    }
+
+    namespace {
+        // Marks with rb_gc_mark, which pins, rather than rb_gc_mark_movable
+        void serialize_batch_mark(void* memory) {
+            auto batch = reinterpret_cast<SerializeBatch*>(memory);
+            for (VALUE output : batch->outputs) {
+                rb_gc_mark(output);
+            }
+            for (const auto &copy : batch->copies) {
+                rb_gc_mark(copy.source);
+            }
+        }
+
+        void serialize_batch_free(void* memory) {
+            delete reinterpret_cast<SerializeBatch*>(memory);
+        }
+
+        const rb_data_type_t serialize_batch_type = {
+            "Fastproto::SerializeBatch",
+            { &serialize_batch_mark, &serialize_batch_free, nullptr, nullptr, { nullptr } },
+            nullptr, nullptr,
+            RUBY_TYPED_FREE_IMMEDIATELY
+        };
+    }
+
+    VALUE serialize_batch_new(SerializeBatch** batch) {
+        VALUE owner = TypedData_Wrap_Struct(0, &serialize_batch_type, nullptr);
+        *batch = new SerializeBatch();
+        RTYPEDDATA_DATA(owner) = *batch;
+        return owner;
+    }
+}
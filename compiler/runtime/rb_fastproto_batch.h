@@ -0,0 +1,86 @@
+#include <ruby/ruby.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "rb_fastproto_wire_format.h"
+
+#ifndef __RB_FASTPROTO_BATCH_H
+#define __RB_FASTPROTO_BATCH_H
+
+namespace rb_fastproto_gen {
+    // Strings at least this long are left for serialize_many's workers to copy in
+    const long SERIALIZE_MANY_DEFERRED_COPY_BYTES = 4 * 1024;
+
+    // The copies are made with the GVL released once there are at least this many bytes of them
+    const size_t SERIALIZE_MANY_GVL_THRESHOLD = 16 * 1024;
+
+    // Each worker is given at least this many bytes to copy
+    const size_t SERIALIZE_MANY_BYTES_PER_THREAD = 64 * 1024;
+
+    // A string or bytes value that serialize_many has left a gap in its output for. source starts
+    // out as the field's String and is swapped for a frozen copy of it, sharing its buffer, before
+    // the GVL is released, so the bytes being read can't be changed or freed by another thread.
+    struct DeferredCopy {
+        VALUE source;
+        uint8_t* target;
+        const char* data;
+        size_t size;
+    };
+
+    // One serialize_many call. Messages are written with the GVL held, the same as by
+    // serialize_to_string, except that long strings are left out (see write_string), and then
+    // write_copies() fills them in on the worker pool without it. Nothing read by the workers
+    // belongs to a message: they only see the frozen copies and the output Strings, which are
+    // both pinned by the batch's mark function, so GC.compact can't move them either.
+    class SerializeBatch {
+    public:
+        // Keeps output, which messages are about to be written into, where it is
+        void pin(VALUE output) {
+            outputs.push_back(output);
+        }
+
+        // Copies the strings left out of the messages in. Has to be called with the GVL, which it
+        // releases for big enough batches.
+        void write_copies();
+
+        std::vector<VALUE> outputs;
+        std::vector<DeferredCopy> copies;
+    };
+
+    // Makes a SerializeBatch, returning the object that owns it, which the caller has to keep
+    // on its stack (with RB_GC_GUARD) until the batch is written.
+    VALUE serialize_batch_new(SerializeBatch** batch);
+
+    // The batch write_string leaves long strings out for, on this thread, or nullptr
+    extern thread_local SerializeBatch* deferring_batch;
+
+    // Has write_string leave long strings out for batch for as long as this is in scope. Nothing
+    // in between may raise or call into ruby.
+    class DeferStringCopies {
+    public:
+        explicit DeferStringCopies(SerializeBatch* batch) {
+            deferring_batch = batch;
+        }
+
+        ~DeferStringCopies() {
+            deferring_batch = nullptr;
+        }
+
+        DeferStringCopies(const DeferStringCopies&) = delete;
+        DeferStringCopies& operator=(const DeferStringCopies&) = delete;
+    };
+
+    // Writes the bytes of a string or bytes field, which the caller has already written the
+    // length of
+    static inline uint8_t* write_string(uint8_t* target, VALUE string) {
+        long size = RSTRING_LEN(string);
+        if (size >= SERIALIZE_MANY_DEFERRED_COPY_BYTES && deferring_batch != nullptr) {
+            deferring_batch->copies.push_back({ string, target, nullptr, static_cast<size_t>(size) });
+            return target + size;
+        }
+        return write_raw(target, RSTRING_PTR(string), size);
+    }
+}
+
+#endif
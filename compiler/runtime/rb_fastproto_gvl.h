@@ -0,0 +1,31 @@
+#include <ruby/ruby.h>
+#include <ruby/thread.h>
+
+#ifndef __RB_FASTPROTO_GVL_H
+#define __RB_FASTPROTO_GVL_H
+
+namespace rb_fastproto_gen {
+    // Calls args->run(), with the GVL released if release is set, and sets args->done. run()
+    // must not touch anything ruby.
+    //
+    // rb_thread_call_without_gvl2 doesn't check for interrupts once it has the GVL back, so it
+    // can't raise out from under our caller. If there was already an interrupt pending it
+    // returns without calling anything, and the call is made with the GVL held instead.
+    template<typename Args>
+    void call_without_gvl(Args* args, bool release) {
+        auto call = [](void* args_ptr) -> void* {
+            auto _args = reinterpret_cast<Args*>(args_ptr);
+            _args->run();
+            _args->done = true;
+            return nullptr;
+        };
+        if (release) {
+            rb_thread_call_without_gvl2(call, args, RUBY_UBF_IO, nullptr);
+        }
+        if (!args->done) {
+            call(args);
+        }
+    }
+}
+
+#endif
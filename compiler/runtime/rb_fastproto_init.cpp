@@ -1,5 +1,9 @@
 // Generated code that calls all the entrypoints
 #include "rb_fastproto_init.h"
+#include "rb_fastproto_arena.h"
+#include "rb_fastproto_memory.h"
+#include "rb_fastproto_repeated_scalar.h"
+#include "rb_fastproto_varint_kernels.h"
 #include "rb_fastproto_init_thunks.h"
 
 namespace rb_fastproto_gen {
@@ -19,6 +23,19 @@ namespace rb_fastproto_gen {
     VALUE cls_fastproto_field_message = Qnil;
     VALUE cls_fastproto_field_group = Qnil;
     VALUE cls_fastproto_field_unknown = Qnil;
+    VALUE cls_fastproto_field_map = Qnil;
+    VALUE cls_fastproto_decode_error = Qnil;
+
+    ID id_new;
+    ID id_eq;
+    ID id_inspect;
+    ID id_to_hash;
+    ID id_fields;
+
+    VALUE default_empty_array = Qnil;
+    VALUE default_empty_hash = Qnil;
+
+    static void intern_ids();
 
     static void define_enum_class();
     static void define_message_class();
@@ -35,9 +52,18 @@ namespace rb_fastproto_gen {
     static void define_field_message_class();
     static void define_field_group_class();
     static void define_field_unknown_class();
+    static void define_field_map_class();
+    static void define_decode_error_class();
 }
 
 extern "C" void Init_fastproto_gen(void) {
+    rb_fastproto_gen::intern_ids();
+
+    rb_gc_register_address(&rb_fastproto_gen::default_empty_array);
+    rb_fastproto_gen::default_empty_array = rb_obj_freeze(rb_ary_new());
+    rb_gc_register_address(&rb_fastproto_gen::default_empty_hash);
+    rb_fastproto_gen::default_empty_hash = rb_obj_freeze(rb_hash_new());
+
     // Define our toplevel module
     rb_fastproto_gen::rb_fastproto_module = rb_define_module("Fastproto");
 
@@ -56,6 +82,12 @@ extern "C" void Init_fastproto_gen(void) {
     rb_fastproto_gen::define_field_message_class();
     rb_fastproto_gen::define_field_group_class();
     rb_fastproto_gen::define_field_unknown_class();
+    rb_fastproto_gen::define_field_map_class();
+    rb_fastproto_gen::define_decode_error_class();
+    rb_fastproto_gen::define_arena_methods();
+    rb_fastproto_gen::define_memory_stats_method();
+    rb_fastproto_gen::define_repeated_scalar_class();
+    rb_fastproto_gen::define_varint_kernel_methods();
 
     // Now call all the initialisation thunks for each protobuf class in rb_fastproto_init_thunks.h
     for (int i = 0; i < rb_fastproto_init_thunks_len; i++) {
@@ -64,6 +96,14 @@ extern "C" void Init_fastproto_gen(void) {
 }
 
 namespace rb_fastproto_gen {
+    static void intern_ids() {
+        id_new = rb_intern("new");
+        id_eq = rb_intern("==");
+        id_inspect = rb_intern("inspect");
+        id_to_hash = rb_intern("to_hash");
+        id_fields = rb_intern("fields");
+    }
+
     static void define_enum_class() {
         cls_fastproto_enum = rb_define_class_under(rb_fastproto_module, "Enum", rb_cObject);
     }
@@ -73,6 +113,11 @@ namespace rb_fastproto_gen {
         return rb_funcall(rb_cv_get(self, "@@message_classes"), rb_intern("[]"), 1, name);
     }
 
+    static int map_value_to_hash(VALUE key, VALUE value, VALUE hash) {
+        rb_hash_aset(hash, key, rb_funcall(cls_fastproto_message, id_to_hash, 1, value));
+        return ST_CONTINUE;
+    }
+
     static VALUE cls_fastproto_message_to_hash(VALUE self, VALUE msg) {
         if (msg == Qnil) {
           return Qnil;
@@ -86,14 +131,25 @@ namespace rb_fastproto_gen {
           auto ary = rb_ary_new();
 
           for (int i = 0; i < RARRAY_LEN(msg); i++) {
-            rb_ary_push(ary, rb_funcall(self, rb_intern("to_hash"), 1, rb_ary_entry(msg, i)));
+            rb_ary_push(ary, rb_funcall(self, id_to_hash, 1, rb_ary_entry(msg, i)));
           }
 
           return ary;
         }
 
-        if (rb_respond_to(msg, rb_intern("to_hash"))) {
-          return rb_funcall(msg, rb_intern("to_hash"), 0);
+        // Map fields. Their keys are never messages, so only the values need converting.
+        if (RB_TYPE_P(msg, T_HASH)) {
+          auto hash = rb_hash_new();
+          rb_hash_foreach(msg, &map_value_to_hash, hash);
+          return hash;
+        }
+
+        if (rb_obj_is_kind_of(msg, cls_fastproto_repeated_scalar)) {
+          return rb_funcall(msg, rb_intern("to_a"), 0);
+        }
+
+        if (rb_respond_to(msg, id_to_hash)) {
+          return rb_funcall(msg, id_to_hash, 0);
         }
 
         return msg;
@@ -201,4 +257,24 @@ namespace rb_fastproto_gen {
     static void define_field_unknown_class() {
         cls_fastproto_field_unknown = rb_define_class_under(rb_fastproto_module, "FieldUnknown", cls_fastproto_field);
     }
+
+    static VALUE cls_fastproto_field_map_initialize(VALUE self, VALUE tag, VALUE name, VALUE repeated, VALUE key_field, VALUE value_field) {
+        VALUE args[] = { tag, name, repeated };
+        rb_call_super(3, args);
+        rb_ivar_set(self, rb_intern("@key_field"), key_field);
+        rb_ivar_set(self, rb_intern("@value_field"), value_field);
+        return self;
+    }
+
+    // Map fields hold a Hash; key_field and value_field describe its keys & values
+    static void define_field_map_class() {
+        cls_fastproto_field_map = rb_define_class_under(rb_fastproto_module, "FieldMap", cls_fastproto_field);
+        rb_define_method(cls_fastproto_field_map, "initialize", RUBY_METHOD_FUNC(&cls_fastproto_field_map_initialize), 5);
+        rb_define_attr(cls_fastproto_field_map, "key_field", 1, 0);
+        rb_define_attr(cls_fastproto_field_map, "value_field", 1, 0);
+    }
+
+    static void define_decode_error_class() {
+        cls_fastproto_decode_error = rb_define_class_under(rb_fastproto_module, "DecodeError", rb_eStandardError);
+    }
 }
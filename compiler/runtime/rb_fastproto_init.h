@@ -26,35 +26,105 @@ namespace rb_fastproto_gen {
     extern VALUE cls_fastproto_field_message;
     extern VALUE cls_fastproto_field_group;
     extern VALUE cls_fastproto_field_unknown;
+    extern VALUE cls_fastproto_field_map;
 
-    static inline unsigned int NUM2UINT_S(VALUE num) {
+    // Raised when parsing malformed wire format data
+    extern VALUE cls_fastproto_decode_error;
+
+    // Method and ivar names the generated code uses on its hot paths. These are interned once
+    // when the extension loads, rather than on every call.
+    extern ID id_new;
+    extern ID id_eq;
+    extern ID id_inspect;
+    extern ID id_to_hash;
+    extern ID id_fields;
+
+    // Messages live inside their Ruby object, rather than in a block of their own, on rubies with
+    // embeddable TypedData (3.3 on). Ruby still mallocs the struct if it's too big for a slot, so
+    // whether one was embedded has to be checked per object.
+#ifdef TYPED_DATA_EMBEDDED
+    const VALUE TYPED_EMBEDDABLE = RUBY_TYPED_EMBEDDABLE;
+    static inline bool typed_data_embedded(VALUE obj) { return RTYPEDDATA_EMBEDDED_P(obj); }
+#else
+    const VALUE TYPED_EMBEDDABLE = 0;
+    static inline bool typed_data_embedded(VALUE obj) { return false; }
+#endif
+
+    // A frozen empty array, which every repeated field of a new message starts out as.
+    extern VALUE default_empty_array;
+
+    // Gives a field of owner its own array to push onto, if it is still sharing
+    // default_empty_array.
+    static inline VALUE own_array(VALUE owner, VALUE* field) {
+        if (*field == default_empty_array) {
+            RB_OBJ_WRITE(owner, field, rb_ary_new());
+        }
+        return *field;
+    }
+
+    // A frozen empty hash, which every map field of a new message starts out as.
+    extern VALUE default_empty_hash;
+
+    // Like own_array(), gives a map field its own hash to add to.
+    static inline VALUE own_hash(VALUE owner, VALUE* field) {
+        if (*field == default_empty_hash) {
+            RB_OBJ_WRITE(owner, field, rb_hash_new());
+        }
+        return *field;
+    }
+
+    // A String of the length bytes at ptr, which points into the frozen String source. Anything
+    // too big to embed in the String object shares source's memory instead of being copied. The
+    // result is always binary, the same as rb_str_new would make it.
+    static inline VALUE shared_substring(VALUE source, const uint8_t* ptr, size_t length) {
+        long offset = reinterpret_cast<const char*>(ptr) - RSTRING_PTR(source);
+        VALUE substring = rb_str_subseq(source, offset, static_cast<long>(length));
+        if (ENCODING_GET(substring) != rb_ascii8bit_encindex()) {
+            rb_enc_associate_index(substring, rb_ascii8bit_encindex());
+        }
+        return substring;
+    }
+
+    // The numeric _S conversions only accept real Integers (and Floats, for NUM2DBL_S). That
+    // disables float-to-int coercion, and means converting a field never calls back into ruby
+    // (via to_int or to_f), so the generated encoders can rely on sizing and writing a message
+    // seeing exactly the same values.
+    static inline void CHECK_INTEGER_S(VALUE num) {
         if (RB_TYPE_P(num, T_FLOAT)) {
             rb_raise(rb_eTypeError, "Expected fixnum, got float");
         }
+        if (!RB_INTEGER_TYPE_P(num)) {
+            rb_raise(rb_eTypeError, "Expected integer, got %s", rb_obj_classname(num));
+        }
+    }
+
+    static inline unsigned int NUM2UINT_S(VALUE num) {
+        CHECK_INTEGER_S(num);
         return NUM2UINT(num);
     }
 
     static inline int NUM2INT_S(VALUE num) {
-        if (RB_TYPE_P(num, T_FLOAT)) {
-            rb_raise(rb_eTypeError, "Expected fixnum, got float");
-        }
+        CHECK_INTEGER_S(num);
         return NUM2INT(num);
     }
 
     static inline unsigned long NUM2ULONG_S(VALUE num) {
-        if (RB_TYPE_P(num, T_FLOAT)) {
-            rb_raise(rb_eTypeError, "Expected fixnum, got float");
-        }
+        CHECK_INTEGER_S(num);
         return NUM2ULONG(num);
     }
 
     static inline long NUM2LONG_S(VALUE num) {
-        if (RB_TYPE_P(num, T_FLOAT)) {
-            rb_raise(rb_eTypeError, "Expected fixnum, got float");
-        }
+        CHECK_INTEGER_S(num);
         return NUM2LONG(num);
     }
 
+    static inline double NUM2DBL_S(VALUE num) {
+        if (!RB_FLOAT_TYPE_P(num) && !RB_INTEGER_TYPE_P(num)) {
+            rb_raise(rb_eTypeError, "Expected float, got %s", rb_obj_classname(num));
+        }
+        return NUM2DBL(num);
+    }
+
     static inline bool VAL2BOOL_S(VALUE arg) {
         if (RB_TYPE_P(arg, T_TRUE)) {
             return true;
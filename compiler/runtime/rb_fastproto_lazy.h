@@ -0,0 +1,97 @@
+#include <ruby/ruby.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifndef __RB_FASTPROTO_LAZY_H
+#define __RB_FASTPROTO_LAZY_H
+
+namespace rb_fastproto_gen {
+    // The message fields of a message read by parse_lazy that haven't been decoded yet. Each span
+    // is one occurrence of a field, tag and all, in source: the frozen String that was parsed,
+    // which the message keeps alive. Spans are kept as offsets, in the order they were read, so
+    // decoding them in turn merges the same as an eager parse would.
+    //
+    // A span that has been decoded (or dropped, because its field was set) has its field_number
+    // cleared to 0 rather than being removed, so one that raises part way through decoding can't
+    // be decoded again.
+    struct LazyFields {
+        struct Span {
+            int field_number;
+            size_t start;
+            size_t end;
+        };
+
+        VALUE source;
+        // Set while the message itself is being parsed, when its message fields are recorded
+        // here rather than decoded
+        bool indexing;
+        std::vector<Span> spans;
+
+        explicit LazyFields(VALUE source) : source(source), indexing(true) {}
+
+        const uint8_t* base() const {
+            return reinterpret_cast<const uint8_t*>(RSTRING_PTR(source));
+        }
+
+        void add(int field_number, const uint8_t* start, const uint8_t* end) {
+            spans.push_back({ field_number, static_cast<size_t>(start - base()), static_cast<size_t>(end - base()) });
+        }
+
+        bool pending(int field_number) const {
+            for (auto &span : spans) {
+                if (span.field_number == field_number) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // The native memory we take up, for reporting to the GC
+        size_t memsize() const {
+            return sizeof(*this) + spans.capacity() * sizeof(Span);
+        }
+
+        // Whether every span has been decoded or dropped
+        bool done() const {
+            for (auto &span : spans) {
+                if (span.field_number != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // The encoded size of field_number's spans, which are written back out as they were
+        size_t size(int field_number) const {
+            size_t size = 0;
+            for (auto &span : spans) {
+                if (span.field_number == field_number) {
+                    size += span.end - span.start;
+                }
+            }
+            return size;
+        }
+
+        uint8_t* write(uint8_t* target, int field_number) const {
+            for (auto &span : spans) {
+                if (span.field_number == field_number) {
+                    std::memcpy(target, base() + span.start, span.end - span.start);
+                    target += span.end - span.start;
+                }
+            }
+            return target;
+        }
+
+        void drop(int field_number) {
+            for (auto &span : spans) {
+                if (span.field_number == field_number) {
+                    span.field_number = 0;
+                }
+            }
+        }
+    };
+}
+
+#endif
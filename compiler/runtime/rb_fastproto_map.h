@@ -0,0 +1,54 @@
+#include <ruby/ruby.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifndef __RB_FASTPROTO_MAP_H
+#define __RB_FASTPROTO_MAP_H
+
+namespace rb_fastproto_gen {
+    // Map fields are held as a Hash, which the generated encoder goes through directly, without
+    // ever making the entry messages that the wire format describes each pair as.
+    struct MapEntry {
+        VALUE key;
+        VALUE value;
+    };
+
+    template<typename Fn>
+    int call_map_entry_fn(VALUE key, VALUE value, VALUE fn) {
+        (*reinterpret_cast<Fn*>(fn))(key, value);
+        return ST_CONTINUE;
+    }
+
+    // Calls fn(key, value) for each entry of hash, in insertion order. fn may raise.
+    template<typename Fn>
+    void each_map_entry(VALUE hash, Fn &fn) {
+        rb_hash_foreach(hash, &call_map_entry_fn<Fn>, reinterpret_cast<VALUE>(&fn));
+    }
+
+    // The entries of hash in key order, given by less on two keys. Nothing that can raise may be
+    // called while the result is alive, since it would be leaked.
+    template<typename Less>
+    std::vector<MapEntry> sorted_map_entries(VALUE hash, Less less) {
+        std::vector<MapEntry> entries;
+        entries.reserve(RHASH_SIZE(hash));
+        auto add = [&entries](VALUE key, VALUE value) {
+            entries.push_back({ key, value });
+        };
+        each_map_entry(hash, add);
+        std::sort(entries.begin(), entries.end(), [&less](const MapEntry &a, const MapEntry &b) {
+            return less(a.key, b.key);
+        });
+        return entries;
+    }
+
+    // String keys are ordered by their bytes, the same as libprotobuf's deterministic output
+    static inline bool string_key_less(VALUE a, VALUE b) {
+        long a_length = RSTRING_LEN(a);
+        long b_length = RSTRING_LEN(b);
+        int compared = std::memcmp(RSTRING_PTR(a), RSTRING_PTR(b), static_cast<size_t>(std::min(a_length, b_length)));
+        return compared < 0 || (compared == 0 && a_length < b_length);
+    }
+}
+
+#endif
@@ -0,0 +1,36 @@
+#include <utility>
+#include <vector>
+
+#include "rb_fastproto_init.h"
+#include "rb_fastproto_memory.h"
+
+namespace rb_fastproto_gen {
+    namespace {
+        // Message classes are registered GC roots, so they can be kept here as they are
+        std::vector<std::pair<VALUE, MessageMemoryStats*>> registered_stats;
+    }
+
+    void register_memory_stats(VALUE cls, MessageMemoryStats* stats) {
+        registered_stats.push_back(std::make_pair(cls, stats));
+    }
+
+    static VALUE fastproto_memory_stats(VALUE self) {
+        VALUE sym_count = ID2SYM(rb_intern("count"));
+        VALUE sym_bytes = ID2SYM(rb_intern("bytes"));
+        VALUE report = rb_hash_new();
+        for (auto &entry : registered_stats) {
+            if (entry.second->live == 0) {
+                continue;
+            }
+            VALUE stats = rb_hash_new();
+            rb_hash_aset(stats, sym_count, SIZET2NUM(entry.second->live));
+            rb_hash_aset(stats, sym_bytes, SIZET2NUM(entry.second->bytes));
+            rb_hash_aset(report, entry.first, stats);
+        }
+        return report;
+    }
+
+    void define_memory_stats_method() {
+        rb_define_singleton_method(rb_fastproto_module, "memory_stats", RUBY_METHOD_FUNC(&fastproto_memory_stats), 0);
+    }
+}
@@ -0,0 +1,34 @@
+#include <ruby/ruby.h>
+#include <cstddef>
+
+#ifndef __RB_FASTPROTO_MEMORY_H
+#define __RB_FASTPROTO_MEMORY_H
+
+namespace rb_fastproto_gen {
+    // What each message class has alive right now, for Fastproto.memory_stats. bytes is the
+    // structs themselves plus the native memory (unknown fields, lazy spans, backing C++
+    // messages) that they have reported to the GC with rb_gc_adjust_memory_usage.
+    struct MessageMemoryStats {
+        size_t live;
+        size_t bytes;
+    };
+
+    // Called by each message class's initialize_class()
+    void register_memory_stats(VALUE cls, MessageMemoryStats* stats);
+
+    // Tells the GC that native memory went from reported bytes to now bytes, and keeps stats in
+    // step. Messages keep their own reported count, which goes back to 0 when they're destroyed.
+    static inline void adjust_native_memory(MessageMemoryStats* stats, size_t* reported, size_t now) {
+        if (now != *reported) {
+            rb_gc_adjust_memory_usage(static_cast<ssize_t>(now) - static_cast<ssize_t>(*reported));
+            stats->bytes += now - *reported;
+            *reported = now;
+        }
+    }
+
+    // Defines Fastproto.memory_stats, a Hash of each message class with any live instances to
+    // { count:, bytes: }
+    void define_memory_stats_method();
+}
+
+#endif
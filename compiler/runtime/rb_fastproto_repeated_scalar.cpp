@@ -0,0 +1,215 @@
+#include "rb_fastproto_init.h"
+#include "rb_fastproto_repeated_scalar.h"
+
+namespace rb_fastproto_gen {
+    VALUE cls_fastproto_repeated_scalar = Qnil;
+
+    static void repeated_scalar_free(void* memory) {
+        delete reinterpret_cast<RepeatedScalar*>(memory);
+    }
+
+    static size_t repeated_scalar_memsize(const void* memory) {
+        return reinterpret_cast<const RepeatedScalar*>(memory)->memsize();
+    }
+
+    // Holds no references, so there's nothing to mark. Not embeddable, since a dup only gets its
+    // container in initialize_copy.
+    static const rb_data_type_t repeated_scalar_type = {
+        "Fastproto::RepeatedScalar",
+        { nullptr, &repeated_scalar_free, &repeated_scalar_memsize, nullptr, { nullptr } },
+        nullptr, nullptr,
+        RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+    };
+
+    VALUE wrap_repeated_scalar(RepeatedScalar* repeated) {
+        return TypedData_Wrap_Struct(cls_fastproto_repeated_scalar, &repeated_scalar_type, repeated);
+    }
+
+    RepeatedScalar* get_repeated_scalar(VALUE value) {
+        if (!rb_obj_is_kind_of(value, cls_fastproto_repeated_scalar)) {
+            rb_raise(rb_eTypeError, "Expected a Fastproto::RepeatedScalar, got %s", rb_obj_classname(value));
+        }
+        auto repeated = reinterpret_cast<RepeatedScalar*>(RTYPEDDATA_DATA(value));
+        if (repeated == nullptr) {
+            rb_raise(rb_eRuntimeError, "Uninitialized Fastproto::RepeatedScalar");
+        }
+        return repeated;
+    }
+
+    // Only here so that dup & clone work; initialize_copy fills the container in.
+    static VALUE repeated_scalar_alloc(VALUE klass) {
+        return TypedData_Wrap_Struct(klass, &repeated_scalar_type, nullptr);
+    }
+
+    // A container that already has values, like a message's field, keeps its element type and
+    // has the values copied into it, since the message's code holds on to it by that type.
+    static VALUE repeated_scalar_initialize_copy(VALUE self, VALUE other) {
+        if (self == other) {
+            return self;
+        }
+        rb_check_frozen(self);
+        auto source = get_repeated_scalar(other);
+        auto repeated = reinterpret_cast<RepeatedScalar*>(RTYPEDDATA_DATA(self));
+        if (repeated == nullptr) {
+            RTYPEDDATA_DATA(self) = source->copy();
+        } else if (!repeated->assign(source)) {
+            rb_raise(rb_eTypeError, "Can't copy a RepeatedScalar with a different element type");
+        }
+        return self;
+    }
+
+    static VALUE repeated_scalar_size(VALUE self) {
+        return LONG2NUM(get_repeated_scalar(self)->size());
+    }
+
+    static VALUE repeated_scalar_each(VALUE self) {
+        RETURN_SIZED_ENUMERATOR(self, 0, nullptr, repeated_scalar_size);
+        auto repeated = get_repeated_scalar(self);
+        // The block could change the size, so check it every time around
+        for (long i = 0; i < repeated->size(); i++) {
+            rb_yield(repeated->get(i));
+        }
+        return self;
+    }
+
+    static VALUE repeated_scalar_to_a(VALUE self) {
+        auto repeated = get_repeated_scalar(self);
+        VALUE array = rb_ary_new_capa(repeated->size());
+        for (long i = 0; i < repeated->size(); i++) {
+            rb_ary_push(array, repeated->get(i));
+        }
+        return array;
+    }
+
+    static VALUE repeated_scalar_empty(VALUE self) {
+        return get_repeated_scalar(self)->size() == 0 ? Qtrue : Qfalse;
+    }
+
+    // Integer indexes are answered directly, with negative ones counting from the end. Anything
+    // else (ranges, start & length) is handed to Array#[].
+    static VALUE repeated_scalar_aref(int argc, VALUE* argv, VALUE self) {
+        auto repeated = get_repeated_scalar(self);
+        if (argc == 1 && FIXNUM_P(argv[0])) {
+            long index = FIX2LONG(argv[0]);
+            if (index < 0) {
+                index += repeated->size();
+            }
+            if (index < 0 || index >= repeated->size()) {
+                return Qnil;
+            }
+            return repeated->get(index);
+        }
+        return rb_funcallv(repeated_scalar_to_a(self), rb_intern("[]"), argc, argv);
+    }
+
+    static VALUE repeated_scalar_aset(VALUE self, VALUE index_value, VALUE value) {
+        rb_check_frozen(self);
+        auto repeated = get_repeated_scalar(self);
+        long index = NUM2LONG(index_value);
+        if (index < 0) {
+            index += repeated->size();
+        }
+        // There is no nil to pad with, so this can only replace an element or append one
+        if (index < 0 || index > repeated->size()) {
+            rb_raise(rb_eIndexError, "index %ld outside of RepeatedScalar of size %ld", NUM2LONG(index_value), repeated->size());
+        }
+        repeated->set(index, value);
+        return value;
+    }
+
+    static VALUE repeated_scalar_push(int argc, VALUE* argv, VALUE self) {
+        rb_check_frozen(self);
+        auto repeated = get_repeated_scalar(self);
+        for (int i = 0; i < argc; i++) {
+            repeated->set(repeated->size(), argv[i]);
+        }
+        return self;
+    }
+
+    static VALUE repeated_scalar_append(VALUE self, VALUE value) {
+        return repeated_scalar_push(1, &value, self);
+    }
+
+    static VALUE repeated_scalar_concat(VALUE self, VALUE other) {
+        rb_check_frozen(self);
+        VALUE values = rb_convert_type(other, T_ARRAY, "Array", "to_a");
+        auto repeated = get_repeated_scalar(self);
+        for (long i = 0; i < RARRAY_LEN(values); i++) {
+            repeated->set(repeated->size(), RARRAY_AREF(values, i));
+        }
+        return self;
+    }
+
+    static VALUE repeated_scalar_clear(VALUE self) {
+        rb_check_frozen(self);
+        get_repeated_scalar(self)->clear();
+        return self;
+    }
+
+    static VALUE repeated_scalar_last(VALUE self) {
+        auto repeated = get_repeated_scalar(self);
+        return repeated->size() == 0 ? Qnil : repeated->get(repeated->size() - 1);
+    }
+
+    // Equal to another RepeatedScalar or an Array with the same values
+    static VALUE repeated_scalar_equal(VALUE self, VALUE other) {
+        if (self == other) {
+            return Qtrue;
+        }
+        auto repeated = get_repeated_scalar(self);
+        if (rb_obj_is_kind_of(other, cls_fastproto_repeated_scalar)) {
+            if (repeated->same_values(get_repeated_scalar(other))) {
+                return Qtrue;
+            }
+        } else if (!RB_TYPE_P(other, T_ARRAY)) {
+            return Qfalse;
+        }
+        return rb_equal(repeated_scalar_to_a(self), rb_convert_type(other, T_ARRAY, "Array", "to_a"));
+    }
+
+    // Stricter than ==: only another RepeatedScalar of the same element type with the same
+    // values, so that eql? ones always have the same hash
+    static VALUE repeated_scalar_eql(VALUE self, VALUE other) {
+        if (self == other) {
+            return Qtrue;
+        }
+        if (!rb_obj_is_kind_of(other, cls_fastproto_repeated_scalar)) {
+            return Qfalse;
+        }
+        return get_repeated_scalar(self)->same_values(get_repeated_scalar(other)) ? Qtrue : Qfalse;
+    }
+
+    static VALUE repeated_scalar_hash(VALUE self) {
+        return rb_hash(repeated_scalar_to_a(self));
+    }
+
+    static VALUE repeated_scalar_inspect(VALUE self) {
+        return rb_inspect(repeated_scalar_to_a(self));
+    }
+
+    void define_repeated_scalar_class() {
+        cls_fastproto_repeated_scalar = rb_define_class_under(rb_fastproto_module, "RepeatedScalar", rb_cObject);
+        rb_include_module(cls_fastproto_repeated_scalar, rb_mEnumerable);
+        rb_define_alloc_func(cls_fastproto_repeated_scalar, &repeated_scalar_alloc);
+        rb_undef_method(CLASS_OF(cls_fastproto_repeated_scalar), "new");
+        rb_define_method(cls_fastproto_repeated_scalar, "initialize_copy", RUBY_METHOD_FUNC(&repeated_scalar_initialize_copy), 1);
+        rb_define_method(cls_fastproto_repeated_scalar, "each", RUBY_METHOD_FUNC(&repeated_scalar_each), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "size", RUBY_METHOD_FUNC(&repeated_scalar_size), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "length", RUBY_METHOD_FUNC(&repeated_scalar_size), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "empty?", RUBY_METHOD_FUNC(&repeated_scalar_empty), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "[]", RUBY_METHOD_FUNC(&repeated_scalar_aref), -1);
+        rb_define_method(cls_fastproto_repeated_scalar, "[]=", RUBY_METHOD_FUNC(&repeated_scalar_aset), 2);
+        rb_define_method(cls_fastproto_repeated_scalar, "<<", RUBY_METHOD_FUNC(&repeated_scalar_append), 1);
+        rb_define_method(cls_fastproto_repeated_scalar, "push", RUBY_METHOD_FUNC(&repeated_scalar_push), -1);
+        rb_define_method(cls_fastproto_repeated_scalar, "concat", RUBY_METHOD_FUNC(&repeated_scalar_concat), 1);
+        rb_define_method(cls_fastproto_repeated_scalar, "clear", RUBY_METHOD_FUNC(&repeated_scalar_clear), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "last", RUBY_METHOD_FUNC(&repeated_scalar_last), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "to_a", RUBY_METHOD_FUNC(&repeated_scalar_to_a), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "to_ary", RUBY_METHOD_FUNC(&repeated_scalar_to_a), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "==", RUBY_METHOD_FUNC(&repeated_scalar_equal), 1);
+        rb_define_method(cls_fastproto_repeated_scalar, "eql?", RUBY_METHOD_FUNC(&repeated_scalar_eql), 1);
+        rb_define_method(cls_fastproto_repeated_scalar, "hash", RUBY_METHOD_FUNC(&repeated_scalar_hash), 0);
+        rb_define_method(cls_fastproto_repeated_scalar, "inspect", RUBY_METHOD_FUNC(&repeated_scalar_inspect), 0);
+        rb_define_alias(cls_fastproto_repeated_scalar, "to_s", "inspect");
+    }
+}
@@ -0,0 +1,186 @@
+#include <ruby/ruby.h>
+#include <cstdint>
+#include <vector>
+
+#include "rb_fastproto_init.h"
+
+#ifndef __RB_FASTPROTO_REPEATED_SCALAR_H
+#define __RB_FASTPROTO_REPEATED_SCALAR_H
+
+namespace rb_fastproto_gen {
+    // Fastproto::RepeatedScalar, which repeated numeric, bool & enum fields use instead of an
+    // Array when the generator is run with repeated=native. The values are kept unboxed in a
+    // std::vector, which the generated encoders and parser use directly. Ruby sees an Enumerable
+    // that behaves like an Array of the boxed values.
+    extern VALUE cls_fastproto_repeated_scalar;
+
+    // How to box & unbox each element type. Unboxing raises a TypeError for the wrong kind of
+    // value, the same as setting a singular field of that type does.
+    template <typename T> struct RepeatedScalarTraits;
+
+    template <> struct RepeatedScalarTraits<int32_t> {
+        static VALUE to_value(int32_t value) { return INT2NUM(value); }
+        static int32_t from_value(VALUE value) { return NUM2INT_S(value); }
+    };
+
+    template <> struct RepeatedScalarTraits<uint32_t> {
+        static VALUE to_value(uint32_t value) { return UINT2NUM(value); }
+        static uint32_t from_value(VALUE value) { return NUM2UINT_S(value); }
+    };
+
+    template <> struct RepeatedScalarTraits<int64_t> {
+        static VALUE to_value(int64_t value) { return LL2NUM(value); }
+        static int64_t from_value(VALUE value) { return NUM2LONG_S(value); }
+    };
+
+    template <> struct RepeatedScalarTraits<uint64_t> {
+        static VALUE to_value(uint64_t value) { return ULL2NUM(value); }
+        static uint64_t from_value(VALUE value) { return NUM2ULONG_S(value); }
+    };
+
+    template <> struct RepeatedScalarTraits<float> {
+        static VALUE to_value(float value) { return DBL2NUM(value); }
+        static float from_value(VALUE value) { return static_cast<float>(NUM2DBL_S(value)); }
+    };
+
+    template <> struct RepeatedScalarTraits<double> {
+        static VALUE to_value(double value) { return DBL2NUM(value); }
+        static double from_value(VALUE value) { return NUM2DBL_S(value); }
+    };
+
+    template <> struct RepeatedScalarTraits<bool> {
+        static VALUE to_value(bool value) { return BOOL2VAL_S(value); }
+        static bool from_value(VALUE value) { return VAL2BOOL_S(value); }
+    };
+
+    // The ruby methods only need to get at the values as VALUEs, so they go through this
+    // interface; the generated code knows each field's element type, and uses the vector.
+    class RepeatedScalar {
+    public:
+        virtual ~RepeatedScalar() { }
+        virtual long size() const = 0;
+        virtual VALUE get(long index) const = 0;
+        // Sets an element, growing the container by one if index == size()
+        virtual void set(long index, VALUE value) = 0;
+        virtual void clear() = 0;
+        virtual RepeatedScalar* copy() const = 0;
+        // Replaces our values with other's, or returns false if it holds another element type
+        virtual bool assign(const RepeatedScalar* other) = 0;
+        virtual bool same_values(const RepeatedScalar* other) const = 0;
+        // The native memory we take up, for ObjectSpace.memsize_of
+        virtual size_t memsize() const = 0;
+    };
+
+    template <typename T>
+    class TypedRepeatedScalar : public RepeatedScalar {
+    public:
+        std::vector<T> values;
+
+        long size() const override {
+            return static_cast<long>(values.size());
+        }
+
+        VALUE get(long index) const override {
+            return RepeatedScalarTraits<T>::to_value(values[index]);
+        }
+
+        void set(long index, VALUE value) override {
+            T native = RepeatedScalarTraits<T>::from_value(value);
+            if (index == size()) {
+                values.push_back(native);
+            } else {
+                values[index] = native;
+            }
+        }
+
+        void clear() override {
+            values.clear();
+        }
+
+        RepeatedScalar* copy() const override {
+            auto copy = new TypedRepeatedScalar<T>();
+            copy->values = values;
+            return copy;
+        }
+
+        bool assign(const RepeatedScalar* other) override {
+            auto typed_other = dynamic_cast<const TypedRepeatedScalar<T>*>(other);
+            if (typed_other == nullptr) {
+                return false;
+            }
+            values = typed_other->values;
+            return true;
+        }
+
+        bool same_values(const RepeatedScalar* other) const override {
+            auto typed_other = dynamic_cast<const TypedRepeatedScalar<T>*>(other);
+            return typed_other != nullptr && typed_other->values == values;
+        }
+
+        size_t memsize() const override {
+            return sizeof(*this) + values.capacity() * sizeof(T);
+        }
+    };
+
+    // Raises if value isn't an initialized Fastproto::RepeatedScalar
+    RepeatedScalar* get_repeated_scalar(VALUE value);
+    VALUE wrap_repeated_scalar(RepeatedScalar* repeated);
+
+    template <typename T>
+    VALUE repeated_scalar_new() {
+        return wrap_repeated_scalar(new TypedRepeatedScalar<T>());
+    }
+
+    // The values of a field, which is either a RepeatedScalar of the right type, or still the
+    // shared default_empty_array.
+    template <typename T>
+    const std::vector<T>& repeated_scalar_values(VALUE field) {
+        static const std::vector<T> empty;
+        if (field == default_empty_array) {
+            return empty;
+        }
+        return static_cast<TypedRepeatedScalar<T>*>(RTYPEDDATA_DATA(field))->values;
+    }
+
+    // Like own_array(), gives a field its own container to add to.
+    template <typename T>
+    std::vector<T>& own_repeated_scalar(VALUE owner, VALUE* field) {
+        if (*field == default_empty_array) {
+            RB_OBJ_WRITE(owner, field, repeated_scalar_new<T>());
+        }
+        return static_cast<TypedRepeatedScalar<T>*>(RTYPEDDATA_DATA(*field))->values;
+    }
+
+    // What a field gets set to when it is assigned value. A RepeatedScalar of the same type is
+    // kept by reference, the way an assigned Array is; anything else is copied in, converting
+    // (and type checking) every element.
+    template <typename T>
+    VALUE repeated_scalar_from(VALUE value) {
+        if (rb_obj_is_kind_of(value, cls_fastproto_repeated_scalar)) {
+            auto repeated = get_repeated_scalar(value);
+            if (dynamic_cast<TypedRepeatedScalar<T>*>(repeated) != nullptr) {
+                return value;
+            }
+            auto copy = new TypedRepeatedScalar<T>();
+            VALUE result = wrap_repeated_scalar(copy);
+            for (long i = 0; i < repeated->size(); i++) {
+                copy->values.push_back(RepeatedScalarTraits<T>::from_value(repeated->get(i)));
+            }
+            return result;
+        }
+
+        Check_Type(value, T_ARRAY);
+        auto copy = new TypedRepeatedScalar<T>();
+        VALUE result = wrap_repeated_scalar(copy);
+        copy->values.reserve(RARRAY_LEN(value));
+        for (long i = 0; i < RARRAY_LEN(value); i++) {
+            copy->values.push_back(RepeatedScalarTraits<T>::from_value(RARRAY_AREF(value, i)));
+        }
+        return result;
+    }
+
+    // Defines Fastproto::RepeatedScalar
+    void define_repeated_scalar_class();
+}
+
+#endif
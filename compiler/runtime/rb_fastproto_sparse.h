@@ -0,0 +1,72 @@
+#include <ruby/ruby.h>
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#ifndef __RB_FASTPROTO_SPARSE_H
+#define __RB_FASTPROTO_SPARSE_H
+
+namespace rb_fastproto_gen {
+    // The fields of a message generated with sparse=<message>, which only holds the ones that have
+    // been given a value. Entries are kept sorted by field number, so finding one is a binary
+    // search, and going through them visits fields in the order they're serialized. A field that
+    // isn't here reads as the template value its caller passes in, which is what a dense message
+    // would have started it out as.
+    //
+    // The values belong to the message, so anything stored through a slot has to go through
+    // RB_OBJ_WRITE with the message as the owner. A slot is only good until the next field is
+    // added.
+    class SparseFields {
+    public:
+        struct Entry {
+            int number;
+            VALUE value;
+        };
+
+        typedef std::vector<Entry>::iterator iterator;
+        typedef std::vector<Entry>::const_iterator const_iterator;
+
+        VALUE get(int number, VALUE missing) const {
+            auto entry = find(number);
+            return entry != entries.end() && entry->number == number ? entry->value : missing;
+        }
+
+        // The field's value, added as initial if it isn't here yet. initial is always a template
+        // value (a GC root), so it can be stored without a write barrier.
+        VALUE* slot(int number, VALUE initial) {
+            auto entry = entries.begin() + (find(number) - entries.cbegin());
+            if (entry == entries.end() || entry->number != number) {
+                entry = entries.insert(entry, Entry{ number, initial });
+            }
+            return &entry->value;
+        }
+
+        void erase(int number) {
+            auto entry = find(number);
+            if (entry != entries.end() && entry->number == number) {
+                entries.erase(entry);
+            }
+        }
+
+        iterator begin() { return entries.begin(); }
+        iterator end() { return entries.end(); }
+        const_iterator begin() const { return entries.begin(); }
+        const_iterator end() const { return entries.end(); }
+
+        // The native memory we take up, for reporting to the GC
+        size_t memsize() const {
+            return entries.capacity() * sizeof(Entry);
+        }
+
+    private:
+        std::vector<Entry> entries;
+
+        const_iterator find(int number) const {
+            return std::lower_bound(entries.begin(), entries.end(), number, [](const Entry &entry, int number) {
+                return entry.number < number;
+            });
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,430 @@
+#include <ruby/ruby.h>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RB_FASTPROTO_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "rb_fastproto_init.h"
+#include "rb_fastproto_varint_kernels.h"
+#include "rb_fastproto_wire_format.h"
+
+namespace rb_fastproto_gen {
+    namespace {
+        // How each field type turns its values into the unsigned varint that goes on the wire, and
+        // back again. The vector kernels need to know how wide a value is, and whether it's
+        // zigzag encoded, to do the same thing a whole vector at a time.
+        struct Int32Codec {
+            typedef int32_t value_type;
+            static const int lane_bits = 32;
+            static const bool zigzag = false;
+            // Negative int32s are sign extended, so they never fit in a single byte
+            static uint64_t encode(int32_t value) { return static_cast<uint64_t>(static_cast<int64_t>(value)); }
+            static int32_t decode(uint64_t raw) { return static_cast<int32_t>(raw); }
+        };
+
+        struct Sint32Codec {
+            typedef int32_t value_type;
+            static const int lane_bits = 32;
+            static const bool zigzag = true;
+            static uint64_t encode(int32_t value) { return zigzag_encode32(value); }
+            static int32_t decode(uint64_t raw) { return zigzag_decode32(static_cast<uint32_t>(raw)); }
+        };
+
+        struct Uint32Codec {
+            typedef uint32_t value_type;
+            static const int lane_bits = 32;
+            static const bool zigzag = false;
+            static uint64_t encode(uint32_t value) { return value; }
+            static uint32_t decode(uint64_t raw) { return static_cast<uint32_t>(raw); }
+        };
+
+        struct Int64Codec {
+            typedef int64_t value_type;
+            static const int lane_bits = 64;
+            static const bool zigzag = false;
+            static uint64_t encode(int64_t value) { return static_cast<uint64_t>(value); }
+            static int64_t decode(uint64_t raw) { return static_cast<int64_t>(raw); }
+        };
+
+        struct Sint64Codec {
+            typedef int64_t value_type;
+            static const int lane_bits = 64;
+            static const bool zigzag = true;
+            static uint64_t encode(int64_t value) { return zigzag_encode64(value); }
+            static int64_t decode(uint64_t raw) { return zigzag_decode64(raw); }
+        };
+
+        struct Uint64Codec {
+            typedef uint64_t value_type;
+            static const int lane_bits = 64;
+            static const bool zigzag = false;
+            static uint64_t encode(uint64_t value) { return value; }
+            static uint64_t decode(uint64_t raw) { return raw; }
+        };
+
+        // The plain kernels, which every CPU can run. The vector kernels fall back to these for
+        // anything that isn't a run of single byte values.
+        template <typename Codec>
+        size_t scalar_size(const typename Codec::value_type* values, size_t count) {
+            size_t size = 0;
+            for (size_t i = 0; i < count; i++) {
+                size += varint_size(Codec::encode(values[i]));
+            }
+            return size;
+        }
+
+        template <typename Codec>
+        uint8_t* scalar_write(uint8_t* target, const typename Codec::value_type* values, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                target = write_varint(target, Codec::encode(values[i]));
+            }
+            return target;
+        }
+
+        template <typename Codec>
+        const uint8_t* scalar_read(const uint8_t* ptr, const uint8_t* end, std::vector<typename Codec::value_type>* values) {
+            while (ptr < end) {
+                uint64_t raw;
+                ptr = read_varint(ptr, end, &raw);
+                if (ptr == nullptr) {
+                    return nullptr;
+                }
+                values->push_back(Codec::decode(raw));
+            }
+            return ptr;
+        }
+
+        const VarintKernels scalar_kernels = {
+            "scalar",
+            { &scalar_size<Int32Codec>, &scalar_write<Int32Codec>, &scalar_read<Int32Codec> },
+            { &scalar_size<Sint32Codec>, &scalar_write<Sint32Codec>, &scalar_read<Sint32Codec> },
+            { &scalar_size<Uint32Codec>, &scalar_write<Uint32Codec>, &scalar_read<Uint32Codec> },
+            { &scalar_size<Int64Codec>, &scalar_write<Int64Codec>, &scalar_read<Int64Codec> },
+            { &scalar_size<Sint64Codec>, &scalar_write<Sint64Codec>, &scalar_read<Sint64Codec> },
+            { &scalar_size<Uint64Codec>, &scalar_write<Uint64Codec>, &scalar_read<Uint64Codec> },
+        };
+
+#ifdef RB_FASTPROTO_X86_KERNELS
+        // The vector kernels are compiled for their instruction set whatever the compiler flags
+        // are, and only ever called once the CPU has been checked for it.
+#define RB_FASTPROTO_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define RB_FASTPROTO_TARGET_AVX2 __attribute__((target("avx2")))
+
+        static inline uint32_t load_uint32(const uint8_t* bytes) {
+            uint32_t value;
+            std::memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        static inline uint16_t load_uint16(const uint8_t* bytes) {
+            uint16_t value;
+            std::memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        // SSE4.1: 4 32 bit or 2 64 bit values per vector, and 16 bytes at a time when reading
+
+        // Loads a vector of values as their (zigzag encoded, if need be) wire values
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 inline __m128i sse41_load_wire(const typename Codec::value_type* values) {
+            __m128i lanes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values));
+            if (!Codec::zigzag) {
+                return lanes;
+            }
+            if (Codec::lane_bits == 32) {
+                return _mm_xor_si128(_mm_slli_epi32(lanes, 1), _mm_srai_epi32(lanes, 31));
+            }
+            // There's no 64 bit arithmetic shift, so spread the sign of each high half instead
+            __m128i sign = _mm_shuffle_epi32(_mm_srai_epi32(lanes, 31), _MM_SHUFFLE(3, 3, 1, 1));
+            return _mm_xor_si128(_mm_slli_epi64(lanes, 1), sign);
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 inline bool sse41_all_single_byte(__m128i lanes) {
+            __m128i high_bits = Codec::lane_bits == 32 ? _mm_set1_epi32(~0x7F) : _mm_set1_epi64x(~0x7FLL);
+            return _mm_testz_si128(lanes, high_bits);
+        }
+
+        // Writes the low byte of every lane
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 inline uint8_t* sse41_write_single_bytes(uint8_t* target, __m128i lanes) {
+            if (Codec::lane_bits == 32) {
+                __m128i gathered = _mm_shuffle_epi8(lanes, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+                uint32_t bytes = static_cast<uint32_t>(_mm_cvtsi128_si32(gathered));
+                std::memcpy(target, &bytes, 4);
+                return target + 4;
+            }
+            __m128i gathered = _mm_shuffle_epi8(lanes, _mm_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+            uint16_t bytes = static_cast<uint16_t>(_mm_cvtsi128_si32(gathered));
+            std::memcpy(target, &bytes, 2);
+            return target + 2;
+        }
+
+        // Widens 16 single byte varints into values
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 inline void sse41_widen(const uint8_t* bytes, typename Codec::value_type* values) {
+            const size_t lanes = 16 / sizeof(typename Codec::value_type);
+            for (size_t i = 0; i < 16; i += lanes) {
+                __m128i widened;
+                if (Codec::lane_bits == 32) {
+                    widened = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(load_uint32(bytes + i))));
+                } else {
+                    widened = _mm_cvtepu8_epi64(_mm_cvtsi32_si128(load_uint16(bytes + i)));
+                }
+                if (Codec::zigzag) {
+                    __m128i one = Codec::lane_bits == 32 ? _mm_set1_epi32(1) : _mm_set1_epi64x(1);
+                    __m128i negate = Codec::lane_bits == 32 ?
+                        _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(widened, one)) :
+                        _mm_sub_epi64(_mm_setzero_si128(), _mm_and_si128(widened, one));
+                    __m128i halved = Codec::lane_bits == 32 ? _mm_srli_epi32(widened, 1) : _mm_srli_epi64(widened, 1);
+                    widened = _mm_xor_si128(halved, negate);
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), widened);
+            }
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 size_t sse41_size(const typename Codec::value_type* values, size_t count) {
+            const size_t lanes = 16 / sizeof(typename Codec::value_type);
+            size_t size = 0;
+            size_t i = 0;
+            for (; i + lanes <= count; i += lanes) {
+                if (sse41_all_single_byte<Codec>(sse41_load_wire<Codec>(values + i))) {
+                    size += lanes;
+                } else {
+                    size += scalar_size<Codec>(values + i, lanes);
+                }
+            }
+            return size + scalar_size<Codec>(values + i, count - i);
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 uint8_t* sse41_write(uint8_t* target, const typename Codec::value_type* values, size_t count) {
+            const size_t lanes = 16 / sizeof(typename Codec::value_type);
+            size_t i = 0;
+            for (; i + lanes <= count; i += lanes) {
+                __m128i wire = sse41_load_wire<Codec>(values + i);
+                if (sse41_all_single_byte<Codec>(wire)) {
+                    target = sse41_write_single_bytes<Codec>(target, wire);
+                } else {
+                    target = scalar_write<Codec>(target, values + i, lanes);
+                }
+            }
+            return scalar_write<Codec>(target, values + i, count - i);
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_SSE41 const uint8_t* sse41_read(const uint8_t* ptr, const uint8_t* end, std::vector<typename Codec::value_type>* values) {
+            while (end - ptr >= 16) {
+                unsigned continuation = static_cast<unsigned>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr))));
+                if (continuation == 0) {
+                    size_t old_size = values->size();
+                    values->resize(old_size + 16);
+                    sse41_widen<Codec>(ptr, values->data() + old_size);
+                    ptr += 16;
+                    continue;
+                }
+                // Take the single byte values up to the first longer one, then read that one
+                const uint8_t* longer = ptr + __builtin_ctz(continuation);
+                for (; ptr < longer; ptr++) {
+                    values->push_back(Codec::decode(*ptr));
+                }
+                uint64_t raw;
+                ptr = read_varint(ptr, end, &raw);
+                if (ptr == nullptr) {
+                    return nullptr;
+                }
+                values->push_back(Codec::decode(raw));
+            }
+            return scalar_read<Codec>(ptr, end, values);
+        }
+
+        const VarintKernels sse41_kernels = {
+            "sse4.1",
+            { &sse41_size<Int32Codec>, &sse41_write<Int32Codec>, &sse41_read<Int32Codec> },
+            { &sse41_size<Sint32Codec>, &sse41_write<Sint32Codec>, &sse41_read<Sint32Codec> },
+            { &sse41_size<Uint32Codec>, &sse41_write<Uint32Codec>, &sse41_read<Uint32Codec> },
+            { &sse41_size<Int64Codec>, &sse41_write<Int64Codec>, &sse41_read<Int64Codec> },
+            { &sse41_size<Sint64Codec>, &sse41_write<Sint64Codec>, &sse41_read<Sint64Codec> },
+            { &sse41_size<Uint64Codec>, &sse41_write<Uint64Codec>, &sse41_read<Uint64Codec> },
+        };
+
+        // AVX2: 8 32 bit or 4 64 bit values per vector, and 32 bytes at a time when reading
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 inline __m256i avx2_load_wire(const typename Codec::value_type* values) {
+            __m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+            if (!Codec::zigzag) {
+                return lanes;
+            }
+            if (Codec::lane_bits == 32) {
+                return _mm256_xor_si256(_mm256_slli_epi32(lanes, 1), _mm256_srai_epi32(lanes, 31));
+            }
+            __m256i sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), lanes);
+            return _mm256_xor_si256(_mm256_slli_epi64(lanes, 1), sign);
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 inline bool avx2_all_single_byte(__m256i lanes) {
+            __m256i high_bits = Codec::lane_bits == 32 ? _mm256_set1_epi32(~0x7F) : _mm256_set1_epi64x(~0x7FLL);
+            return _mm256_testz_si256(lanes, high_bits);
+        }
+
+        // Writes the low byte of every lane. The shuffle can't cross the two 128 bit halves, so
+        // each half gathers its own bytes and they're written one after the other.
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 inline uint8_t* avx2_write_single_bytes(uint8_t* target, __m256i lanes) {
+            const size_t half_lanes = Codec::lane_bits == 32 ? 4 : 2;
+            __m256i gathered = Codec::lane_bits == 32 ?
+                _mm256_shuffle_epi8(lanes, _mm256_setr_epi8(
+                    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)) :
+                _mm256_shuffle_epi8(lanes, _mm256_setr_epi8(
+                    0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+            uint32_t low = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_castsi256_si128(gathered)));
+            uint32_t high = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_extracti128_si256(gathered, 1)));
+            std::memcpy(target, &low, half_lanes);
+            std::memcpy(target + half_lanes, &high, half_lanes);
+            return target + 2 * half_lanes;
+        }
+
+        // Widens 32 single byte varints into values
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 inline void avx2_widen(const uint8_t* bytes, typename Codec::value_type* values) {
+            const size_t lanes = 32 / sizeof(typename Codec::value_type);
+            for (size_t i = 0; i < 32; i += lanes) {
+                __m256i widened;
+                if (Codec::lane_bits == 32) {
+                    widened = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(bytes + i)));
+                } else {
+                    widened = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(static_cast<int>(load_uint32(bytes + i))));
+                }
+                if (Codec::zigzag) {
+                    __m256i one = Codec::lane_bits == 32 ? _mm256_set1_epi32(1) : _mm256_set1_epi64x(1);
+                    __m256i negate = Codec::lane_bits == 32 ?
+                        _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(widened, one)) :
+                        _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_and_si256(widened, one));
+                    __m256i halved = Codec::lane_bits == 32 ? _mm256_srli_epi32(widened, 1) : _mm256_srli_epi64(widened, 1);
+                    widened = _mm256_xor_si256(halved, negate);
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i), widened);
+            }
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 size_t avx2_size(const typename Codec::value_type* values, size_t count) {
+            const size_t lanes = 32 / sizeof(typename Codec::value_type);
+            size_t size = 0;
+            size_t i = 0;
+            for (; i + lanes <= count; i += lanes) {
+                if (avx2_all_single_byte<Codec>(avx2_load_wire<Codec>(values + i))) {
+                    size += lanes;
+                } else {
+                    size += scalar_size<Codec>(values + i, lanes);
+                }
+            }
+            return size + scalar_size<Codec>(values + i, count - i);
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 uint8_t* avx2_write(uint8_t* target, const typename Codec::value_type* values, size_t count) {
+            const size_t lanes = 32 / sizeof(typename Codec::value_type);
+            size_t i = 0;
+            for (; i + lanes <= count; i += lanes) {
+                __m256i wire = avx2_load_wire<Codec>(values + i);
+                if (avx2_all_single_byte<Codec>(wire)) {
+                    target = avx2_write_single_bytes<Codec>(target, wire);
+                } else {
+                    target = scalar_write<Codec>(target, values + i, lanes);
+                }
+            }
+            return scalar_write<Codec>(target, values + i, count - i);
+        }
+
+        template <typename Codec>
+        RB_FASTPROTO_TARGET_AVX2 const uint8_t* avx2_read(const uint8_t* ptr, const uint8_t* end, std::vector<typename Codec::value_type>* values) {
+            while (end - ptr >= 32) {
+                unsigned continuation = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr))));
+                if (continuation == 0) {
+                    size_t old_size = values->size();
+                    values->resize(old_size + 32);
+                    avx2_widen<Codec>(ptr, values->data() + old_size);
+                    ptr += 32;
+                    continue;
+                }
+                const uint8_t* longer = ptr + __builtin_ctz(continuation);
+                for (; ptr < longer; ptr++) {
+                    values->push_back(Codec::decode(*ptr));
+                }
+                uint64_t raw;
+                ptr = read_varint(ptr, end, &raw);
+                if (ptr == nullptr) {
+                    return nullptr;
+                }
+                values->push_back(Codec::decode(raw));
+            }
+            return scalar_read<Codec>(ptr, end, values);
+        }
+
+        const VarintKernels avx2_kernels = {
+            "avx2",
+            { &avx2_size<Int32Codec>, &avx2_write<Int32Codec>, &avx2_read<Int32Codec> },
+            { &avx2_size<Sint32Codec>, &avx2_write<Sint32Codec>, &avx2_read<Sint32Codec> },
+            { &avx2_size<Uint32Codec>, &avx2_write<Uint32Codec>, &avx2_read<Uint32Codec> },
+            { &avx2_size<Int64Codec>, &avx2_write<Int64Codec>, &avx2_read<Int64Codec> },
+            { &avx2_size<Sint64Codec>, &avx2_write<Sint64Codec>, &avx2_read<Sint64Codec> },
+            { &avx2_size<Uint64Codec>, &avx2_write<Uint64Codec>, &avx2_read<Uint64Codec> },
+        };
+#endif
+
+        // The kernels this CPU can run, best first
+        std::vector<const VarintKernels*> supported_varint_kernels;
+    }
+
+    std::atomic<const VarintKernels*> active_varint_kernels(&scalar_kernels);
+
+    static VALUE fastproto_varint_kernels(VALUE self) {
+        return rb_str_new_cstr(varint_kernels().name);
+    }
+
+    static VALUE fastproto_available_varint_kernels(VALUE self) {
+        VALUE names = rb_ary_new();
+        for (auto kernels : supported_varint_kernels) {
+            rb_ary_push(names, rb_str_new_cstr(kernels->name));
+        }
+        return names;
+    }
+
+    // Mostly useful for checking that every set of kernels gives the same answers
+    static VALUE fastproto_set_varint_kernels(VALUE self, VALUE name) {
+        VALUE name_string = rb_obj_as_string(name);
+        for (auto kernels : supported_varint_kernels) {
+            if (std::strcmp(kernels->name, StringValueCStr(name_string)) == 0) {
+                active_varint_kernels.store(kernels, std::memory_order_relaxed);
+                return name;
+            }
+        }
+        rb_raise(rb_eArgError, "Unknown or unsupported varint kernels: %s", StringValueCStr(name_string));
+    }
+
+    void define_varint_kernel_methods() {
+#ifdef RB_FASTPROTO_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            supported_varint_kernels.push_back(&avx2_kernels);
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            supported_varint_kernels.push_back(&sse41_kernels);
+        }
+#endif
+        supported_varint_kernels.push_back(&scalar_kernels);
+        active_varint_kernels.store(supported_varint_kernels.front(), std::memory_order_relaxed);
+
+        rb_define_singleton_method(rb_fastproto_module, "varint_kernels", RUBY_METHOD_FUNC(&fastproto_varint_kernels), 0);
+        rb_define_singleton_method(rb_fastproto_module, "varint_kernels=", RUBY_METHOD_FUNC(&fastproto_set_varint_kernels), 1);
+        rb_define_singleton_method(rb_fastproto_module, "available_varint_kernels", RUBY_METHOD_FUNC(&fastproto_available_varint_kernels), 0);
+    }
+}
@@ -0,0 +1,45 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifndef __RB_FASTPROTO_VARINT_KERNELS_H
+#define __RB_FASTPROTO_VARINT_KERNELS_H
+
+namespace rb_fastproto_gen {
+    // Bulk encoders & decoders for whole runs of varints, which the generated code uses for
+    // repeated integer fields whose values are kept natively (see rb_fastproto_repeated_scalar.h).
+    // size and write work the same way as the single value helpers in rb_fastproto_wire_format.h.
+    // read appends every value up to end to values, and returns nullptr if the input is malformed.
+    template <typename T>
+    struct VarintKernelOps {
+        size_t (*size)(const T* values, size_t count);
+        uint8_t* (*write)(uint8_t* target, const T* values, size_t count);
+        const uint8_t* (*read)(const uint8_t* ptr, const uint8_t* end, std::vector<T>* values);
+    };
+
+    // One set of kernels per field type. There is a plain C++ set, and on x86 an SSE4.1 and an
+    // AVX2 set, which take runs of small (single byte) values a vector at a time. The best one
+    // the CPU supports is picked when the extension loads.
+    struct VarintKernels {
+        const char* name;
+        VarintKernelOps<int32_t> int32;
+        VarintKernelOps<int32_t> sint32;
+        VarintKernelOps<uint32_t> uint32;
+        VarintKernelOps<int64_t> int64;
+        VarintKernelOps<int64_t> sint64;
+        VarintKernelOps<uint64_t> uint64;
+    };
+
+    extern std::atomic<const VarintKernels*> active_varint_kernels;
+
+    static inline const VarintKernels& varint_kernels() {
+        return *active_varint_kernels.load(std::memory_order_relaxed);
+    }
+
+    // Picks the kernels for this CPU, and defines Fastproto.varint_kernels,
+    // Fastproto.varint_kernels= and Fastproto.available_varint_kernels
+    void define_varint_kernel_methods();
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include <ruby/ruby.h>
+
+#include "rb_fastproto_init.h"
+#include "rb_fastproto_wire_format.h"
+
+namespace rb_fastproto_gen {
+    const uint8_t* skip_field(const uint8_t* ptr, const uint8_t* end, uint32_t tag, int depth) {
+        switch (tag & 7) {
+            case 0: {
+                uint64_t value;
+                return read_varint(ptr, end, &value);
+            }
+            case 1:
+                return end - ptr < 8 ? nullptr : ptr + 8;
+            case 2: {
+                size_t length;
+                ptr = read_length(ptr, end, &length);
+                return ptr == nullptr ? nullptr : ptr + length;
+            }
+            case 3: {
+                if (depth >= MAX_PARSE_DEPTH) {
+                    return nullptr;
+                }
+                uint32_t end_group_tag = (tag & ~7u) | 4;
+                while (true) {
+                    uint32_t inner_tag;
+                    ptr = read_tag(ptr, end, &inner_tag);
+                    if (ptr == nullptr || inner_tag == 0) {
+                        return nullptr;
+                    }
+                    if (inner_tag == end_group_tag) {
+                        return ptr;
+                    }
+                    ptr = skip_field(ptr, end, inner_tag, depth + 1);
+                    if (ptr == nullptr) {
+                        return nullptr;
+                    }
+                }
+            }
+            case 5:
+                return end - ptr < 4 ? nullptr : ptr + 4;
+            default:
+                // An end group tag with no group to end, or one of the unused wire types
+                return nullptr;
+        }
+    }
+
+    void raise_decode_error(const char* message_name) {
+        rb_raise(cls_fastproto_decode_error, "Malformed protobuf data while parsing %s", message_name);
+    }
+}
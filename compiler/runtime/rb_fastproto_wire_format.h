@@ -0,0 +1,219 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifndef __RB_FASTPROTO_WIRE_FORMAT_H
+#define __RB_FASTPROTO_WIRE_FORMAT_H
+
+namespace rb_fastproto_gen {
+    // Helpers for the generated encoders, which write the protobuf wire format straight out of
+    // the field VALUEs. Everything here writes into a buffer that the caller has already sized
+    // with the matching *_size function, so none of it does any bounds checking.
+
+    static inline size_t varint_size(uint64_t value) {
+        size_t size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    // Negative int32s are sign extended to 64 bits on the wire, so they always take 10 bytes.
+    static inline size_t varint_size_int32(int32_t value) {
+        return value < 0 ? 10 : varint_size(static_cast<uint32_t>(value));
+    }
+
+    // The fixed width types take the value only so the generated code can treat every type alike.
+    static inline size_t fixed32_size(uint32_t) {
+        return 4;
+    }
+
+    static inline size_t fixed64_size(uint64_t) {
+        return 8;
+    }
+
+    static inline size_t float_size(float) {
+        return 4;
+    }
+
+    static inline size_t double_size(double) {
+        return 8;
+    }
+
+    static inline size_t bool_size(bool) {
+        return 1;
+    }
+
+    static inline uint32_t zigzag_encode32(int32_t value) {
+        return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    }
+
+    static inline uint64_t zigzag_encode64(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static inline uint8_t* write_varint(uint8_t* target, uint64_t value) {
+        while (value >= 0x80) {
+            *target++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *target++ = static_cast<uint8_t>(value);
+        return target;
+    }
+
+    static inline uint8_t* write_varint_int32(uint8_t* target, int32_t value) {
+        return write_varint(target, static_cast<uint64_t>(static_cast<int64_t>(value)));
+    }
+
+    static inline uint8_t* write_fixed32(uint8_t* target, uint32_t value) {
+        target[0] = static_cast<uint8_t>(value);
+        target[1] = static_cast<uint8_t>(value >> 8);
+        target[2] = static_cast<uint8_t>(value >> 16);
+        target[3] = static_cast<uint8_t>(value >> 24);
+        return target + 4;
+    }
+
+    static inline uint8_t* write_fixed64(uint8_t* target, uint64_t value) {
+        target = write_fixed32(target, static_cast<uint32_t>(value));
+        return write_fixed32(target, static_cast<uint32_t>(value >> 32));
+    }
+
+    static inline uint8_t* write_float(uint8_t* target, float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return write_fixed32(target, bits);
+    }
+
+    static inline uint8_t* write_double(uint8_t* target, double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return write_fixed64(target, bits);
+    }
+
+    static inline uint8_t* write_raw(uint8_t* target, const void* data, size_t size) {
+        std::memcpy(target, data, size);
+        return target + size;
+    }
+
+    // Helpers for the generated decoders, which build the field VALUEs straight from the wire
+    // format. These all check against the end of the buffer, and return nullptr if the input
+    // is truncated or malformed, leaving it to the caller to raise.
+
+    static inline const uint8_t* read_varint(const uint8_t* ptr, const uint8_t* end, uint64_t* value) {
+        uint64_t result = 0;
+        for (int shift = 0; shift < 64 && ptr < end; shift += 7) {
+            uint8_t byte = *ptr++;
+            result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                *value = result;
+                return ptr;
+            }
+        }
+        return nullptr;
+    }
+
+    static inline const uint8_t* read_tag(const uint8_t* ptr, const uint8_t* end, uint32_t* tag) {
+        // Single byte tags (field numbers up to 15) are by far the most common
+        if (ptr < end && *ptr < 0x80) {
+            *tag = *ptr;
+            return ptr + 1;
+        }
+        uint64_t value;
+        ptr = read_varint(ptr, end, &value);
+        if (ptr == nullptr || value > UINT32_MAX) {
+            return nullptr;
+        }
+        *tag = static_cast<uint32_t>(value);
+        return ptr;
+    }
+
+    static inline const uint8_t* read_fixed32(const uint8_t* ptr, const uint8_t* end, uint32_t* value) {
+        if (end - ptr < 4) {
+            return nullptr;
+        }
+        *value = static_cast<uint32_t>(ptr[0]) |
+            (static_cast<uint32_t>(ptr[1]) << 8) |
+            (static_cast<uint32_t>(ptr[2]) << 16) |
+            (static_cast<uint32_t>(ptr[3]) << 24);
+        return ptr + 4;
+    }
+
+    static inline const uint8_t* read_fixed64(const uint8_t* ptr, const uint8_t* end, uint64_t* value) {
+        uint32_t low, high;
+        ptr = read_fixed32(ptr, end, &low);
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        ptr = read_fixed32(ptr, end, &high);
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        *value = static_cast<uint64_t>(low) | (static_cast<uint64_t>(high) << 32);
+        return ptr;
+    }
+
+    // Reads the length prefix of a length-delimited field, and checks the data fits in the buffer
+    static inline const uint8_t* read_length(const uint8_t* ptr, const uint8_t* end, size_t* length) {
+        uint64_t value;
+        ptr = read_varint(ptr, end, &value);
+        if (ptr == nullptr || value > static_cast<uint64_t>(end - ptr)) {
+            return nullptr;
+        }
+        *length = static_cast<size_t>(value);
+        return ptr;
+    }
+
+    static inline float bits_to_float(uint32_t bits) {
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static inline double bits_to_double(uint64_t bits) {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static inline int32_t zigzag_decode32(uint32_t value) {
+        return static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1));
+    }
+
+    static inline int64_t zigzag_decode64(uint64_t value) {
+        return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+    }
+
+    // Messages nested deeper than this are rejected rather than overflowing the C stack. This is
+    // the same limit libprotobuf uses by default.
+    static const int MAX_PARSE_DEPTH = 100;
+
+    // Skips over the field after tag (which has already been consumed), returning where the next
+    // one starts, or nullptr if the field is malformed. Groups are skipped as a whole, up to
+    // MAX_PARSE_DEPTH deep.
+    const uint8_t* skip_field(const uint8_t* ptr, const uint8_t* end, uint32_t tag, int depth);
+
+    // Messages keep their unknown fields as the bytes they were read as, tags and all, which are
+    // written back out verbatim. The string is only allocated once there is something to keep,
+    // since nearly every message has none.
+    static inline void append_unknown(std::string** unknown_fields, const uint8_t* start, const uint8_t* end) {
+        if (*unknown_fields == nullptr) {
+            *unknown_fields = new std::string();
+        }
+        (*unknown_fields)->append(reinterpret_cast<const char*>(start), end - start);
+    }
+
+    // Keeps a varint field as an unknown field, for enum values the enum doesn't have
+    static inline void append_unknown_varint(std::string** unknown_fields, int field_number, uint64_t value) {
+        uint8_t buffer[15];
+        uint8_t* target = write_varint(buffer, static_cast<uint64_t>(field_number) << 3);
+        target = write_varint(target, value);
+        append_unknown(unknown_fields, buffer, target);
+    }
+
+    // Raises a Fastproto::DecodeError for a message of the given type.
+    [[noreturn]] void raise_decode_error(const char* message_name);
+}
+
+#endif
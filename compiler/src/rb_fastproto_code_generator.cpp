@@ -17,6 +17,11 @@ namespace rb_fastproto {
         google::protobuf::compiler::OutputDirectory *output_directory,
         std::string *error
     ) const {
+        options = GeneratorOptions();
+        if (!parse_generator_options(parameter, &options, error)) {
+            return false;
+        }
+
         auto output_cpp_file_name = cpp_path_for_proto(file);
         boost::scoped_ptr<google::protobuf::io::ZeroCopyOutputStream> cpp_output(output_directory->Open(output_cpp_file_name));
         google::protobuf::io::Printer cpp_printer(cpp_output.get(), '$');
@@ -42,6 +47,9 @@ namespace rb_fastproto {
             "#include <ruby/ruby.h>\n"
             "#include <vector>\n"
             "#include <utility>\n"
+            "#include \"rb_fastproto_lazy.h\"\n"
+            "#include \"rb_fastproto_memory.h\"\n"
+            "#include \"rb_fastproto_sparse.h\"\n"
             "#include \"$pb_header_name$\"\n"
             "\n",
             "pb_header_name", cpp_proto_header_path_for_proto(file)
@@ -130,8 +138,16 @@ namespace rb_fastproto {
             "#include <functional>\n"
             "#include <tuple>\n"
             "#include <typeinfo>\n"
+            "#include <google/protobuf/unknown_field_set.h>\n"
             "\n"
             "#include \"rb_fastproto_init.h\"\n"
+            "#include \"rb_fastproto_wire_format.h\"\n"
+            "#include \"rb_fastproto_arena.h\"\n"
+            "#include \"rb_fastproto_repeated_scalar.h\"\n"
+            "#include \"rb_fastproto_varint_kernels.h\"\n"
+            "#include \"rb_fastproto_backing.h\"\n"
+            "#include \"rb_fastproto_map.h\"\n"
+            "#include \"rb_fastproto_batch.h\"\n"
         );
 
         for (int i = 0; i < file->dependency_count(); i++) {
@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/compiler/code_generator.h>
@@ -14,6 +15,31 @@
 #define __RB_FASTPROTO_CODE_GENERATOR
 
 namespace rb_fastproto {
+    // Options passed to the plugin as --rb-fastproto_out=<key>=<value>,...:<out_dir>
+    struct GeneratorOptions {
+        // layout=compact stores singular numeric, bool & enum fields unboxed in the message struct.
+        // They are converted (and type checked) when assigned, rather than when serialized.
+        bool compact_layout = false;
+        // repeated=native stores repeated numeric, bool & enum fields in a Fastproto::RepeatedScalar
+        // instead of an Array. They are likewise converted when assigned.
+        bool native_repeated = false;
+        // storage=cpp keeps the libprotobuf message that parse read into, and only converts each
+        // field out of it when the field is first used. Serializing writes back just the fields
+        // that have been used, and lets libprotobuf encode the rest.
+        bool cpp_storage = false;
+        // sparse=<full message name>, given once per message, stores that message's fields in a
+        // SparseFields holding only the ones that have been set, instead of a VALUE each. It suits
+        // very wide messages that only ever have a few of their fields set. Every field of a sparse
+        // message is a VALUE, whatever layout and repeated say.
+        std::set<std::string> sparse_messages;
+        // map_order=sorted writes the entries of map fields in key order, so equal maps always
+        // encode to the same bytes. map_order=insertion (the default) writes them in the order
+        // their Hash holds them, which saves sorting.
+        bool sorted_maps = false;
+    };
+
+    bool parse_generator_options(const std::string &parameter, GeneratorOptions* options, std::string* error);
+
     class RBFastProtoCodeGenerator : public ::google::protobuf::compiler::CodeGenerator {
     public:
         explicit RBFastProtoCodeGenerator();
@@ -27,6 +53,9 @@ namespace rb_fastproto {
         ) const;
 
     private:
+        // Set from the parameter at the start of each Generate()
+        mutable GeneratorOptions options;
+
         void write_header(
             const google::protobuf::FileDescriptor *file,
             google::protobuf::io::Printer &printer
@@ -101,6 +130,12 @@ namespace rb_fastproto {
             const std::string &class_name,
             google::protobuf::io::Printer &printer
         ) const;
+        void write_header_message_struct_backing(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::Descriptor* message_type,
+            const std::string &class_name,
+            google::protobuf::io::Printer &printer
+        ) const;
 
         std::string write_cpp_message_struct(
             const google::protobuf::FileDescriptor* file,
@@ -132,6 +167,12 @@ namespace rb_fastproto {
             const std::string &class_name,
             google::protobuf::io::Printer &printer
         ) const;
+        void write_cpp_message_struct_oneof_accessors(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::Descriptor* message_type,
+            const std::string &class_name,
+            google::protobuf::io::Printer &printer
+        ) const;
         void write_cpp_message_struct_dynamic_accessors(
             const google::protobuf::FileDescriptor* file,
             const google::protobuf::Descriptor* message_type,
@@ -150,13 +191,25 @@ namespace rb_fastproto {
             const std::string &class_name,
             google::protobuf::io::Printer &printer
         ) const;
-        void write_cpp_message_struct_from_proto_obj(
+        void write_cpp_message_struct_validator(
             const google::protobuf::FileDescriptor* file,
             const google::protobuf::Descriptor* message_type,
             const std::string &class_name,
             google::protobuf::io::Printer &printer
         ) const;
-        void write_cpp_message_struct_validator(
+        void write_cpp_message_struct_wire_size(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::Descriptor* message_type,
+            const std::string &class_name,
+            google::protobuf::io::Printer &printer
+        ) const;
+        void write_cpp_message_struct_wire_writer(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::Descriptor* message_type,
+            const std::string &class_name,
+            google::protobuf::io::Printer &printer
+        ) const;
+        void write_cpp_message_struct_wire_parser(
             const google::protobuf::FileDescriptor* file,
             const google::protobuf::Descriptor* message_type,
             const std::string &class_name,
@@ -168,6 +221,12 @@ namespace rb_fastproto {
             const std::string &class_name,
             google::protobuf::io::Printer &printer
         ) const;
+        void write_cpp_message_struct_deep_freeze(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::Descriptor* message_type,
+            const std::string &class_name,
+            google::protobuf::io::Printer &printer
+        ) const;
         void write_cpp_message_struct_parser(
             const google::protobuf::FileDescriptor* file,
             const google::protobuf::Descriptor* message_type,
@@ -216,6 +275,29 @@ namespace rb_fastproto {
             const std::string &class_name,
             google::protobuf::io::Printer &printer
         ) const;
+        void write_cpp_message_struct_backing(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::Descriptor* message_type,
+            const std::string &class_name,
+            google::protobuf::io::Printer &printer
+        ) const;
+
+        // message struct layout
+        bool is_native_field(const google::protobuf::FieldDescriptor* field) const;
+        bool is_native_repeated(const google::protobuf::FieldDescriptor* field) const;
+        bool has_presence_bit(const google::protobuf::FieldDescriptor* field) const;
+        int presence_bit_index(const google::protobuf::FieldDescriptor* field) const;
+        int presence_bit_count(const google::protobuf::Descriptor* message_type) const;
+        bool is_sparse(const google::protobuf::Descriptor* message_type) const;
+        bool has_field_member(const google::protobuf::FieldDescriptor* field) const;
+        std::string field_expr(const google::protobuf::FieldDescriptor* field, const std::string &prefix) const;
+        std::string field_slot_expr(const google::protobuf::FieldDescriptor* field, const std::string &prefix) const;
+        std::string field_value_expr(const google::protobuf::FieldDescriptor* field, const std::string &prefix) const;
+        std::string template_value_expr(const google::protobuf::FieldDescriptor* field) const;
+        std::string map_entry_fill_op(
+            const google::protobuf::FileDescriptor* file,
+            const google::protobuf::FieldDescriptor* field
+        ) const;
 
         // service code
 
@@ -314,6 +396,7 @@ namespace rb_fastproto {
     std::string cpp_proto_header_path_for_proto(const google::protobuf::FileDescriptor* proto_file);
     std::string cpp_path_for_proto(const google::protobuf::FileDescriptor* proto_file);
     std::string cpp_proto_class_name(const google::protobuf::Descriptor* message_type);
+    std::string cpp_proto_enum_class_name(const google::protobuf::EnumDescriptor* enum_type);
     std::string cpp_proto_descriptor_name(const google::protobuf::Descriptor* message_type);
     std::string ruby_proto_enum_class_name(const google::protobuf::EnumDescriptor* message_type);
     std::string ruby_proto_enum_class_name_no_ns(const google::protobuf::EnumDescriptor* message_type);
@@ -331,6 +414,19 @@ namespace rb_fastproto {
     std::string cpp_proto_method_wrapper_struct_name(const google::protobuf::MethodDescriptor* method);
     std::string cpp_proto_method_wrapper_struct_name_no_ns(const google::protobuf::MethodDescriptor* method);
     std::string cpp_field_name(const google::protobuf::FieldDescriptor* field);
+    int wire_type_for_field(const google::protobuf::FieldDescriptor* field);
+    int element_wire_type_for_field(const google::protobuf::FieldDescriptor* field);
+    std::vector<uint8_t> wire_tag_bytes(int field_number, int wire_type);
+    bool has_fixed_wire_size(const google::protobuf::FieldDescriptor* field);
+    bool is_lazy_field(const google::protobuf::FieldDescriptor* field);
+    bool has_lazy_fields(const google::protobuf::Descriptor* message_type);
+    bool has_map_fields(const google::protobuf::Descriptor* message_type);
+    std::string native_type_for_field(const google::protobuf::FieldDescriptor* field);
+    size_t native_size_for_field(const google::protobuf::FieldDescriptor* field);
+    std::string native_to_value(const google::protobuf::FieldDescriptor* field, const std::string &native);
+    std::string value_to_native(const google::protobuf::FieldDescriptor* field, const std::string &value);
+    bool has_static_default(const google::protobuf::FieldDescriptor* field);
+    std::string declared_default_value(const google::protobuf::FieldDescriptor* field);
 }
 
 #endif
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <functional>
 #include <iostream>
 
 #include <boost/algorithm/string.hpp>
@@ -25,8 +27,23 @@ namespace rb_fastproto {
             "// Keep this so we know whether to delete a char array of memory, or delete the object\n"
             "// (thereby invoking its destructor)\n"
             "bool have_initialized;\n"
+            "// Whether we're inside our Ruby object, which frees us along with itself\n"
+            "bool embedded;\n"
             "static VALUE rb_cls;\n"
+            "// Write barrier protected, so a VALUE stored in any of our fields has to go through\n"
+            "// RB_OBJ_WRITE, with rb_self (the object wrapping us) as the owner.\n"
+            "static const rb_data_type_t rb_data_type;\n"
+            "VALUE rb_self;\n"
+            "// A frozen message with every field at its default. Required fields of this type start\n"
+            "// out as it, and frozen messages hand it out for unset fields of this type. Made on\n"
+            "// first use by default_instance().\n"
+            "static VALUE shared_default;\n"
             "bool is_default_value;\n"
+            "// While we are a default value faulted in by a parent message, the first change to one of\n"
+            "// our fields is passed up to notify_parent, so the parent can mark that field as set.\n"
+            "VALUE parent;\n"
+            "void (*notify_parent)(VALUE parent, VALUE child, int field_number);\n"
+            "int parent_field_number;\n"
         );
         // Write fields for the message field
         write_header_message_struct_fields(file, message_type, class_name, printer);
@@ -36,9 +53,14 @@ namespace rb_fastproto {
             "\n\n"
             "// The default constructor will make a default message.\n"
             "$class_name$(VALUE rb_self);\n"
-            "~$class_name$() = default;\n"
+            "~$class_name$() {\n"
+            "    adjust_native_memory(&memory_stats, &native_reported, 0);\n"
+            "    delete unknown_fields;\n"
+            "    delete lazy_fields;$delete_backing$\n"
+            "}\n"
             "\n",
-            "class_name", class_name
+            "class_name", class_name,
+            "delete_backing", options.cpp_storage ? " delete backing;" : ""
         );
 
         // Static methods...
@@ -48,12 +70,16 @@ namespace rb_fastproto {
             "static VALUE alloc(VALUE self);\n"
             "static VALUE alloc();\n"
             "static VALUE initialize(int argc, VALUE* argv, VALUE self);\n"
-            "static void free(char* memory);\n"
-            "static void mark(char* memory);\n"
+            "static void free(void* memory);\n"
+            "static void mark(void* memory);\n"
+            "static void compact(void* memory);\n"
+            "static size_t memsize(const void* memory);\n"
             "\n"
             "static VALUE validate(VALUE self);\n"
             "static VALUE serialize_to_string(VALUE self);\n"
             "static VALUE serialize_to_string_with_gvl(VALUE self);\n"
+            "static VALUE byte_size(VALUE self);\n"
+            "static VALUE deep_freeze(VALUE self);\n"
             "static VALUE parse(VALUE self, VALUE buffer);\n"
             "static VALUE value_for_tag(VALUE self, VALUE tag);\n"
             "static VALUE set_value_for_tag(VALUE self, VALUE tag, VALUE val);\n"
@@ -61,24 +87,44 @@ namespace rb_fastproto {
             "static VALUE get_nested(int argc, VALUE* argv, VALUE self);\n"
             "static VALUE get_nested_bang(int argc, VALUE* argv, VALUE self);\n"
             "static VALUE notify_default_changed(VALUE self, VALUE sender, VALUE notify_tag);\n"
+            "static void notify_field_changed(VALUE self, VALUE child, int field_number);\n"
             "static VALUE equal_to(VALUE self, VALUE other);\n"
             "static VALUE inspect(VALUE self);\n"
             "static VALUE to_hash(VALUE self);\n"
             "static VALUE singleton_parse(VALUE self, VALUE buffer);\n"
+            "static VALUE singleton_parse_shared(VALUE self, VALUE buffer);\n"
+            "static VALUE singleton_parse_lazy(VALUE self, VALUE buffer);\n"
+            "static VALUE singleton_serialize_many(VALUE self, VALUE messages);\n"
+            "static VALUE singleton_serialize_many_delimited(VALUE self, VALUE messages);\n"
+            "static VALUE serialize_many(VALUE messages, bool delimited);\n"
             "static VALUE singleton_field_for_name(VALUE self, VALUE name);\n"
             "static VALUE singleton_fields(VALUE self);\n"
             "static VALUE singleton_fully_qualified_name(VALUE self);\n"
             "\n"
             "VALUE to_proto_obj($cpp_proto_class$* cpp_proto);\n"
-            "VALUE from_proto_obj(const $cpp_proto_class$& cpp_proto);\n",
+            "void fill_proto_obj($cpp_proto_class$* cpp_proto);\n"
+            "size_t fixed_wire_size();\n"
+            "size_t compute_wire_size();\n"
+            "uint8_t* write_wire(uint8_t* target);\n"
+            "void mark_changed(VALUE self);\n"
+            "static VALUE new_for_parse();\n"
+            "static VALUE default_instance();\n"
+            "const uint8_t* parse_wire(const uint8_t* ptr, const uint8_t* end, uint32_t end_group_tag, int depth, VALUE source);\n"
+            "void parse_lazy_wire(const uint8_t* ptr, const uint8_t* end, VALUE source);\n"
+            "void decode_lazy(int field_number);\n"
+            "void drop_lazy(int field_number);\n",
             "cpp_proto_class", cpp_proto_class_name(message_type)
         );
 
         // various methods defined for each protobuf field, like getters & setters
         write_header_message_struct_accessors(file, message_type, class_name, printer);
 
-        // Define any submessages
+        // Define any submessages. Map fields hold their entries in a Hash, so the entry messages
+        // protoc makes for them are left out.
         for (int i = 0; i < message_type->nested_type_count(); i++ ) {
+            if (message_type->nested_type(i)->options().map_entry()) {
+                continue;
+            }
             write_header_message_struct_definition(file, message_type->nested_type(i), printer);
         }
 
@@ -92,21 +138,159 @@ namespace rb_fastproto {
         const std::string &class_name,
         google::protobuf::io::Printer &printer
     ) const {
-        // Write a VALUE for each field to store the ruby-version of it.
-        // Also a bool to store whether or not it is set.
+        // Write a VALUE for each field to store the ruby-version of it. In the compact layout,
+        // scalar fields are stored natively instead, after the VALUEs, largest first so the
+        // struct doesn't need any padding. Sparse messages keep all of their VALUEs in sparse_fields.
+        std::vector<const google::protobuf::FieldDescriptor*> native_fields;
+        if (is_sparse(message_type)) {
+            printer.Print("SparseFields sparse_fields;\n");
+        }
         for (int j = 0; j < message_type->field_count(); j++) {
             auto field = message_type->field(j);
 
-            printer.Print("VALUE field_$field_name$;\n", "field_name", cpp_field_name(field));
-            if (field->is_optional()) {
-                printer.Print("bool has_field_$field_name$;\n", "field_name", cpp_field_name(field));
+            if (is_native_field(field)) {
+                native_fields.push_back(field);
+            } else if (has_field_member(field)) {
+                printer.Print("VALUE field_$field_name$;\n", "field_name", cpp_field_name(field));
+            }
+        }
+        // Each oneof has one VALUE for whichever of its fields is set, and that field's number (or
+        // 0 when none is). Switching to another field starts it out as its template value, which
+        // is a GC root, so select_oneof_* doesn't need a write barrier.
+        for (int j = 0; j < message_type->real_oneof_decl_count(); j++) {
+            printer.Print(
+                "VALUE oneof_$oneof_name$;\n"
+                "int oneof_case_$oneof_name$;\n"
+                "VALUE* select_oneof_$oneof_name$(int number, VALUE initial) {\n"
+                "    if (oneof_case_$oneof_name$ != number) {\n"
+                "        oneof_case_$oneof_name$ = number;\n"
+                "        oneof_$oneof_name$ = initial;\n"
+                "    }\n"
+                "    return &oneof_$oneof_name$;\n"
+                "}\n"
+                "void clear_oneof_$oneof_name$() {\n"
+                "    oneof_case_$oneof_name$ = 0;\n"
+                "    oneof_$oneof_name$ = Qnil;\n"
+                "}\n",
+                "oneof_name", message_type->oneof_decl(j)->name()
+            );
+        }
+        std::stable_sort(native_fields.begin(), native_fields.end(), [](
+            const google::protobuf::FieldDescriptor* a,
+            const google::protobuf::FieldDescriptor* b
+        ) {
+            return native_size_for_field(a) > native_size_for_field(b);
+        });
+        // Whether or not each optional field is set is stored in a bitset, with an accessor for
+        // each field. It goes before any bools, again to save on padding.
+        int bit_count = presence_bit_count(message_type);
+        bool printed_has_bits = bit_count == 0;
+        for (auto field : native_fields) {
+            if (!printed_has_bits && native_size_for_field(field) < 4) {
+                printer.Print("uint32_t has_bits[$words$];\n", "words", std::to_string((bit_count + 31) / 32));
+                printed_has_bits = true;
+            }
+            printer.Print(
+                "$native_type$ field_$field_name$;\n",
+                "native_type", native_type_for_field(field),
+                "field_name", cpp_field_name(field)
+            );
+        }
+        if (!printed_has_bits) {
+            printer.Print("uint32_t has_bits[$words$];\n", "words", std::to_string((bit_count + 31) / 32));
+        }
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+            if (!has_presence_bit(field)) {
+                continue;
             }
+
+            auto oneof = field->real_containing_oneof();
+            if (oneof != nullptr) {
+                printer.Print(
+                    "bool has_field_$field_name$() const { return oneof_case_$oneof_name$ == $field_number$; }\n"
+                    "void set_has_field_$field_name$(bool value) {\n"
+                    "    if (value) { select_oneof_$oneof_name$($field_number$, $default$); } else if (has_field_$field_name$()) { clear_oneof_$oneof_name$(); }\n"
+                    "}\n",
+                    "field_name", cpp_field_name(field),
+                    "field_number", std::to_string(field->number()),
+                    "oneof_name", oneof->name(),
+                    "default", template_value_expr(field)
+                );
+                continue;
+            }
+
+            int bit = presence_bit_index(field);
+            printer.Print(
+                "bool has_field_$field_name$() const { return (has_bits[$word$] & $mask$) != 0; }\n"
+                "void set_has_field_$field_name$(bool value) {\n"
+                "    if (value) { has_bits[$word$] |= $mask$; } else { has_bits[$word$] &= ~$mask$; }\n"
+                "}\n",
+                "field_name", cpp_field_name(field),
+                "word", std::to_string(bit / 32),
+                "mask", std::to_string(1u << (bit % 32)) + "u"
+            );
+        }
+
+        // Add storage for unknown fields: the bytes they were parsed from, or nullptr if there
+        // weren't any. Note that this is not exposed to ruby, except if you deserialize unknown
+        // fields, they will be serialized again.
+        printer.Print("std::string* unknown_fields;\n");
+
+        // Each compute_wire_size() leaves its result here, so a parent can write our length prefix
+        printer.Print("size_t cached_size;\n");
+
+        // The size of the fields only a setter can change, which fixed_wire_size() keeps until then
+        printer.Print(
+            "size_t fixed_size;\n"
+            "bool fixed_size_valid;\n"
+        );
+
+        // Once deep_freeze has frozen us and everything we hold, nothing can change our encoding,
+        // so the first serialize_to_string keeps it in encoded (as a frozen String) for next time
+        printer.Print(
+            "bool frozen_tree;\n"
+            "VALUE encoded;\n"
+        );
+
+        // Message fields that parse_lazy has found but not yet decoded, or nullptr if there are none
+        printer.Print("LazyFields* lazy_fields;\n");
+
+        if (options.cpp_storage) {
+            write_header_message_struct_backing(file, message_type, class_name, printer);
         }
 
-        // Add storage for unknown fields
-        // Note that this is not exposed to ruby, except if you deserialize unknown fields,
-        // they will be serialized again.
-        printer.Print("google::protobuf::UnknownFieldSet unknown_fields;\n");
+        // How much native memory (unknown fields, lazy spans, sparse fields, backing) we have told the GC about
+        printer.Print(
+            "static MessageMemoryStats memory_stats;\n"
+            "size_t native_reported;\n"
+            "size_t native_size() const;\n"
+            "void report_native_memory() { adjust_native_memory(&memory_stats, &native_reported, native_size()); }\n"
+        );
+
+        // Symbols and IDs for each field, resolved once in initialize_class() so the hot paths
+        // never have to look a name up.
+        for (int j = 0; j < message_type->field_count(); j++) {
+            printer.Print(
+                "static VALUE sym_$field_name$;\n"
+                "static ID id_set_$field_name$;\n"
+                "static ID id_has_$field_name$;\n",
+                "field_name", cpp_field_name(message_type->field(j))
+            );
+        }
+
+        // Each scalar field's default, which new messages copy in.
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+            if (!has_static_default(field)) {
+                continue;
+            }
+            printer.Print(
+                "static $type$ default_$field_name$;\n",
+                "type", is_native_field(field) ? native_type_for_field(field) : "VALUE",
+                "field_name", cpp_field_name(field)
+            );
+        }
     }
 
     void RBFastProtoCodeGenerator::write_header_message_struct_accessors(
@@ -118,18 +302,27 @@ namespace rb_fastproto {
         for (int j = 0; j < message_type->field_count(); j++) {
             auto field = message_type->field(j);
 
-            // Every method needs a getter, setter, and a factory for constructing a default
+            // Every method needs a getter & setter. Repeated & message fields also need a factory
+            // for the array or message they get on first read.
             printer.Print(
                 "static VALUE get_$field_name$(VALUE self);\n"
                 "static VALUE set_$field_name$(VALUE self, VALUE val);\n"
-                "static VALUE has_$field_name$(VALUE self);\n"
-                "static VALUE default_factory_$field_name$(VALUE self, bool constructor);\n"
-                "\n",
+                "static VALUE has_$field_name$(VALUE self);\n",
                 "field_name", cpp_field_name(field)
             );
+            if (!has_static_default(field)) {
+                printer.Print("static VALUE default_factory_$field_name$(VALUE self);\n", "field_name", cpp_field_name(field));
+            }
+            printer.Print("\n");
 
             printer.Print("\n");
         }
+        for (int j = 0; j < message_type->real_oneof_decl_count(); j++) {
+            printer.Print(
+                "static VALUE which_oneof_$oneof_name$(VALUE self);\n",
+                "oneof_name", message_type->oneof_decl(j)->name()
+            );
+        }
     }
 
     std::string RBFastProtoCodeGenerator::write_cpp_message_struct(
@@ -158,18 +351,23 @@ namespace rb_fastproto {
         write_cpp_message_struct_default_factories(file, message_type, class_name, printer);
         // Static accessors for each field, so ruby can call them
         write_cpp_message_struct_accessors(file, message_type, class_name, printer);
+        write_cpp_message_struct_oneof_accessors(file, message_type, class_name, printer);
         // Dynamic value_for_tag methods
         write_cpp_message_struct_dynamic_accessors(file, message_type, class_name, printer);
-        // to and from proto object conversion
+        // to proto object conversion
         write_cpp_message_struct_to_proto_obj(file, message_type, class_name, printer);
-        write_cpp_message_struct_from_proto_obj(file, message_type, class_name, printer);
         // The message needs an alloc function, and a free function, and a mark function, for ruby.
         // It also needs a static initialize method to use as a factory.
         write_cpp_message_struct_allocators(file, message_type, class_name, printer);
         // Define validation methods
         write_cpp_message_struct_validator(file, message_type, class_name, printer);
+        // Direct wire format encoding and decoding
+        write_cpp_message_struct_wire_size(file, message_type, class_name, printer);
+        write_cpp_message_struct_wire_writer(file, message_type, class_name, printer);
+        write_cpp_message_struct_wire_parser(file, message_type, class_name, printer);
         // Define serialization methods
         write_cpp_message_struct_serializer(file, message_type, class_name, printer);
+        write_cpp_message_struct_deep_freeze(file, message_type, class_name, printer);
         // Deserialization methods
         write_cpp_message_struct_parser(file, message_type, class_name, printer);
         // Equality methods
@@ -185,11 +383,50 @@ namespace rb_fastproto {
         write_cpp_message_struct_singleton_fields(file, message_type, class_name, printer);
         write_cpp_message_struct_singleton_fully_qualified_name(file, message_type, class_name, printer);
 
+        // storage=cpp's conversions to and from the backing C++ message
+        if (options.cpp_storage) {
+            write_cpp_message_struct_backing(file, message_type, class_name, printer);
+        }
+
         // For some silly reason we need to initialized its static members at translation-unit scope?
-        printer.Print("VALUE $class_name$::rb_cls = Qnil;\n", "class_name", class_name);
+        printer.Print(
+            "VALUE $class_name$::rb_cls = Qnil;\n"
+            "VALUE $class_name$::shared_default = Qnil;\n"
+            "MessageMemoryStats $class_name$::memory_stats = { 0, 0 };\n"
+            "const rb_data_type_t $class_name$::rb_data_type = {\n"
+            "    \"$message_name$\",\n"
+            "    { &mark, &free, &memsize, &compact },\n"
+            "    nullptr, nullptr,\n"
+            "    RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | TYPED_EMBEDDABLE\n"
+            "};\n",
+            "class_name", class_name,
+            "message_name", message_type->full_name()
+        );
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+            printer.Print(
+                "VALUE $class_name$::sym_$field_name$ = Qnil;\n"
+                "ID $class_name$::id_set_$field_name$ = 0;\n"
+                "ID $class_name$::id_has_$field_name$ = 0;\n",
+                "class_name", class_name,
+                "field_name", cpp_field_name(field)
+            );
+            if (has_static_default(field)) {
+                printer.Print(
+                    "$type$ $class_name$::default_$field_name$ = $zero$;\n",
+                    "type", is_native_field(field) ? native_type_for_field(field) : "VALUE",
+                    "class_name", class_name,
+                    "field_name", cpp_field_name(field),
+                    "zero", is_native_field(field) ? "0" : "Qnil"
+                );
+            }
+        }
 
         // Write the implementation for all submessages to
         for (int i = 0; i < message_type->nested_type_count(); i++ ) {
+            if (message_type->nested_type(i)->options().map_entry()) {
+                continue;
+            }
             write_cpp_message_struct(file, message_type->nested_type(i), printer);
         }
 
@@ -213,25 +450,51 @@ namespace rb_fastproto {
     ) const {
         // Object constructor; called in ruby initialize method.
         printer.Print(
-            "$class_name$::$constructor_name$(VALUE rb_self) : have_initialized(true), is_default_value(true) { \n",
+            "$class_name$::$constructor_name$(VALUE rb_self) :\n"
+            "    have_initialized(true), embedded(typed_data_embedded(rb_self)), rb_self(rb_self),\n"
+            "    is_default_value(true),\n"
+            "    parent(Qnil), notify_parent(nullptr), parent_field_number(0),\n"
+            "    unknown_fields(nullptr), cached_size(0), fixed_size(0), fixed_size_valid(false),\n"
+            "    frozen_tree(false), encoded(Qnil), lazy_fields(nullptr)$backing_init$,\n"
+            "    native_reported(0) { \n",
             "class_name", class_name,
-            "constructor_name", cpp_proto_message_wrapper_struct_name_no_ns(message_type)
+            "constructor_name", cpp_proto_message_wrapper_struct_name_no_ns(message_type),
+            "backing_init", options.cpp_storage ? ",\n    backing(nullptr), serializing(0), backing_size(0)" : ""
         );
 
-        // Initialize each field in the constructor.
+        // Initialize each field in the constructor. These are all copies of defaults that were
+        // made ahead of time, so nothing gets allocated here. The defaults are GC roots, so they
+        // don't need write barriers even when parse re-runs this on an old message. Sparse
+        // messages only start out holding their required fields, which are always serialized.
         printer.Indent();
         for (int j = 0; j < message_type->field_count(); j++) {
             auto field = message_type->field(j);
 
-            // Set the default value appropriately
+            if (field->real_containing_oneof() != nullptr) {
+                continue;
+            } else if (is_sparse(message_type)) {
+                if (field->is_required()) {
+                    printer.Print("$slot$;\n", "slot", field_slot_expr(field, ""));
+                }
+                continue;
+            }
             printer.Print(
-                "field_$field_name$ = default_factory_$field_name$(rb_self, true);\n",
-                "field_name", cpp_field_name(field)
+                "field_$field_name$ = $default$;\n",
+                "field_name", cpp_field_name(field),
+                "default", template_value_expr(field)
             );
+        }
+        for (int j = 0; j < message_type->real_oneof_decl_count(); j++) {
+            printer.Print("clear_oneof_$oneof_name$();\n", "oneof_name", message_type->oneof_decl(j)->name());
+        }
 
-            // If the field is optional, we need to set the has or not status of it
-            if (field->is_optional()) {
-                printer.Print("has_field_$field_name$ = false;\n", "field_name", cpp_field_name(field));
+        // Nothing is set to start with
+        for (int word = 0; word < (presence_bit_count(message_type) + 31) / 32; word++) {
+            printer.Print("has_bits[$word$] = 0;\n", "word", std::to_string(word));
+        }
+        if (options.cpp_storage) {
+            for (int word = 0; word < std::max(1, (message_type->field_count() + 31) / 32); word++) {
+                printer.Print("unread_bits[$word$] = 0;\n", "word", std::to_string(word));
             }
         }
         printer.Outdent();
@@ -254,12 +517,16 @@ namespace rb_fastproto {
 
         printer.Print(
             "rb_cls = rb_define_class_under($ruby_namespace$, \"$ruby_class_name$\", cls_fastproto_message);\n"
+            "rb_gc_register_address(&rb_cls);\n"
+            "register_memory_stats(rb_cls, &memory_stats);\n"
             "rb_define_alloc_func(rb_cls, &alloc);\n"
             "rb_define_method(rb_cls, \"initialize\", RUBY_METHOD_FUNC(&initialize), -1);\n"
             "rb_define_method(rb_cls, \"validate!\", RUBY_METHOD_FUNC(&validate), 0);\n"
             "rb_define_method(rb_cls, \"serialize_to_string\", RUBY_METHOD_FUNC(&serialize_to_string), 0);\n"
             "rb_define_alias(rb_cls, \"to_s\", \"serialize_to_string\");\n"
             "rb_define_method(rb_cls, \"serialize_to_string_with_gvl\", RUBY_METHOD_FUNC(&serialize_to_string_with_gvl), 0);\n"
+            "rb_define_method(rb_cls, \"byte_size\", RUBY_METHOD_FUNC(&byte_size), 0);\n"
+            "rb_define_method(rb_cls, \"deep_freeze\", RUBY_METHOD_FUNC(&deep_freeze), 0);\n"
             "rb_define_method(rb_cls, \"parse\", RUBY_METHOD_FUNC(&parse), 1);\n"
             "rb_define_method(rb_cls, \"value_for_tag\", RUBY_METHOD_FUNC(&value_for_tag), 1);\n"
             "rb_define_method(rb_cls, \"set_value_for_tag\", RUBY_METHOD_FUNC(&set_value_for_tag), 2);\n"
@@ -276,6 +543,10 @@ namespace rb_fastproto {
             "rb_define_method(rb_cls, \"fully_qualified_name\", RUBY_METHOD_FUNC(&singleton_fully_qualified_name), 0);\n"
             "rb_define_method(rb_cls, \"field_for_name\", RUBY_METHOD_FUNC(&singleton_field_for_name), 1);\n"
             "rb_define_singleton_method(rb_cls, \"parse\", RUBY_METHOD_FUNC(&singleton_parse), 1);\n"
+            "rb_define_singleton_method(rb_cls, \"parse_shared\", RUBY_METHOD_FUNC(&singleton_parse_shared), 1);\n"
+            "rb_define_singleton_method(rb_cls, \"parse_lazy\", RUBY_METHOD_FUNC(&singleton_parse_lazy), 1);\n"
+            "rb_define_singleton_method(rb_cls, \"serialize_many\", RUBY_METHOD_FUNC(&singleton_serialize_many), 1);\n"
+            "rb_define_singleton_method(rb_cls, \"serialize_many_delimited\", RUBY_METHOD_FUNC(&singleton_serialize_many_delimited), 1);\n"
             "rb_define_singleton_method(rb_cls, \"fields\", RUBY_METHOD_FUNC(&singleton_fields), 0);\n"
             "rb_define_singleton_method(rb_cls, \"field_for_name\", RUBY_METHOD_FUNC(&singleton_field_for_name), 1);\n"
             "rb_define_singleton_method(rb_cls, \"fully_qualified_name\", RUBY_METHOD_FUNC(&singleton_fully_qualified_name), 0);\n"
@@ -301,6 +572,50 @@ namespace rb_fastproto {
             );
         }
 
+        for (int i = 0; i < message_type->real_oneof_decl_count(); i++) {
+            printer.Print(
+                "rb_define_method(rb_cls, \"which_$oneof_name$\", RUBY_METHOD_FUNC(&which_oneof_$oneof_name$), 0);\n",
+                "oneof_name", message_type->oneof_decl(i)->name()
+            );
+        }
+
+        // Intern each field's names. These are static symbols, which are never garbage collected,
+        // so they don't need registering with the GC like rb_cls does.
+        for(int i =  0; i < message_type->field_count(); i++) {
+            auto field = message_type->field(i);
+
+            printer.Print(
+                "sym_$cpp_field_name$ = ID2SYM(rb_intern(\"$rb_field_name$\"));\n"
+                "id_set_$cpp_field_name$ = rb_intern(\"$rb_field_name$=\");\n"
+                "id_has_$cpp_field_name$ = rb_intern(\"has_$rb_field_name$?\");\n",
+                "cpp_field_name", cpp_field_name(field),
+                "rb_field_name", field->name()
+            );
+        }
+
+        // Build each field's default. Strings are frozen, because every message shares them.
+        for(int i =  0; i < message_type->field_count(); i++) {
+            auto field = message_type->field(i);
+            if (!has_static_default(field)) {
+                continue;
+            }
+
+            if (is_native_field(field)) {
+                printer.Print(
+                    "default_$cpp_field_name$ = $value$;\n",
+                    "cpp_field_name", cpp_field_name(field),
+                    "value", value_to_native(field, declared_default_value(field))
+                );
+            } else {
+                printer.Print(
+                    "rb_gc_register_address(&default_$cpp_field_name$);\n"
+                    "default_$cpp_field_name$ = $value$;\n",
+                    "cpp_field_name", cpp_field_name(field),
+                    "value", declared_default_value(field)
+                );
+            }
+        }
+
         printer.Print(
             "rb_funcall(rb_cv_get(cls_fastproto_message, \"@@message_classes\"), rb_intern(\"[]=\"), 2, rb_str_new2(\"$package$.$message_name$\"), rb_cls);\n",
             "package", file->package(),
@@ -309,6 +624,9 @@ namespace rb_fastproto {
 
         // Initialize any submessages too
         for (int i = 0; i < message_type->nested_type_count(); i++ ) {
+            if (message_type->nested_type(i)->options().map_entry()) {
+                continue;
+            }
             printer.Print("$subtype$::initialize_class();\n", "subtype", cpp_proto_message_wrapper_struct_name(message_type->nested_type(i)));
         }
 
@@ -327,21 +645,24 @@ namespace rb_fastproto {
 
         printer.Print(
             "VALUE $class_name$::alloc(VALUE self) {\n"
-            "    auto memory = ruby_xmalloc(sizeof($class_name$));\n"
-            "    // Important: It guarantees that reading have_initialized returns false so we know\n"
-            "    // not to run the destructor\n"
-            "    std::memset(memory, 0, sizeof($class_name$));\n"
-            "    return Data_Wrap_Struct(self, &mark, &free, memory);\n"
+            "    // Important: the struct is zeroed, which guarantees that reading have_initialized\n"
+            "    // returns false so we know not to run the destructor\n"
+            "    $class_name$* memory;\n"
+            "    VALUE obj = TypedData_Make_Struct(self, $class_name$, &rb_data_type, memory);\n"
+            "    memory->embedded = typed_data_embedded(obj);\n"
+            "    memory_stats.live++;\n"
+            "    memory_stats.bytes += sizeof($class_name$);\n"
+            "    return obj;\n"
             "}\n"
             "\n"
             "VALUE $class_name$::alloc() {\n"
-            "    return alloc(rb_path2class(\"$rb_class_name$\"));\n"
+            "    return alloc(rb_cls);\n"
             "}\n"
             "\n"
             "VALUE $class_name$::initialize(int argc, VALUE* argv, VALUE self) {\n"
             "    // Use placement new to create the object\n"
             "    void* memory;\n"
-            "    Data_Get_Struct(self, void*, memory);\n"
+            "    TypedData_Get_Struct(self, void, &rb_data_type, memory);\n"
             "    new(memory) $class_name$(self);\n"
             "    // If we got passed a hash, set attributes with it.\n"
             "    VALUE attrs = Qnil;\n"
@@ -374,34 +695,129 @@ namespace rb_fastproto {
             "    return self;\n"
             "}\n"
             "\n"
-            "void $class_name$::free(char* memory) {\n"
+            "void $class_name$::free(void* memory) {\n"
             "    auto obj = reinterpret_cast<$class_name$*>(memory);\n"
+            "    bool embedded = obj->embedded;\n"
             "    if (obj->have_initialized) {\n"
             "        obj->~$destructor_name$();\n"
             "    }\n"
-            "    ruby_xfree(memory);\n"
+            "    if (!embedded) {\n"
+            "        ruby_xfree(memory);\n"
+            "    }\n"
+            "    memory_stats.live--;\n"
+            "    memory_stats.bytes -= sizeof($class_name$);\n"
             "}\n"
             "\n"
-            "void $class_name$::mark(char* memory) {\n"
+            "void $class_name$::mark(void* memory) {\n"
             "    auto cpp_this = reinterpret_cast<$class_name$*>(memory);\n"
             "\n",
             "class_name", class_name,
-            "destructor_name", cpp_proto_message_wrapper_struct_name_no_ns(message_type),
-            "rb_class_name", ruby_proto_message_class_name(message_type)
+            "destructor_name", cpp_proto_message_wrapper_struct_name_no_ns(message_type)
         );
 
-        // Mark each field
+        // Mark each field. Nothing is pinned, so GC.compact can move what we point to, and
+        // compact() then updates our copies of the references. Native fields hold no VALUE.
         printer.Indent();
 
+        printer.Print("rb_gc_mark_movable(cpp_this->parent);\n");
+        printer.Print("rb_gc_mark_movable(cpp_this->encoded);\n");
+        printer.Print(
+            "if (cpp_this->lazy_fields != nullptr) {\n"
+            "    rb_gc_mark_movable(cpp_this->lazy_fields->source);\n"
+            "}\n"
+        );
+        if (is_sparse(message_type)) {
+            printer.Print(
+                "for (const auto &entry : cpp_this->sparse_fields) {\n"
+                "    rb_gc_mark_movable(entry.value);\n"
+                "}\n"
+            );
+        }
+
         for (int j = 0; j < message_type->field_count(); j++) {
             auto field = message_type->field(j);
+            if (is_native_field(field) || !has_field_member(field)) {
+                continue;
+            }
 
-            printer.Print("rb_gc_mark(cpp_this->field_$field_name$);\n", "field_name", cpp_field_name(field));
+            printer.Print("rb_gc_mark_movable(cpp_this->field_$field_name$);\n", "field_name", cpp_field_name(field));
+        }
+        for (int j = 0; j < message_type->real_oneof_decl_count(); j++) {
+            printer.Print("rb_gc_mark_movable(cpp_this->oneof_$oneof_name$);\n", "oneof_name", message_type->oneof_decl(j)->name());
         }
 
         printer.Outdent();
 
         printer.Print("}\n\n");
+
+        // rb_self is updated too, since we may have been moved ourselves
+        printer.Print(
+            "void $class_name$::compact(void* memory) {\n"
+            "    auto cpp_this = reinterpret_cast<$class_name$*>(memory);\n"
+            "    cpp_this->rb_self = rb_gc_location(cpp_this->rb_self);\n"
+            "    cpp_this->parent = rb_gc_location(cpp_this->parent);\n"
+            "    cpp_this->encoded = rb_gc_location(cpp_this->encoded);\n"
+            "    if (cpp_this->lazy_fields != nullptr) {\n"
+            "        cpp_this->lazy_fields->source = rb_gc_location(cpp_this->lazy_fields->source);\n"
+            "    }\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+        if (is_sparse(message_type)) {
+            printer.Print(
+                "for (auto &entry : cpp_this->sparse_fields) {\n"
+                "    entry.value = rb_gc_location(entry.value);\n"
+                "}\n"
+            );
+        }
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+            if (is_native_field(field) || !has_field_member(field)) {
+                continue;
+            }
+
+            printer.Print(
+                "cpp_this->field_$field_name$ = rb_gc_location(cpp_this->field_$field_name$);\n",
+                "field_name", cpp_field_name(field)
+            );
+        }
+        for (int j = 0; j < message_type->real_oneof_decl_count(); j++) {
+            printer.Print(
+                "cpp_this->oneof_$oneof_name$ = rb_gc_location(cpp_this->oneof_$oneof_name$);\n",
+                "oneof_name", message_type->oneof_decl(j)->name()
+            );
+        }
+        printer.Outdent();
+        printer.Print("}\n\n");
+
+        // Native memory that Ruby's malloc accounting never sees. backing is counted as the size
+        // of what it was parsed from, rather than walking it with SpaceUsedLong every time.
+        printer.Print(
+            "size_t $class_name$::native_size() const {\n"
+            "    size_t size = unknown_fields == nullptr ? 0 : sizeof(std::string) + unknown_fields->capacity();\n"
+            "    if (lazy_fields != nullptr) {\n"
+            "        size += lazy_fields->memsize();\n"
+            "    }\n"
+            "$sparse_size$"
+            "$backing_size$"
+            "    return size;\n"
+            "}\n\n"
+            "size_t $class_name$::memsize(const void* memory) {\n"
+            "    auto cpp_this = reinterpret_cast<const $class_name$*>(memory);\n"
+            "    // An embedded struct is already counted in its object's slot\n"
+            "    size_t size = cpp_this->embedded ? 0 : sizeof($class_name$);\n"
+            "    if (cpp_this->have_initialized) {\n"
+            "        size += cpp_this->native_size();\n"
+            "    }\n"
+            "    return size;\n"
+            "}\n\n",
+            "class_name", class_name,
+            "sparse_size", is_sparse(message_type) ? "    size += sparse_fields.memsize();\n" : "",
+            "backing_size", !options.cpp_storage ? "" :
+                "    if (backing != nullptr) {\n"
+                "        size += backing_size;\n"
+                "    }\n"
+        );
     }
 
     void RBFastProtoCodeGenerator::write_cpp_message_struct_default_factories(
@@ -410,91 +826,59 @@ namespace rb_fastproto {
         const std::string &class_name,
         google::protobuf::io::Printer &printer
     ) const {
-        // Default factories for each field.
-        // Method that just returns an appropriate default ruby VALUE.
-        // Takes a parameter which is whether or not we are in a constructor (and hence should be lazy)
-
-
+        // Repeated & message fields start out sharing a frozen default, and these make them their
+        // own array or message the first time they're read.
         for (int j = 0; j < message_type->field_count(); j++) {
             auto field = message_type->field(j);
+            if (has_static_default(field)) {
+                continue;
+            }
 
             printer.Print(
-                "VALUE $class_name$::default_factory_$field_name$(VALUE self, bool constructor) {\n",
+                "VALUE $class_name$::default_factory_$field_name$(VALUE self) {\n",
                 "field_name", cpp_field_name(field),
                 "class_name", class_name
             );
             printer.Indent();
 
-            if (field->is_repeated()) {
-                // Repeated fields just default to an empty array
+            if (is_native_repeated(field)) {
+                printer.Print("return repeated_scalar_new<$native_type$>();\n", "native_type", native_type_for_field(field));
+            } else if (field->is_map()) {
+                printer.Print("return rb_hash_new();\n");
+            } else if (field->is_repeated()) {
                 printer.Print("return rb_ary_new();\n");
             } else {
-                switch (field->type()) {
-                    case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
-                        printer.Print("return LONG2NUM(0);\n");
-                        break;
-                    case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
-                        printer.Print("return DBL2NUM(0.0);\n");
-                        break;
-                    case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
-                        printer.Print("return Qfalse;\n");
-                        break;
-                    case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
-                        printer.Print("return rb_str_new2(\"\");\n");
-                        break;
-                    case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
-                        printer.Print(
-                            "auto r_str = rb_str_new2(\"\");\n"
-                            "rb_enc_associate_index(r_str, rb_enc_find_index(\"UTF-8\"));\n"
-                            "return r_str;\n"
-                        );
-                        break;
-                    case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
-                        // TODO: What happens here?
-                        printer.Print("return Qnil;\n");
-                        break;
-                    case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
-                    case google::protobuf::FieldDescriptor::Type::TYPE_GROUP:
-                        // If it is optional, just write nil when in the constructor and we will fault it in on read.
-                        // This prevents stack overflows.
-                        printer.Print(
-                            "if ($is_required$ || !constructor) {\n"
-                            "    auto obj = rb_funcall(\n"
-                            "        rb_path2class(\"$rb_message_class_name$\"),\n"
-                            "        rb_intern(\"new\"), 0\n"
-                            "    );\n"
-                            "    // obj = rb_obj_freeze(obj);\n"
-                            "    // Set the parent_for_notify to be us - we will find out when one of its subfields\n"
-                            "    // changes, so we can update is_set for optional fields.\n"
-                            "    rb_ivar_set(obj, rb_intern(\"@parent_for_notify\"), self);\n"
-                            "    rb_ivar_set(obj, rb_intern(\"@tag_for_notify\"), INT2NUM($field_number$));"
-                            "    return obj;\n"
-                            "} else {\n"
-                            "    return Qnil;\n"
-                            "}\n",
-                            "is_required", field->is_required() ? "true" : "false",
-                            "rb_message_class_name", ruby_proto_message_class_name(field->message_type()),
-                            "field_name", cpp_field_name(field),
-                            "field_number", std::to_string(field->number())
-                        );
-                    default:
-                        break;
-                }
+                printer.Print(
+                    "auto obj = $nested_message_type$::new_for_parse();\n"
+                    "// Make ourselves its parent - we will find out when one of its subfields\n"
+                    "// changes, so we can update is_set for optional fields.\n"
+                    "$nested_message_type$* cpp_obj;\n"
+                    "TypedData_Get_Struct(obj, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_obj);\n"
+                    "RB_OBJ_WRITE(obj, &cpp_obj->parent, self);\n"
+                    "cpp_obj->notify_parent = &notify_field_changed;\n"
+                    "cpp_obj->parent_field_number = $field_number$;\n"
+                    "return obj;\n",
+                    "nested_message_type", cpp_proto_message_wrapper_struct_name(field->message_type()),
+                    "field_number", std::to_string(field->number())
+                );
             }
 
             printer.Outdent();
             printer.Print("}\n");
         }
+
+        // Made lazily, rather than in initialize_class(), because the types of our fields may not
+        // have been initialized yet at that point.
+        printer.Print(
+            "VALUE $class_name$::default_instance() {\n"
+            "    if (shared_default == Qnil) {\n"
+            "        rb_gc_register_address(&shared_default);\n"
+            "        shared_default = rb_obj_freeze(new_for_parse());\n"
+            "    }\n"
+            "    return shared_default;\n"
+            "}\n",
+            "class_name", class_name
+        );
     }
 
     void RBFastProtoCodeGenerator::write_cpp_message_struct_accessors(
@@ -510,7 +894,7 @@ namespace rb_fastproto {
             printer.Print(
                 "VALUE $class_name$::set_$field_name$(VALUE self, VALUE val) {\n"
                 "  $class_name$* cpp_self;\n"
-                "  Data_Get_Struct(self, $class_name$, cpp_self);\n"
+                "  TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
                 "\n",
                 "field_name", cpp_field_name(field),
                 "class_name", class_name
@@ -524,46 +908,87 @@ namespace rb_fastproto {
                 "}\n\n"
             );
 
-            // If nil was provided, interpret that as "unset"
+            if (is_lazy_field(field)) {
+                // Whatever parse_lazy found for this field has been replaced
+                printer.Print(
+                    "if (cpp_self->lazy_fields != nullptr) {\n"
+                    "    cpp_self->drop_lazy($field_number$);\n"
+                    "}\n\n",
+                    "field_number", std::to_string(field->number())
+                );
+            }
+
+            if (options.cpp_storage) {
+                // The backing's value for this field is replaced when we're next serialized. So is
+                // any other field of its oneof, which mustn't be read back over it.
+                auto oneof = field->real_containing_oneof();
+                for (int k = 0; k < (oneof != nullptr ? oneof->field_count() : 1); k++) {
+                    printer.Print(
+                        "cpp_self->clear_unread_field_$field_name$();\n",
+                        "field_name", cpp_field_name(oneof != nullptr ? oneof->field(k) : field)
+                    );
+                }
+                printer.Print("\n");
+            }
+
+            if (has_fixed_wire_size(field)) {
+                printer.Print("cpp_self->fixed_size_valid = false;\n\n");
+            }
+
+            // If nil was provided, interpret that as "unset". A sparse message stops holding the
+            // field, unless it's required. A oneof is only cleared if this is the field it has set,
+            // which set_has_field_* takes care of.
             printer.Print("if (val == Qnil) {\n");
             printer.Indent();
 
-            printer.Print("cpp_self->field_$field_name$ = default_factory_$field_name$(self, false);\n", "field_name", cpp_field_name(field));
-            if (field->is_optional()) {
-                printer.Print("cpp_self->has_field_$field_name$ = false;\n", "field_name", cpp_field_name(field));
+            printer.Print(
+                field->real_containing_oneof() != nullptr ?
+                    "" :
+                is_sparse(message_type) && !field->is_required() ?
+                    "cpp_self->sparse_fields.erase($field_number$);\n" :
+                is_native_field(field) ?
+                    "cpp_self->field_$field_name$ = $default$;\n" :
+                    "RB_OBJ_WRITE(self, $slot$, $default$);\n",
+                "field_name", cpp_field_name(field),
+                "field_number", std::to_string(field->number()),
+                "slot", field_slot_expr(field, "cpp_self->"),
+                "default", template_value_expr(field)
+            );
+            if (has_presence_bit(field)) {
+                printer.Print("cpp_self->set_has_field_$field_name$(false);\n", "field_name", cpp_field_name(field));
             }
 
             printer.Outdent();
 
             // Otherwise, we need to set our internal VALUE to what was provided.
-            // No type checking is done at this stage.
+            // No type checking is done at this stage, except for native fields, which have to be
+            // converted now.
             printer.Print("} else {\n");
             printer.Indent();
 
-            printer.Print("cpp_self->field_$field_name$ = val;\n", "field_name", cpp_field_name(field));
+            if (is_native_field(field)) {
+                printer.Print(
+                    "cpp_self->field_$field_name$ = $convert$;\n",
+                    "field_name", cpp_field_name(field),
+                    "convert", value_to_native(field, "val")
+                );
+            } else if (is_native_repeated(field)) {
+                printer.Print(
+                    "RB_OBJ_WRITE(self, &cpp_self->field_$field_name$, repeated_scalar_from<$native_type$>(val));\n",
+                    "field_name", cpp_field_name(field),
+                    "native_type", native_type_for_field(field)
+                );
+            } else {
+                printer.Print("RB_OBJ_WRITE(self, $slot$, val);\n", "slot", field_slot_expr(field, "cpp_self->"));
+            }
 
-            if (field->is_optional()) {
-                printer.Print("cpp_self->has_field_$field_name$ = true;\n", "field_name", cpp_field_name(field));
+            if (has_presence_bit(field)) {
+                printer.Print("cpp_self->set_has_field_$field_name$(true);\n", "field_name", cpp_field_name(field));
             }
 
             printer.Print("\n");
 
-            printer.Print(
-                "if (cpp_self->is_default_value) {\n"
-                "  cpp_self->is_default_value = false;\n"
-                "\n"
-                "  if (rb_ivar_get(self, rb_intern(\"@parent_for_notify\"))) {\n"
-                "    VALUE parent_for_notify = rb_ivar_get(self, rb_intern(\"@parent_for_notify\"));\n"
-                "\n"
-                "    if (parent_for_notify != Qnil) {\n"
-                "      VALUE notify_tag = rb_ivar_get(self, rb_intern(\"@tag_for_notify\"));\n"
-                "\n"
-                "      rb_funcall(parent_for_notify, rb_intern(\"notify_default_changed\"), 2, self, notify_tag);\n"
-                "      rb_ivar_set(self, rb_intern(\"@parent_for_notify\"), Qnil);\n"
-                "    }\n"
-                "  }\n"
-                "}\n"
-            );
+            printer.Print("cpp_self->mark_changed(self);\n");
 
             printer.Outdent();
             printer.Print("}\n\n");
@@ -577,22 +1002,71 @@ namespace rb_fastproto {
             printer.Print(
                 "VALUE $class_name$::get_$field_name$(VALUE self) {\n"
                 "  $class_name$* cpp_self;\n"
-                "  Data_Get_Struct(self, $class_name$, cpp_self);\n",
+                "  TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n",
                 "field_name", cpp_field_name(field),
                 "class_name", class_name
             );
             printer.Indent();
 
-            // If the field is a message, and currently nil, we need to fault it in
-            if (field->message_type()) {
+            if (is_lazy_field(field)) {
                 printer.Print(
-                    "if (cpp_self->field_$field_name$ == Qnil) {\n"
-                    "    cpp_self->field_$field_name$ = default_factory_$field_name$(self, false);\n"
+                    "if (cpp_self->lazy_fields != nullptr) {\n"
+                    "    cpp_self->decode_lazy($field_number$);\n"
                     "}\n",
+                    "field_number", std::to_string(field->number())
+                );
+            }
+
+            if (options.cpp_storage) {
+                printer.Print(
+                    "if (cpp_self->unread_field_$field_name$()) {\n"
+                    "    cpp_self->read_backing($field_number$);\n"
+                    "}\n",
+                    "field_name", cpp_field_name(field),
+                    "field_number", std::to_string(field->number())
+                );
+            }
+
+            // If the field is still sharing its default array or message, it needs its own one
+            // before anyone can change it. Frozen messages can't be changed, so they just hand out
+            // the shared one, and reading through a frozen message never allocates.
+            if (has_static_default(field)) {
+                // Nothing to do; scalars are never changed in place.
+            } else if (field->is_repeated() || field->is_required()) {
+                printer.Print(
+                    "if ($field$ == $shared_default$ && !RB_OBJ_FROZEN(self)) {\n"
+                    "    RB_OBJ_WRITE(self, $slot$, default_factory_$field_name$(self));\n"
+                    "}\n",
+                    "field", field_expr(field, "cpp_self->"),
+                    "slot", field_slot_expr(field, "cpp_self->"),
+                    "field_name", cpp_field_name(field),
+                    "shared_default", field->is_map() ? "default_empty_hash" : field->is_repeated() ?
+                        "default_empty_array" :
+                        cpp_proto_message_wrapper_struct_name(field->message_type()) + "::shared_default"
+                );
+            } else if (field->message_type()) {
+                // Unset optional messages are nil until they're read. Reading one that's in a
+                // oneof mustn't switch the oneof over to it, so it isn't kept until it's changed
+                // (see notify_field_changed).
+                printer.Print(
+                    "if ($field$ == Qnil) {\n"
+                    "    if (RB_OBJ_FROZEN(self)) {\n"
+                    "        return $nested_message_type$::default_instance();\n"
+                    "    }\n",
+                    "field", field_expr(field, "cpp_self->"),
+                    "nested_message_type", cpp_proto_message_wrapper_struct_name(field->message_type())
+                );
+                printer.Print(
+                    field->real_containing_oneof() != nullptr ?
+                        "    return default_factory_$field_name$(self);\n"
+                        "}\n" :
+                        "    RB_OBJ_WRITE(self, $slot$, default_factory_$field_name$(self));\n"
+                        "}\n",
+                    "slot", field_slot_expr(field, "cpp_self->"),
                     "field_name", cpp_field_name(field)
                 );
             }
-            printer.Print("return cpp_self->field_$field_name$;\n", "field_name", cpp_field_name(field));
+            printer.Print("return $value$;\n", "value", field_value_expr(field, "cpp_self->"));
 
             printer.Outdent();
             printer.Print("}\n");
@@ -608,11 +1082,22 @@ namespace rb_fastproto {
             if (field->is_optional()) {
                 printer.Print(
                     "$class_name$* cpp_self;\n"
-                    "Data_Get_Struct(self, $class_name$, cpp_self);\n"
-                    "return cpp_self->has_field_$field_name$ ? Qtrue : Qfalse; \n",
-                    "field_name", cpp_field_name(field),
+                    "TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n",
                     "class_name", class_name
                 );
+                if (options.cpp_storage) {
+                    printer.Print(
+                        "if (cpp_self->unread_field_$field_name$()) {\n"
+                        "    cpp_self->read_backing($field_number$);\n"
+                        "}\n",
+                        "field_name", cpp_field_name(field),
+                        "field_number", std::to_string(field->number())
+                    );
+                }
+                printer.Print(
+                    "return cpp_self->has_field_$field_name$() ? Qtrue : Qfalse; \n",
+                    "field_name", cpp_field_name(field)
+                );
             } else {
                 printer.Print("return Qtrue;\n");
             }
@@ -622,46 +1107,100 @@ namespace rb_fastproto {
         }
     }
 
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_oneof_accessors(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        // which_<oneof> is the name of the field the oneof has set, as a symbol, or nil.
+        for (int i = 0; i < message_type->real_oneof_decl_count(); i++) {
+            auto oneof = message_type->oneof_decl(i);
+
+            printer.Print(
+                "VALUE $class_name$::which_oneof_$oneof_name$(VALUE self) {\n"
+                "    $class_name$* cpp_self;\n"
+                "    TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n",
+                "class_name", class_name,
+                "oneof_name", oneof->name()
+            );
+            printer.Indent();
+
+            if (options.cpp_storage) {
+                for (int j = 0; j < oneof->field_count(); j++) {
+                    printer.Print(
+                        "if (cpp_self->unread_field_$field_name$()) {\n"
+                        "    cpp_self->read_backing($field_number$);\n"
+                        "}\n",
+                        "field_name", cpp_field_name(oneof->field(j)),
+                        "field_number", std::to_string(oneof->field(j)->number())
+                    );
+                }
+            }
+
+            printer.Print("switch (cpp_self->oneof_case_$oneof_name$) {\n", "oneof_name", oneof->name());
+            for (int j = 0; j < oneof->field_count(); j++) {
+                printer.Print(
+                    "case $field_number$:\n"
+                    "    return sym_$field_name$;\n",
+                    "field_name", cpp_field_name(oneof->field(j)),
+                    "field_number", std::to_string(oneof->field(j)->number())
+                );
+            }
+            printer.Print(
+                "}\n"
+                "return Qnil;\n"
+            );
+
+            printer.Outdent();
+            printer.Print("}\n\n");
+        }
+    }
+
     void RBFastProtoCodeGenerator::write_cpp_message_struct_dynamic_accessors(
         const google::protobuf::FileDescriptor* file,
         const google::protobuf::Descriptor* message_type,
         const std::string &class_name,
         google::protobuf::io::Printer &printer
     ) const {
+        // The tag accessors go through the ruby methods (rather than straight to the fields), so
+        // they see anything a subclass has overridden.
+        struct tag_accessor {
+            const char* signature;
+            const char* call;
+        };
+        const tag_accessor tag_accessors[] = {
+            { "value_for_tag(VALUE self, VALUE tag)", "return rb_funcall(self, SYM2ID(sym_$field_name$), 0);\n" },
+            { "set_value_for_tag(VALUE self, VALUE tag, VALUE val)", "return rb_funcall(self, id_set_$field_name$, 1, val);\n" },
+            { "has_value_for_tag(VALUE self, VALUE tag)", "return rb_funcall(self, id_has_$field_name$, 0);\n" },
+        };
+        for (auto &accessor : tag_accessors) {
+            printer.Print(
+                "VALUE $class_name$::$signature$ {\n"
+                "    Check_Type(tag, T_FIXNUM);\n"
+                "    switch (FIX2LONG(tag)) {\n",
+                "class_name", class_name,
+                "signature", accessor.signature
+            );
+            for (int j = 0; j < message_type->field_count(); j++) {
+                auto field = message_type->field(j);
+
+                printer.Print("    case $field_number$:\n", "field_number", std::to_string(field->number()));
+                printer.Print(
+                    (std::string("        ") + accessor.call).c_str(),
+                    "field_name", cpp_field_name(field)
+                );
+            }
+            printer.Print(
+                "    }\n"
+                "    rb_raise(rb_eKeyError, \"Tag not found\");\n"
+                "    return Qnil;\n"
+                "}\n"
+                "\n"
+            );
+        }
+
         printer.Print(
-            "VALUE $class_name$::value_for_tag(VALUE self, VALUE tag) {\n"
-            "    Check_Type(tag, T_FIXNUM);\n"
-            "    auto field_descriptor = $cpp_proto_type$::descriptor()->FindFieldByNumber(NUM2INT(tag));\n"
-            "    if (field_descriptor == nullptr) {\n"
-            "        rb_raise(rb_eKeyError, \"Tag not found\");\n"
-            "        return Qnil;\n"
-            "    }\n"
-            "    auto method = rb_intern(field_descriptor->name().c_str());\n"
-            "    return rb_funcall(self, method, 0);\n"
-            "}\n"
-            "\n"
-            "VALUE $class_name$::set_value_for_tag(VALUE self, VALUE tag, VALUE val) {\n"
-            "    Check_Type(tag, T_FIXNUM);\n"
-            "    auto field_descriptor = $cpp_proto_type$::descriptor()->FindFieldByNumber(NUM2INT(tag));\n"
-            "    if (field_descriptor == nullptr) {\n"
-            "        rb_raise(rb_eKeyError, \"Tag not found\");\n"
-            "        return Qnil;\n"
-            "    }\n"
-            "    auto method = rb_intern(std::string(field_descriptor->name() + \"=\").c_str());\n"
-            "    return rb_funcall(self, method, 1, val);\n"
-            "}\n"
-            "\n"
-            "VALUE $class_name$::has_value_for_tag(VALUE self, VALUE tag) {\n"
-            "    Check_Type(tag, T_FIXNUM);\n"
-            "    auto field_descriptor = $cpp_proto_type$::descriptor()->FindFieldByNumber(NUM2INT(tag));\n"
-            "    if (field_descriptor == nullptr) {\n"
-            "        rb_raise(rb_eKeyError, \"Tag not found\");\n"
-            "        return Qnil;\n"
-            "    }\n"
-            "    auto method = rb_intern((std::string(\"has_\") + field_descriptor->name() + \"?\").c_str());\n"
-            "    return rb_funcall(self, method, 0);\n"
-            "}\n"
-            "\n"
             "VALUE $class_name$::get_nested(int argc, VALUE* argv, VALUE self) {\n"
             "    VALUE field_sym = Qnil;\n"
             "    VALUE rest = Qnil;\n"
@@ -709,306 +1248,361 @@ namespace rb_fastproto {
             "}\n"
             "\n"
             "VALUE $class_name$::notify_default_changed(VALUE self, VALUE sender, VALUE notify_tag) {\n"
-            "    int field_num = NUM2INT(notify_tag);\n"
-            "    // Meaningless for required fields;\n"
-            "    if (!$cpp_proto_type$::descriptor()->FindFieldByNumber(field_num)->is_optional()) {\n"
-            "        return Qnil;\n"
-            "    }\n"
-            "    // Just do the slow get_value_for_tag thing :(\n"
-            "    VALUE current_field_value = value_for_tag(self, notify_tag);\n"
-            "    if (current_field_value != sender) {\n"
-            "        return Qnil;\n"
-            "    }\n"
-            "    set_value_for_tag(self, notify_tag, current_field_value);\n"
+            "    notify_field_changed(self, sender, NUM2INT(notify_tag));\n"
             "    return Qnil;\n"
             "}\n"
+            "\n"
+            "void $class_name$::mark_changed(VALUE self) {\n"
+            "    if (is_default_value) {\n"
+            "        is_default_value = false;\n"
+            "\n"
+            "        // Only the first change is passed up to the parent\n"
+            "        if (notify_parent != nullptr) {\n"
+            "            auto notify = notify_parent;\n"
+            "            VALUE notify_to = parent;\n"
+            "            notify_parent = nullptr;\n"
+            "            parent = Qnil;\n"
+            "            notify(notify_to, self, parent_field_number);\n"
+            "        }\n"
+            "    }\n"
+            "}\n"
             "\n",
-            "class_name", class_name,
-            "cpp_proto_type", cpp_proto_class_name(message_type)
-        );
-    }
-
-    void RBFastProtoCodeGenerator::write_cpp_message_struct_to_proto_obj(
-        const google::protobuf::FileDescriptor* file,
-        const google::protobuf::Descriptor* message_type,
-        const std::string &class_name,
-        google::protobuf::io::Printer &printer
-    ) const {
-        // Implements to_proto_obj which fills an appropriately classed google C++
-        // protobuf object with the VALUES from this object.
-        // Returns any exception that happened, or Qnil.
-
-        printer.Print(
-            "VALUE $class_name$::to_proto_obj($cpp_proto_type$* cpp_proto) {\n",
-            "cpp_proto_type", cpp_proto_class_name(message_type),
             "class_name", class_name
         );
-        printer.Indent();
 
-        // The gymnastics with the the dangerous_func lambda is so we can catch any exception
-        // that gets raised in the conversion macro return it to our caller, so we can run destructors
-        // before re-raising the exception to ruby.
+        // One of our default submessages has changed. If it is still the value of an optional
+        // field, that field now counts as set. Either way, we are no longer a default message.
         printer.Print(
-            "struct dangerous_func_data {\n"
-            "    decltype(cpp_proto) _cpp_proto;\n"
-            "    $class_name$* self;\n"
-            "};\n"
-            "auto dangerous_func = [](VALUE data_as_value) -> VALUE {\n"
-            "    // Unwrap our 'VALUE' into an actual pointer\n"
-            "    auto data = reinterpret_cast<dangerous_func_data*>(rb_data_object_get(data_as_value));\n"
-            "    auto _cpp_proto = data->_cpp_proto;\n"
-            "    auto _self = data->self;\n",
+            "void $class_name$::notify_field_changed(VALUE self, VALUE child, int field_number) {\n",
             "class_name", class_name
         );
-
         printer.Indent();
 
-        // OK. Now, carefully, without allocating memory on the heap, set each of our fields onto the proto
-        // object. If there is a type mismatch, we get longjmp()'d out into the ruby exception handler.
+        std::vector<const google::protobuf::FieldDescriptor*> notify_fields;
         for (int j = 0; j < message_type->field_count(); j++) {
             auto field = message_type->field(j);
-
-            if (field->is_repeated()) {
-                // Loop the array into the protobuf.
-                printer.Print(
-                    "for (\n"
-                    "    const VALUE* array_el = rb_array_const_ptr(_self->field_$field_name$);\n"
-                    "    array_el < rb_array_const_ptr(_self->field_$field_name$) + rb_array_len(_self->field_$field_name$);\n"
-                    "    array_el++\n"
-                    ") {\n",
-                    "field_name", cpp_field_name(field)
-                );
-            } else if (field->is_optional()) {
-                // Do nothing if the field is not set
-                printer.Print("if (_self->has_field_$field_name$) {\n", "field_name", cpp_field_name(field));
-            } else {
-                printer.Print("if (true) {\n");
-            }
-            printer.Indent();
-
-            // Depending on the ruby class, we do a different conversion
-            // The numeric _S macros are defined in generator_entrypoint.cpp
-            // and wrap the ruby macros to disable float-to-int coersion
-            std::string single_op;
-            std::string repeated_op;
-            switch (field->type()) {
-                case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
-                case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
-                case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
-                    single_op = "_cpp_proto->set_$field_name$(NUM2INT_S(_self->field_$field_name$));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(NUM2INT_S(*array_el));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
-                case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
-                    single_op = "_cpp_proto->set_$field_name$(NUM2UINT_S(_self->field_$field_name$));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(NUM2UINT_S(*array_el));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
-                case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
-                case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
-                    single_op = "_cpp_proto->set_$field_name$(NUM2LONG_S(_self->field_$field_name$));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(NUM2LONG_S(*array_el));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
-                case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
-                    single_op = "_cpp_proto->set_$field_name$(NUM2ULONG_S(_self->field_$field_name$));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(NUM2ULONG_S(*array_el));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
-                    single_op = "_cpp_proto->set_$field_name$(static_cast<float>(NUM2DBL(_self->field_$field_name$)));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(static_cast<float>(NUM2DBL(*array_el)));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
-                    single_op = "_cpp_proto->set_$field_name$(NUM2DBL(_self->field_$field_name$));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(NUM2DBL(*array_el));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
-                    single_op = "_cpp_proto->set_$field_name$(VAL2BOOL_S(_self->field_$field_name$));\n";
-                    repeated_op = "_cpp_proto->add_$field_name$(VAL2BOOL_S(*array_el));\n";
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
-                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
-                    // Pass two arguments to set_stringfield()
-                    single_op = (
-                        "_cpp_proto->set_$field_name$(\n"
-                        "    RSTRING_PTR(_self->field_$field_name$),\n"
-                        "    RSTRING_LEN(_self->field_$field_name$)\n"
-                        ");\n"
-                    );
-                    repeated_op = (
-                        "_cpp_proto->add_$field_name$(\n"
-                        "    RSTRING_PTR(*array_el),\n"
-                        "    RSTRING_LEN(*array_el)\n"
-                        ");\n"
-                    );
-                    break;
-                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
-                case google::protobuf::FieldDescriptor::Type::TYPE_GROUP:
-                    // Recurse to serialize the message
-                    single_op = (
-                        "Check_Type(_self->field_$field_name$, T_DATA);\n"
-                        "if (CLASS_OF(_self->field_$field_name$) != rb_path2class(\"$rb_message_class_name$\")) {\n"
-                        "    rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
-                        "} else {\n"
-                        "    $nested_message_type$* cpp_nested;\n"
-                        "    Data_Get_Struct(_self->field_$field_name$, $nested_message_type$, cpp_nested);\n"
-                        "    cpp_nested->to_proto_obj(_cpp_proto->mutable_$field_name$());\n"
-                        "}\n"
-                    );
-                    repeated_op = (
-                        "Check_Type(*array_el, T_DATA);\n"
-                        "if (CLASS_OF(*array_el) != rb_path2class(\"$rb_message_class_name$\")) {\n"
-                        "    rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
-                        "} else {\n"
-                        "    $nested_message_type$* cpp_nested;\n"
-                        "    Data_Get_Struct(*array_el, $nested_message_type$, cpp_nested);\n"
-                        "    auto pb_el = _cpp_proto->add_$field_name$();\n"
-                        "    cpp_nested->to_proto_obj(pb_el);\n"
-                        "}\n"
-                    );
-                    break;
-                default:
-                    break;
+            if (field->message_type() != nullptr && !field->is_repeated()) {
+                notify_fields.push_back(field);
             }
+        }
 
+        if (!notify_fields.empty()) {
             printer.Print(
-                (field->is_repeated() ? repeated_op : single_op).c_str(),
-                "field_name", cpp_field_name(field),
-                "rb_message_class_name", field->message_type() != nullptr ? ruby_proto_message_class_name(field->message_type()) : "",
-                "nested_message_type", field->message_type() != nullptr ? cpp_proto_message_wrapper_struct_name(field->message_type()) : ""
+                "$class_name$* cpp_self;\n"
+                "TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
+                "switch (field_number) {\n",
+                "class_name", class_name
             );
-
-            printer.Outdent();
-            if (field->is_optional()) {
-                printer.Print("} else {\n"); // close off if (required | set)
-                printer.Print("    _cpp_proto->clear_$field_name$();\n", "field_name", cpp_field_name(field));
+            for (auto field : notify_fields) {
+                // A oneof field's default message isn't kept until now. It's taken on as long as
+                // nothing else in the oneof has been set in the meantime.
+                auto oneof = field->real_containing_oneof();
+                printer.Print(
+                    "case $field_number$:\n"
+                    "    if ($field$ == child$or_unset$) {\n"
+                    "        if (RB_OBJ_FROZEN(self)) {\n"
+                    "            rb_raise(rb_eRuntimeError, \"Message is frozen\");\n"
+                    "        }\n",
+                    "field", field_expr(field, "cpp_self->"),
+                    "field_number", std::to_string(field->number()),
+                    "or_unset", oneof != nullptr ? " || cpp_self->oneof_case_" + oneof->name() + " == 0" : ""
+                );
+                if (oneof != nullptr) {
+                    printer.Print("        RB_OBJ_WRITE(self, $slot$, child);\n", "slot", field_slot_expr(field, "cpp_self->"));
+                }
+                if (field->is_optional()) {
+                    printer.Print("        cpp_self->set_has_field_$field_name$(true);\n", "field_name", cpp_field_name(field));
+                }
+                printer.Print(
+                    "        cpp_self->mark_changed(self);\n"
+                    "    }\n"
+                    "    break;\n"
+                );
             }
             printer.Print("}\n");
         }
 
-        // Now set any unknown fields.
-        printer.Print("_cpp_proto->GetReflection()->MutableUnknownFields(_cpp_proto)->MergeFrom(_self->unknown_fields);\n");
-
-        printer.Print("return Qnil;\n");
-        printer.Outdent();
-
-        printer.Print(
-            "};\n"
-            "int exc_status;\n"
-            "dangerous_func_data data_struct;\n"
-            "data_struct._cpp_proto = cpp_proto;\n"
-            "data_struct.self = this;\n"
-            "VALUE data_struct_as_value = rb_data_object_wrap(rb_cObject, &data_struct, nullptr, [](void* _){});\n"
-            "rb_protect(dangerous_func, data_struct_as_value, &exc_status);\n"
-            "if (exc_status) {\n"
-            "    // Exception!\n"
-            "    auto err = rb_errinfo();\n"
-            "    rb_set_errinfo(Qnil);\n"
-            "    return err;\n"
-            "} else {\n"
-            "    // cpp_proto has its field set\n"
-            "    return Qnil;\n"
-            "}\n"
-        );
-
         printer.Outdent();
         printer.Print("}\n\n");
     }
 
-    void RBFastProtoCodeGenerator::write_cpp_message_struct_from_proto_obj(
+    // The body of the add_entry_<field> lambda fill_proto_obj goes through a map field's hash
+    // with, which puts one key & value into cpp_map_<field>. Everything that can raise is done
+    // before a string key is made, since nothing would destruct it.
+    std::string RBFastProtoCodeGenerator::map_entry_fill_op(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::FieldDescriptor* field
+    ) const {
+        auto map_key = field->message_type()->map_key();
+        auto map_value = field->message_type()->map_value();
+
+        std::string op;
+        std::string key;
+        if (map_key->type() == google::protobuf::FieldDescriptor::Type::TYPE_STRING) {
+            op = "Check_Type(key, T_STRING);\n";
+            key = "std::string(RSTRING_PTR(key), RSTRING_LEN(key))";
+        } else {
+            op = "auto map_key = " + value_to_native(map_key, "key") + ";\n";
+            key = "map_key";
+        }
+        auto entry = "(*cpp_map_$field_name$)[" + key + "]";
+
+        switch (map_value->type()) {
+            case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                op +=
+                    "Check_Type(value, T_STRING);\n" +
+                    entry + ".assign(RSTRING_PTR(value), RSTRING_LEN(value));\n";
+                break;
+            case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                op +=
+                    "auto map_value = static_cast<" + cpp_proto_enum_class_name(map_value->enum_type()) + ">(NUM2INT_S(value));\n" +
+                    entry + " = map_value;\n";
+                break;
+            case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE: {
+                auto nested_message_type = cpp_proto_message_wrapper_struct_name(map_value->message_type());
+                op +=
+                    "if (CLASS_OF(value) != " + nested_message_type + "::rb_cls) {\n"
+                    "    rb_raise(rb_eTypeError, \"$field_name$ not a " + ruby_proto_message_class_name(map_value->message_type()) + "\");\n"
+                    "}\n" +
+                    nested_message_type + "* cpp_nested;\n"
+                    "TypedData_Get_Struct(value, " + nested_message_type + ", &" + nested_message_type + "::rb_data_type, cpp_nested);\n";
+                // As with message fields, one from another file is encoded and parsed back in
+                if (options.cpp_storage && map_value->message_type()->file() != file) {
+                    op +=
+                        "size_t nested_size = cpp_nested->compute_wire_size();\n"
+                        "VALUE bytes = rb_str_new(nullptr, nested_size);\n"
+                        "cpp_nested->write_wire(reinterpret_cast<uint8_t*>(RSTRING_PTR(bytes)));\n" +
+                        entry + ".ParsePartialFromArray(RSTRING_PTR(bytes), static_cast<int>(nested_size));\n"
+                        "RB_GC_GUARD(bytes);\n";
+                } else {
+                    op +=
+                        "auto &nested_proto = " + entry + ";\n"
+                        "cpp_nested->fill_proto_obj(&nested_proto);\n";
+                }
+                break;
+            }
+            default:
+                op +=
+                    "auto map_value = " + value_to_native(map_value, "value") + ";\n" +
+                    entry + " = map_value;\n";
+                break;
+        }
+        return op;
+    }
+
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_to_proto_obj(
         const google::protobuf::FileDescriptor* file,
         const google::protobuf::Descriptor* message_type,
         const std::string &class_name,
         google::protobuf::io::Printer &printer
     ) const {
-        // Defines a from_proto_obj that takes a protobuf object and sets our VALUES
-        // from it.
+        // Implements to_proto_obj which fills an appropriately classed google C++
+        // protobuf object with the VALUES from this object.
+        // Returns any exception that happened, or Qnil.
+
+        // Any exception that gets raised in the conversion macros is caught and returned to our
+        // caller, so it can run destructors before re-raising the exception to ruby. The whole tree
+        // is converted under this one rb_protect; a pointer to the arguments on our stack is
+        // passed through it as the VALUE, so nothing gets allocated on the ruby heap.
         printer.Print(
-            "VALUE $class_name$::from_proto_obj(const $cpp_proto_type$& cpp_proto) {\n",
+            "VALUE $class_name$::to_proto_obj($cpp_proto_type$* cpp_proto) {\n"
+            "    struct protect_args {\n"
+            "        $class_name$* self;\n"
+            "        $cpp_proto_type$* cpp_proto;\n"
+            "    };\n"
+            "    protect_args args = { this, cpp_proto };\n"
+            "    int exc_status;\n"
+            "    rb_protect([](VALUE args_as_value) -> VALUE {\n"
+            "        auto _args = reinterpret_cast<protect_args*>(args_as_value);\n"
+            "        _args->self->fill_proto_obj(_args->cpp_proto);\n"
+            "        return Qnil;\n"
+            "    }, reinterpret_cast<VALUE>(&args), &exc_status);\n"
+            "    if (exc_status) {\n"
+            "        // Exception!\n"
+            "        auto err = rb_errinfo();\n"
+            "        rb_set_errinfo(Qnil);\n"
+            "        return err;\n"
+            "    } else {\n"
+            "        // cpp_proto has its field set\n"
+            "        return Qnil;\n"
+            "    }\n"
+            "}\n\n",
+            "cpp_proto_type", cpp_proto_class_name(message_type),
+            "class_name", class_name
+        );
+
+        // fill_proto_obj does the actual conversion, recursing straight into nested messages. It
+        // must only be called under to_proto_obj's rb_protect.
+        printer.Print(
+            "void $class_name$::fill_proto_obj($cpp_proto_type$* cpp_proto) {\n",
             "cpp_proto_type", cpp_proto_class_name(message_type),
             "class_name", class_name
         );
         printer.Indent();
 
-        for (int j = 0; j < message_type->field_count(); j++) {
-            auto field = message_type->field(j);
+        if (has_lazy_fields(message_type)) {
+            printer.Print(
+                "if (lazy_fields != nullptr) {\n"
+                "  decode_lazy(0);\n"
+                "}\n"
+            );
+        }
+
+        // With storage=cpp, the fields that are still unread are only in backing, so we start from
+        // a copy of it (unless it is what we're filling) and write the rest over the top. Unknown
+        // fields go in first, since enum values the C++ message can't hold are added to them.
+        if (options.cpp_storage) {
+            printer.Print(
+                "if (backing != nullptr && backing != cpp_proto) {\n"
+                "    cpp_proto->CopyFrom(*backing);\n"
+                "}\n"
+                "auto cpp_unknown_fields = cpp_proto->mutable_unknown_fields();\n"
+                "cpp_unknown_fields->Clear();\n"
+                "if (unknown_fields != nullptr) {\n"
+                "    cpp_unknown_fields->ParseFromArray(unknown_fields->data(), static_cast<int>(unknown_fields->size()));\n"
+                "}\n"
+            );
+        }
+
+        // OK. Now, carefully, without allocating memory on the heap, set each of our fields onto the proto
+        // object. If there is a type mismatch, we get longjmp()'d out to to_proto_obj's rb_protect.
+        // Fields without a member of their own (in sparse messages, or oneofs) are looked up into a
+        // local of the same name as the member.
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+
+            if (!has_field_member(field)) {
+                printer.Print("{\n");
+                printer.Indent();
+                printer.Print(
+                    "VALUE field_$field_name$ = $field$;\n",
+                    "field_name", cpp_field_name(field),
+                    "field", field_expr(field, "")
+                );
+            }
+
+            if (options.cpp_storage) {
+                printer.Print(
+                    "if (!unread_field_$field_name$()) {\n"
+                    "  cpp_proto->clear_$field_name$();\n",
+                    "field_name", cpp_field_name(field)
+                );
+                printer.Indent();
+            }
 
-            if (field->is_repeated()) {
+            if (is_native_repeated(field)) {
+                // The values are already native, so they go straight in.
                 printer.Print(
-                    "// Initialize the array to the right size.\n"
-                    "field_$field_name$ = rb_ary_new_capa(cpp_proto.$field_name$_size());\n"
-                    "for (auto&& array_el : cpp_proto.$field_name$()) {\n",
+                    "for (auto value : repeated_scalar_values<$native_type$>(field_$field_name$)) {\n",
+                    "field_name", cpp_field_name(field),
+                    "native_type", native_type_for_field(field)
+                );
+            } else if (field->is_map()) {
+                // Each pair goes straight into the protobuf's map, without an entry message
+                printer.Print(
+                    "Check_Type(field_$field_name$, T_HASH);\n"
+                    "auto cpp_map_$field_name$ = cpp_proto->mutable_$field_name$();\n"
+                    "auto add_entry_$field_name$ = [&](VALUE key, VALUE value) {\n",
+                    "field_name", cpp_field_name(field)
+                );
+            } else if (field->is_repeated()) {
+                // Loop the array into the protobuf.
+                printer.Print(
+                    "Check_Type(field_$field_name$, T_ARRAY);\n"
+                    "for (\n"
+                    "    const VALUE* array_el = rb_array_const_ptr(field_$field_name$);\n"
+                    "    array_el < rb_array_const_ptr(field_$field_name$) + rb_array_len(field_$field_name$);\n"
+                    "    array_el++\n"
+                    ") {\n",
                     "field_name", cpp_field_name(field)
                 );
             } else if (field->is_optional()) {
                 // Do nothing if the field is not set
-                printer.Print("if (cpp_proto.has_$field_name$()) {\n", "field_name", cpp_field_name(field));
+                printer.Print("if (has_field_$field_name$()) {\n", "field_name", cpp_field_name(field));
             } else {
                 printer.Print("if (true) {\n");
             }
             printer.Indent();
 
+            // Depending on the ruby class, we do a different conversion
+            // The numeric _S macros are defined in generator_entrypoint.cpp
+            // and wrap the ruby macros to disable float-to-int coersion
             std::string single_op;
             std::string repeated_op;
             switch (field->type()) {
                 case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
                 case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
                 case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
-                    single_op = "field_$field_name$ = INT2NUM(cpp_proto.$field_name$());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, INT2NUM(array_el));\n";
+                    single_op = "cpp_proto->set_$field_name$(NUM2INT_S(field_$field_name$));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(NUM2INT_S(*array_el));\n";
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
                 case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
-                    single_op = "field_$field_name$ = UINT2NUM(cpp_proto.$field_name$());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, UINT2NUM(array_el));\n";
+                    single_op = "cpp_proto->set_$field_name$(NUM2UINT_S(field_$field_name$));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(NUM2UINT_S(*array_el));\n";
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
                 case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
                 case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
-                    single_op = "field_$field_name$ = LONG2NUM(cpp_proto.$field_name$());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, LONG2NUM(array_el));\n";
+                    single_op = "cpp_proto->set_$field_name$(NUM2LONG_S(field_$field_name$));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(NUM2LONG_S(*array_el));\n";
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
                 case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
-                    single_op = "field_$field_name$ = ULONG2NUM(cpp_proto.$field_name$());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, ULONG2NUM(array_el));\n";
+                    single_op = "cpp_proto->set_$field_name$(NUM2ULONG_S(field_$field_name$));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(NUM2ULONG_S(*array_el));\n";
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
+                    single_op = "cpp_proto->set_$field_name$(static_cast<float>(NUM2DBL_S(field_$field_name$)));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(static_cast<float>(NUM2DBL_S(*array_el)));\n";
+                    break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
-                    single_op = "field_$field_name$ = DBL2NUM(cpp_proto.$field_name$());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, DBL2NUM(array_el));\n";
+                    single_op = "cpp_proto->set_$field_name$(NUM2DBL_S(field_$field_name$));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(NUM2DBL_S(*array_el));\n";
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
-                    single_op = "field_$field_name$ = BOOL2VAL_S(cpp_proto.$field_name$());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, BOOL2VAL_S(array_el));\n";
+                    single_op = "cpp_proto->set_$field_name$(VAL2BOOL_S(field_$field_name$));\n";
+                    repeated_op = "cpp_proto->add_$field_name$(VAL2BOOL_S(*array_el));\n";
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
                 case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
-                    // Important to use the length, because .data() also has a terminating
-                    // null byte.
-                    single_op = "field_$field_name$ = rb_str_new(cpp_proto.$field_name$().data(), cpp_proto.$field_name$().length());\n";
-                    repeated_op = "rb_ary_push(field_$field_name$, rb_str_new(array_el.data(), array_el.length()));\n";
+                    // Pass two arguments to set_stringfield()
+                    single_op = (
+                        "Check_Type(field_$field_name$, T_STRING);\n"
+                        "cpp_proto->set_$field_name$(\n"
+                        "    RSTRING_PTR(field_$field_name$),\n"
+                        "    RSTRING_LEN(field_$field_name$)\n"
+                        ");\n"
+                    );
+                    repeated_op = (
+                        "Check_Type(*array_el, T_STRING);\n"
+                        "cpp_proto->add_$field_name$(\n"
+                        "    RSTRING_PTR(*array_el),\n"
+                        "    RSTRING_LEN(*array_el)\n"
+                        ");\n"
+                    );
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
                 case google::protobuf::FieldDescriptor::Type::TYPE_GROUP:
                     // Recurse to serialize the message
                     single_op = (
-                        "{\n"
-                        "    this->field_$field_name$ = $nested_message_type$::alloc();\n"
-                        "    rb_obj_call_init(this->field_$field_name$, 0, nullptr);\n"
+                        "if (CLASS_OF(field_$field_name$) != $nested_message_type$::rb_cls) {\n"
+                        "    rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
+                        "} else {\n"
                         "    $nested_message_type$* cpp_nested;\n"
-                        "    Data_Get_Struct(this->field_$field_name$, $nested_message_type$, cpp_nested);\n"
-                        "    cpp_nested->from_proto_obj(cpp_proto.$field_name$());\n"
+                        "    TypedData_Get_Struct(field_$field_name$, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        "    cpp_nested->fill_proto_obj(cpp_proto->mutable_$field_name$());\n"
                         "}\n"
                     );
                     repeated_op = (
-                        "{\n"
-                        "    VALUE new_obj = $nested_message_type$::alloc();\n"
-                        "    rb_obj_call_init(this->field_$field_name$, 0, nullptr);\n"
-                        "    rb_ary_push(field_$field_name$, new_obj);\n"
+                        "if (CLASS_OF(*array_el) != $nested_message_type$::rb_cls) {\n"
+                        "    rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
+                        "} else {\n"
                         "    $nested_message_type$* cpp_nested;\n"
-                        "    Data_Get_Struct(new_obj, $nested_message_type$, cpp_nested);\n"
-                        "    cpp_nested->from_proto_obj(array_el);\n"
+                        "    TypedData_Get_Struct(*array_el, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        "    auto pb_el = cpp_proto->add_$field_name$();\n"
+                        "    cpp_nested->fill_proto_obj(pb_el);\n"
                         "}\n"
                     );
                     break;
@@ -1016,30 +1610,113 @@ namespace rb_fastproto {
                     break;
             }
 
-            printer.Print(
-                (field->is_repeated() ? repeated_op : single_op).c_str(),
-                "field_name", cpp_field_name(field),
-                "rb_message_class_name", field->message_type() != nullptr ? ruby_proto_message_class_name(field->message_type()) : "",
-                "nested_message_type", field->message_type() != nullptr ? cpp_proto_message_wrapper_struct_name(field->message_type()) : ""
-            );
+            // Native fields were already converted when they were set. (Enums aren't copied over
+            // either way.)
+            if (is_native_field(field) && field->type() != google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                single_op = "cpp_proto->set_$field_name$(field_$field_name$);\n";
+            }
+            if (is_native_repeated(field)) {
+                repeated_op = field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM ?
+                    "(void)value;\n" :
+                    "cpp_proto->add_$field_name$(value);\n";
+            }
 
-            if (field->is_optional()) {
-                printer.Print("has_field_$field_name$ = true;\n", "field_name", cpp_field_name(field));
+            if (options.cpp_storage) {
+                // Whatever we hold is what gets serialized, so enums have to be copied too. A value
+                // the enum doesn't have is kept as an unknown field, as libprotobuf would parse it.
+                if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                    std::string store = (
+                        "if ($enum_type$_IsValid(enum_value)) {\n"
+                        "    cpp_proto->$set_or_add$_$field_name$(static_cast<$enum_type$>(enum_value));\n"
+                        "} else {\n"
+                        "    cpp_unknown_fields->AddVarint($field_number$, static_cast<uint64_t>(static_cast<int64_t>(enum_value)));\n"
+                        "}\n"
+                    );
+                    if (is_native_repeated(field)) {
+                        repeated_op = "int32_t enum_value = value;\n" + store;
+                    } else if (field->is_repeated()) {
+                        repeated_op = "int32_t enum_value = NUM2INT_S(*array_el);\n" + store;
+                    } else if (is_native_field(field)) {
+                        single_op = "int32_t enum_value = field_$field_name$;\n" + store;
+                    } else {
+                        // Required enums without a default are nil until they're set
+                        single_op =
+                            "if (field_$field_name$ != Qnil) {\n"
+                            "    int32_t enum_value = NUM2INT_S(field_$field_name$);\n"
+                            "    " + boost::replace_all_copy(store.substr(0, store.size() - 1), "\n", "\n    ") + "\n"
+                            "}\n";
+                    }
+                }
+
+                // A message type from another file may not write enums into its C++ message
+                // either, so it's encoded with its own encoder and parsed back from that.
+                if (field->message_type() != nullptr && field->message_type()->file() != file) {
+                    std::string copy = (
+                        "if (CLASS_OF($value$) != $nested_message_type$::rb_cls) {\n"
+                        "    rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
+                        "} else {\n"
+                        "    $nested_message_type$* cpp_nested;\n"
+                        "    TypedData_Get_Struct($value$, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        "    size_t nested_size = cpp_nested->compute_wire_size();\n"
+                        "    VALUE bytes = rb_str_new(nullptr, nested_size);\n"
+                        "    cpp_nested->write_wire(reinterpret_cast<uint8_t*>(RSTRING_PTR(bytes)));\n"
+                        "    $target$->ParsePartialFromArray(RSTRING_PTR(bytes), static_cast<int>(nested_size));\n"
+                        "    RB_GC_GUARD(bytes);\n"
+                        "}\n"
+                    );
+                    single_op = boost::replace_all_copy(
+                        boost::replace_all_copy(copy, "$value$", "field_$field_name$"),
+                        "$target$", "cpp_proto->mutable_$field_name$()"
+                    );
+                    repeated_op = boost::replace_all_copy(
+                        boost::replace_all_copy(copy, "$value$", "*array_el"),
+                        "$target$", "cpp_proto->add_$field_name$()"
+                    );
+                }
+            }
+
+            if (field->is_map()) {
+                repeated_op = map_entry_fill_op(file, field);
             }
 
+            std::map<std::string, std::string> vars;
+            vars["field_name"] = cpp_field_name(field);
+            vars["field_number"] = std::to_string(field->number());
+            vars["set_or_add"] = field->is_repeated() ? "add" : "set";
+            vars["enum_type"] = field->enum_type() != nullptr ? cpp_proto_enum_class_name(field->enum_type()) : "";
+            vars["rb_message_class_name"] = field->message_type() != nullptr ? ruby_proto_message_class_name(field->message_type()) : "";
+            vars["nested_message_type"] = field->message_type() != nullptr ? cpp_proto_message_wrapper_struct_name(field->message_type()) : "";
+            printer.Print(vars, (field->is_repeated() ? repeated_op : single_op).c_str());
 
             printer.Outdent();
             if (field->is_optional()) {
                 printer.Print("} else {\n"); // close off if (required | set)
-                printer.Print("   has_field_$field_name$ = false;\n", "field_name", cpp_field_name(field));
+                printer.Print("    cpp_proto->clear_$field_name$();\n", "field_name", cpp_field_name(field));
+            }
+            printer.Print(
+                field->is_map() ? "};\neach_map_entry(field_$field_name$, add_entry_$field_name$);\n" : "}\n",
+                "field_name", cpp_field_name(field)
+            );
+
+            if (options.cpp_storage) {
+                printer.Outdent();
+                printer.Print("}\n");
+            }
+            if (!has_field_member(field)) {
+                printer.Outdent();
+                printer.Print("}\n");
             }
-            printer.Print("}\n");
         }
 
         // Now set any unknown fields.
-        printer.Print("this->unknown_fields.MergeFrom(cpp_proto.GetReflection()->GetUnknownFields(cpp_proto));\n");
+        if (!options.cpp_storage) {
+            printer.Print(
+                "if (unknown_fields != nullptr) {\n"
+                "    cpp_proto->mutable_unknown_fields()->ParseFromArray(unknown_fields->data(), static_cast<int>(unknown_fields->size()));\n"
+                "}\n"
+            );
+        }
 
-        printer.Print("return Qnil;\n");
         printer.Outdent();
         printer.Print("}\n\n");
     }
@@ -1056,9 +1733,11 @@ namespace rb_fastproto {
             "    VALUE ex;\n"
             "    {\n"
             "        $class_name$* cpp_self;\n"
-            "        Data_Get_Struct(self, $class_name$, cpp_self);\n"
-            "        $cpp_proto_class$ cpp_proto;\n"
-            "        ex = cpp_self->to_proto_obj(&cpp_proto);\n"
+            "        TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
+            "        // The C++ message only lives as long as this block, so build it on the thread's arena\n"
+            "        ScopedThreadArena arena;\n"
+            "        auto cpp_proto = google::protobuf::Arena::CreateMessage<$cpp_proto_class$>(arena.get());\n"
+            "        ex = cpp_self->to_proto_obj(cpp_proto);\n"
             "        if (ex != Qnil) {\n"
             "            goto raise;\n"
             "        }\n"
@@ -1080,74 +1759,250 @@ namespace rb_fastproto {
         const std::string &class_name,
         google::protobuf::io::Printer &printer
     ) const {
+        // Serialization goes straight from our VALUEs to the wire format, so it has to hold the GVL
+        // the whole time; serialize_to_string_with_gvl is kept around as a synonym. (Only
+        // storage=cpp's libprotobuf serialization can release it.)
         printer.Print(
             "VALUE $class_name$::serialize_to_string(VALUE self) {\n"
-            "    VALUE ex;\n"
-            "    // More function pointer hax to avoid GVL...\n"
-            "    struct serialize_args {\n"
-            "        $cpp_proto_class$* cpp_proto;\n"
-            "        size_t pb_size;\n"
-            "        char* rb_buffer_ptr;\n"
-            "    };\n"
+            "    $class_name$* cpp_self;\n"
+            "    TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
             "\n"
-            "    {\n"
-            "        $class_name$* cpp_self;\n"
-            "        Data_Get_Struct(self, $class_name$, cpp_self);\n"
+            "    // A copy of a frozen String shares its memory, so this doesn't copy the bytes\n"
+            "    if (cpp_self->encoded != Qnil) {\n"
+            "        return rb_str_dup(cpp_self->encoded);\n"
+            "    }\n"
             "\n"
-            "        serialize_args args;\n"
-            "        $cpp_proto_class$ cpp_proto;\n"
-            "        ex = cpp_self->to_proto_obj(&cpp_proto);\n"
-            "        if (ex != Qnil) {\n"
-            "            goto raise;\n"
-            "        }\n"
-            "        args.cpp_proto = &cpp_proto;\n"
-            "        args.pb_size = cpp_proto.ByteSize();\n"
-            "        VALUE rb_str = rb_str_new(\"\", 0);\n"
-            "        rb_str_resize(rb_str, args.pb_size);\n"
-            "        args.rb_buffer_ptr = RSTRING_PTR(rb_str);\n"
-            "        // We want to call proto.SerializeToArray outside of the ruby GVL.\n"
-            "        // We can't convert a lambda that captures to a function pointer, so we\n"
-            "        // do stupid struct hacks.\n"
-            "        rb_thread_call_without_gvl(\n"
-            "            [](void* _args_void) -> void* {\n"
-            "                auto _args = reinterpret_cast<serialize_args*>(_args_void);\n"
-            "                _args->cpp_proto->SerializeToArray(_args->rb_buffer_ptr, static_cast<int>(_args->pb_size));\n"
-            "                return nullptr;\n"
-            "            },\n"
-            "            &args, RUBY_UBF_IO, nullptr\n"
-            "        );\n"
-            "        return rb_str;\n"
+            "    VALUE rb_str;\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+        if (options.cpp_storage) {
+            // Unless another thread is already serializing the backing C++ message, libprotobuf
+            // does it, with the fields we have used written over it first
+            printer.Print(
+                "if (cpp_self->backing != nullptr && cpp_self->serializing == 0) {\n"
+                "    rb_str = cpp_self->serialize_backing();\n"
+                "} else {\n"
+            );
+            printer.Indent();
+        }
+        printer.Print(
+            "// Sizing the message type checks all of the fields, and raises if any are wrong\n"
+            "size_t pb_size = cpp_self->compute_wire_size();\n"
+            "rb_str = rb_str_new(nullptr, pb_size);\n"
+            "cpp_self->write_wire(reinterpret_cast<uint8_t*>(RSTRING_PTR(rb_str)));\n"
+        );
+        if (options.cpp_storage) {
+            printer.Outdent();
+            printer.Print("}\n");
+        }
+        printer.Outdent();
+        printer.Print(
+            "    if (cpp_self->frozen_tree) {\n"
+            "        RB_OBJ_WRITE(self, &cpp_self->encoded, rb_str_new_frozen(rb_str));\n"
             "    }\n"
-            "    raise:\n"
-            "        rb_exc_raise(ex);\n"
-            "        return Qnil;\n"
+            "    return rb_str;\n"
             "}\n\n"
 
             "VALUE $class_name$::serialize_to_string_with_gvl(VALUE self) {\n"
-            "    VALUE ex;\n"
+            "    return serialize_to_string(self);\n"
+            "}\n\n"
+
+            // How long serialize_to_string would be, without writing anything out
+            "VALUE $class_name$::byte_size(VALUE self) {\n"
+            "    $class_name$* cpp_self;\n"
+            "    TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n",
+            "class_name", class_name
+        );
+        if (options.cpp_storage) {
+            printer.Print(
+                "    if (cpp_self->backing != nullptr && cpp_self->serializing == 0) {\n"
+                "        cpp_self->fill_proto_obj(cpp_self->backing);\n"
+                "        return SIZET2NUM(cpp_self->backing->ByteSizeLong());\n"
+                "    }\n"
+            );
+        }
+        printer.Print(
+            "    return SIZET2NUM(cpp_self->compute_wire_size());\n"
+            "}\n\n"
+        );
+
+        // serialize_many encodes a batch of messages, as an Array of Strings, or with
+        // serialize_many_delimited as one String with each message's length in front of it. Every
+        // message is sized and written with the GVL held, so nothing can change them meanwhile,
+        // except for long strings: those are left for the batch to copy in on its worker pool once
+        // the GVL is released, from frozen copies that no other thread can touch.
+        printer.Print(
+            "VALUE $class_name$::singleton_serialize_many(VALUE self, VALUE messages) {\n"
+            "    return serialize_many(messages, false);\n"
+            "}\n\n"
+            "VALUE $class_name$::singleton_serialize_many_delimited(VALUE self, VALUE messages) {\n"
+            "    return serialize_many(messages, true);\n"
+            "}\n\n"
+            "VALUE $class_name$::serialize_many(VALUE messages, bool delimited) {\n"
+            "    Check_Type(messages, T_ARRAY);\n"
+            "    long count = RARRAY_LEN(messages);\n"
+            "    VALUE sizes_buffer;\n"
+            "    size_t* sizes = ALLOCV_N(size_t, sizes_buffer, count);\n"
+            "    size_t total_size = 0;\n"
+            "    for (long i = 0; i < count; i++) {\n"
+            "        VALUE message = RARRAY_AREF(messages, i);\n"
+            "        if (CLASS_OF(message) != rb_cls) {\n"
+            "            rb_raise(rb_eTypeError, \"serialize_many needs $rb_class_name$ messages\");\n"
+            "        }\n"
+            "        $class_name$* cpp_message;\n"
+            "        TypedData_Get_Struct(message, $class_name$, &rb_data_type, cpp_message);\n"
+            "        sizes[i] = cpp_message->compute_wire_size();\n"
+            "        total_size += (delimited ? varint_size(sizes[i]) : 0) + sizes[i];\n"
+            "    }\n"
             "\n"
-            "    {\n"
-            "        $class_name$* cpp_self;\n"
-            "        Data_Get_Struct(self, $class_name$, cpp_self);\n"
+            "    SerializeBatch* batch;\n"
+            "    VALUE rb_batch = serialize_batch_new(&batch);\n"
+            "    VALUE result = delimited ? rb_str_new(nullptr, total_size) : rb_ary_new_capa(count);\n"
+            "    if (delimited) {\n"
+            "        batch->pin(result);\n"
+            "    } else {\n"
+            "        for (long i = 0; i < count; i++) {\n"
+            "            VALUE string = rb_str_new(nullptr, sizes[i]);\n"
+            "            rb_ary_push(result, string);\n"
+            "            batch->pin(string);\n"
+            "        }\n"
+            "    }\n"
             "\n"
-            "        $cpp_proto_class$ cpp_proto;\n"
-            "        ex = cpp_self->to_proto_obj(&cpp_proto);\n"
-            "        if (ex != Qnil) {\n"
-            "            goto raise;\n"
+            "    {\n"
+            "        DeferStringCopies defer(batch);\n"
+            "        uint8_t* target = delimited ? reinterpret_cast<uint8_t*>(RSTRING_PTR(result)) : nullptr;\n"
+            "        for (long i = 0; i < count; i++) {\n"
+            "            $class_name$* cpp_message;\n"
+            "            TypedData_Get_Struct(RARRAY_AREF(messages, i), $class_name$, &rb_data_type, cpp_message);\n"
+            "            if (delimited) {\n"
+            "                target = write_varint(target, sizes[i]);\n"
+            "                target = cpp_message->write_wire(target);\n"
+            "            } else {\n"
+            "                cpp_message->write_wire(reinterpret_cast<uint8_t*>(RSTRING_PTR(RARRAY_AREF(result, i))));\n"
+            "            }\n"
             "        }\n"
-            "        VALUE rb_str = rb_str_new(\"\", 0);\n"
-            "        auto pb_size = cpp_proto.ByteSize();\n"
-            "        rb_str_resize(rb_str, pb_size);\n"
-            "        cpp_proto.SerializeToArray(RSTRING_PTR(rb_str), static_cast<int>(pb_size));\n"
-            "        return rb_str;\n"
             "    }\n"
-            "    raise:\n"
-            "        rb_exc_raise(ex);\n"
-            "        return Qnil;\n"
+            "    batch->write_copies();\n"
+            "\n"
+            "    ALLOCV_END(sizes_buffer);\n"
+            "    RB_GC_GUARD(rb_batch);\n"
+            "    RB_GC_GUARD(messages);\n"
+            "    return result;\n"
             "}\n\n",
             "class_name", class_name,
-            "cpp_proto_class", cpp_proto_class_name(message_type)
+            "rb_class_name", ruby_proto_message_class_name(message_type)
+        );
+    }
+
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_deep_freeze(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        // deep_freeze freezes the message, and everything it holds: strings, arrays & their
+        // elements, and sub-messages (by deep freezing them too). frozen_tree is set before going
+        // down into the fields, so a message that contains itself doesn't go round forever.
+        printer.Print(
+            "VALUE $class_name$::deep_freeze(VALUE self) {\n"
+            "    $class_name$* cpp_self;\n"
+            "    TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
+            "    if (cpp_self->frozen_tree) {\n"
+            "        return self;\n"
+            "    }\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+        if (has_lazy_fields(message_type)) {
+            // Anything parse_lazy left undecoded has to be decoded now, while we can still change
+            printer.Print(
+                "if (cpp_self->lazy_fields != nullptr) {\n"
+                "    cpp_self->decode_lazy(0);\n"
+                "}\n"
+            );
+        }
+        if (options.cpp_storage) {
+            // Likewise anything still in the backing C++ message
+            printer.Print(
+                "if (cpp_self->backing != nullptr) {\n"
+                "    cpp_self->read_backing(0);\n"
+                "}\n"
+            );
+        }
+        printer.Print(
+            "cpp_self->frozen_tree = true;\n"
+            "rb_obj_freeze(self);\n"
+            "\n"
         );
+
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+            if (is_native_field(field)) {
+                continue;
+            }
+            std::map<std::string, std::string> vars;
+            vars["field_name"] = cpp_field_name(field);
+            vars["field"] = field_expr(field, "cpp_self->");
+
+            if (is_native_repeated(field)) {
+                printer.Print(vars, "rb_obj_freeze($field$);\n");
+            } else if (field->is_map()) {
+                // Hashes freeze their string keys already, so it's only the values that need it
+                auto map_value = field->message_type()->map_value();
+                vars["freeze_value"] = map_value->message_type() != nullptr ?
+                    "if (CLASS_OF(value) == " + cpp_proto_message_wrapper_struct_name(map_value->message_type()) + "::rb_cls) {\n"
+                    "            " + cpp_proto_message_wrapper_struct_name(map_value->message_type()) + "::deep_freeze(value);\n"
+                    "        }\n" :
+                    "rb_obj_freeze(value);\n";
+                printer.Print(vars,
+                    "if (RB_TYPE_P($field$, T_HASH)) {\n"
+                    "    auto freeze_value = [](VALUE key, VALUE value) {\n"
+                    "        $freeze_value$"
+                    "    };\n"
+                    "    each_map_entry($field$, freeze_value);\n"
+                    "}\n"
+                    "rb_obj_freeze($field$);\n"
+                );
+            } else if (field->message_type() != nullptr) {
+                vars["nested_message_type"] = cpp_proto_message_wrapper_struct_name(field->message_type());
+                if (field->is_repeated()) {
+                    printer.Print(vars,
+                        "if (RB_TYPE_P($field$, T_ARRAY)) {\n"
+                        "    for (long i = 0; i < RARRAY_LEN($field$); i++) {\n"
+                        "        VALUE element = RARRAY_AREF($field$, i);\n"
+                        "        if (CLASS_OF(element) == $nested_message_type$::rb_cls) {\n"
+                        "            $nested_message_type$::deep_freeze(element);\n"
+                        "        }\n"
+                        "    }\n"
+                        "}\n"
+                        "rb_obj_freeze($field$);\n"
+                    );
+                } else {
+                    printer.Print(vars,
+                        "if (CLASS_OF($field$) == $nested_message_type$::rb_cls) {\n"
+                        "    $nested_message_type$::deep_freeze($field$);\n"
+                        "}\n"
+                    );
+                }
+            } else if (field->is_repeated()) {
+                // Strings are the only elements that aren't already immutable
+                printer.Print(vars,
+                    "if (RB_TYPE_P($field$, T_ARRAY)) {\n"
+                    "    for (long i = 0; i < RARRAY_LEN($field$); i++) {\n"
+                    "        rb_obj_freeze(RARRAY_AREF($field$, i));\n"
+                    "    }\n"
+                    "}\n"
+                    "rb_obj_freeze($field$);\n"
+                );
+            } else {
+                printer.Print(vars, "rb_obj_freeze($field$);\n");
+            }
+        }
+
+        printer.Print("return self;\n");
+        printer.Outdent();
+        printer.Print("}\n\n");
     }
 
     void RBFastProtoCodeGenerator::write_cpp_message_struct_parser(
@@ -1158,43 +2013,39 @@ namespace rb_fastproto {
     ) const {
         printer.Print(
             "VALUE $class_name$::parse(VALUE self, VALUE buffer) {\n"
-            "    // VALUE ex;\n"
-            "    // More function pointer hax to avoid GVL...\n"
-            "    struct parse_args {\n"
-            "        $cpp_proto_class$* cpp_proto;\n"
-            "        size_t pb_size;\n"
-            "        char* rb_buffer_ptr;\n"
-            "    };\n"
+            "    if (RB_OBJ_FROZEN(self)) {\n"
+            "        rb_raise(rb_eRuntimeError, \"Message is frozen\");\n"
+            "    }\n"
+            "    Check_Type(buffer, T_STRING);\n"
+            "    $class_name$* cpp_self;\n"
+            "    TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
+            "$check_serializing$"
             "\n"
-            "    {\n"
-            "        $class_name$* cpp_self;\n"
-            "        Data_Get_Struct(self, $class_name$, cpp_self);\n"
-            "        parse_args args;"
-            "        args.pb_size = RSTRING_LEN(buffer);\n"
-            "        args.rb_buffer_ptr = RSTRING_PTR(buffer);\n"
-            "        $cpp_proto_class$ cpp_proto;\n"
-            "        args.cpp_proto = &cpp_proto;\n"
+            "    // Start again from a default message, the same as ParseFromArray would. We are still\n"
+            "    // the same field of our parent, though.\n"
+            "    VALUE parent = cpp_self->parent;\n"
+            "    auto notify_parent = cpp_self->notify_parent;\n"
+            "    int parent_field_number = cpp_self->parent_field_number;\n"
+            "    cpp_self->~$destructor_name$();\n"
+            "    new(cpp_self) $class_name$(self);\n"
+            "    RB_OBJ_WRITE(self, &cpp_self->parent, parent);\n"
+            "    cpp_self->notify_parent = notify_parent;\n"
+            "    cpp_self->parent_field_number = parent_field_number;\n"
             "\n"
-            "        // We want to call proto.ParseFromArray outside of the ruby GVL.\n"
-            "        // We can't convert a lambda that captures to a function pointer, so we\n"
-            "        // do stupid struct hacks.\n"
-            "        rb_thread_call_without_gvl(\n"
-            "            [](void* _args_void) -> void* {\n"
-            "                auto _args = reinterpret_cast<parse_args*>(_args_void);\n"
-            "                _args->cpp_proto->ParseFromArray(_args->rb_buffer_ptr, static_cast<int>(_args->pb_size));\n"
-            "                return nullptr;\n"
-            "            },\n"
-            "            &args, RUBY_UBF_IO, nullptr\n"
-            "        );\n"
-            "        cpp_self->from_proto_obj(cpp_proto);\n"
-            "        return Qnil;\n"
-            "    }\n"
-            "    // raise:\n"
-            "    //    rb_exc_raise(ex);\n"
-            "    //    return Qnil;\n"
+            "$parse_call$"
+            "    return Qnil;\n"
             "}\n\n",
             "class_name", class_name,
-            "cpp_proto_class", cpp_proto_class_name(message_type)
+            "destructor_name", cpp_proto_message_wrapper_struct_name_no_ns(message_type),
+            // Another thread may be reading our backing C++ message with the GVL released
+            "check_serializing", !options.cpp_storage ? "" :
+                "    if (cpp_self->serializing > 0) {\n"
+                "        rb_raise(rb_eRuntimeError, \"Message is being serialized\");\n"
+                "    }\n",
+            "parse_call", options.cpp_storage ?
+                "    cpp_self->adopt_backing(parse_backing(buffer), RSTRING_LEN(buffer));\n" :
+                "    auto ptr = reinterpret_cast<const uint8_t*>(RSTRING_PTR(buffer));\n"
+                "    cpp_self->parse_wire(ptr, ptr + RSTRING_LEN(buffer), 0, 0, Qnil);\n"
         );
     }
 
@@ -1208,13 +2059,13 @@ namespace rb_fastproto {
         printer.Indent();
 
         printer.Print(
-            "if (rb_funcall(other, rb_intern(\"is_a?\"), 1, rb_cls) != Qtrue) {\n"
+            "if (!RTEST(rb_obj_is_kind_of(other, rb_cls))) {\n"
             "  return Qfalse;\n"
             "}\n"
             "\n"
             "$class_name$ *cpp_self, *cpp_other;\n"
-            "Data_Get_Struct(self, $class_name$, cpp_self);\n"
-            "Data_Get_Struct(other, $class_name$, cpp_other);\n"
+            "TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
+            "TypedData_Get_Struct(other, $class_name$, &rb_data_type, cpp_other);\n"
             "\n"
             "if (cpp_self->is_default_value && cpp_other->is_default_value) {\n"
             "  return Qtrue;\n"
@@ -1222,6 +2073,28 @@ namespace rb_fastproto {
             "\n",
             "class_name", class_name
         );
+        if (has_lazy_fields(message_type)) {
+            printer.Print(
+                "if (cpp_self->lazy_fields != nullptr) {\n"
+                "  cpp_self->decode_lazy(0);\n"
+                "}\n"
+                "if (cpp_other->lazy_fields != nullptr) {\n"
+                "  cpp_other->decode_lazy(0);\n"
+                "}\n"
+                "\n"
+            );
+        }
+        if (options.cpp_storage) {
+            printer.Print(
+                "if (cpp_self->backing != nullptr) {\n"
+                "  cpp_self->read_backing(0);\n"
+                "}\n"
+                "if (cpp_other->backing != nullptr) {\n"
+                "  cpp_other->read_backing(0);\n"
+                "}\n"
+                "\n"
+            );
+        }
 
         for (int i = 0; i < message_type->field_count(); i++) {
             auto field = message_type->field(i);
@@ -1236,12 +2109,33 @@ namespace rb_fastproto {
                 );
             }
 
+            if (is_native_field(field)) {
+                // Native values can be compared directly, but a nil enum has to match too
+                if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                    printer.Print(
+                        "if (cpp_self->has_field_$field_name$() != cpp_other->has_field_$field_name$()) {\n"
+                        "  return Qfalse;\n"
+                        "}\n",
+                        "field_name", cpp_field_name(field)
+                    );
+                }
+                printer.Print(
+                    "if (cpp_self->field_$field_name$ != cpp_other->field_$field_name$) {\n"
+                    "  return Qfalse;\n"
+                    "}\n"
+                    "\n",
+                    "field_name", cpp_field_name(field)
+                );
+                continue;
+            }
+
             printer.Print(
-                "if (rb_funcall(cpp_self->field_$field_name$, rb_intern(\"==\"), 1, cpp_other->field_$field_name$) == Qfalse) {\n"
+                "if (rb_funcall($self_field$, id_eq, 1, $other_field$) == Qfalse) {\n"
                 "  return Qfalse;\n"
                 "}\n"
                 "\n",
-                "field_name", cpp_field_name(field)
+                "self_field", field_expr(field, "cpp_self->"),
+                "other_field", field_expr(field, "cpp_other->")
             );
         }
 
@@ -1262,35 +2156,63 @@ namespace rb_fastproto {
 
         printer.Print(
             "$class_name$* cpp_self;\n"
-            "Data_Get_Struct(self, $class_name$, cpp_self);\n"
+            "TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n"
             "\n",
             "class_name", class_name
         );
+        if (has_lazy_fields(message_type)) {
+            printer.Print(
+                "if (cpp_self->lazy_fields != nullptr) {\n"
+                "  cpp_self->decode_lazy(0);\n"
+                "}\n"
+                "\n"
+            );
+        }
+        if (options.cpp_storage) {
+            printer.Print(
+                "if (cpp_self->backing != nullptr) {\n"
+                "  cpp_self->read_backing(0);\n"
+                "}\n"
+                "\n"
+            );
+        }
 
         printer.Print("std::string str(\"#<$rb_class_name$\");\n", "rb_class_name", ruby_proto_message_class_name(message_type));
         for (int i = 0; i < message_type->field_count(); i++) {
             auto field = message_type->field(i);
             printer.Print("str += \" $field_name$=\";\n", "field_name", field->name());
 
-            if (field->is_optional()) {
+            if (is_native_field(field)) {
                 printer.Print(
-                    "if (cpp_self->has_field_$field_name$ && cpp_self->field_$field_name$ != Qnil) {\n"
-                    "  VALUE d = rb_funcall(cpp_self->field_$field_name$, rb_intern(\"inspect\"), 0);\n"
+                    "if ($is_set$) {\n"
+                    "  VALUE d = rb_funcall($value$, id_inspect, 0);\n"
                     "  str += StringValueCStr(d);\n"
                     "} else {\n"
                     "  str += \"<unset>\";\n"
                     "}\n",
-                    "field_name", cpp_field_name(field)
+                    "is_set", has_presence_bit(field) ? "cpp_self->has_field_" + cpp_field_name(field) + "()" : "true",
+                    "value", native_to_value(field, "cpp_self->field_" + cpp_field_name(field))
+                );
+            } else if (field->is_optional()) {
+                printer.Print(
+                    "if (cpp_self->has_field_$field_name$() && $field$ != Qnil) {\n"
+                    "  VALUE d = rb_funcall($field$, id_inspect, 0);\n"
+                    "  str += StringValueCStr(d);\n"
+                    "} else {\n"
+                    "  str += \"<unset>\";\n"
+                    "}\n",
+                    "field_name", cpp_field_name(field),
+                    "field", field_expr(field, "cpp_self->")
                 );
             } else {
                 printer.Print(
-                    "if (cpp_self->field_$field_name$ != Qnil) {\n"
-                    "  VALUE d = rb_funcall(cpp_self->field_$field_name$, rb_intern(\"inspect\"), 0);\n"
+                    "if ($field$ != Qnil) {\n"
+                    "  VALUE d = rb_funcall($field$, id_inspect, 0);\n"
                     "  str += StringValueCStr(d);\n"
                     "} else {\n"
                     "  str += \"<unset>\";\n"
                     "}\n",
-                    "field_name", cpp_field_name(field)
+                    "field", field_expr(field, "cpp_self->")
                 );
             }
         }
@@ -1313,30 +2235,56 @@ namespace rb_fastproto {
 
         printer.Print(
             "$class_name$* cpp_self;\n"
-            "Data_Get_Struct(self, $class_name$, cpp_self);\n\n",
+            "TypedData_Get_Struct(self, $class_name$, &rb_data_type, cpp_self);\n\n",
             "class_name", class_name
         );
+        if (has_lazy_fields(message_type)) {
+            printer.Print(
+                "if (cpp_self->lazy_fields != nullptr) {\n"
+                "  cpp_self->decode_lazy(0);\n"
+                "}\n"
+                "\n"
+            );
+        }
+        if (options.cpp_storage) {
+            printer.Print(
+                "if (cpp_self->backing != nullptr) {\n"
+                "  cpp_self->read_backing(0);\n"
+                "}\n"
+                "\n"
+            );
+        }
 
         printer.Print("auto hash = rb_hash_new();\n\n");
 
         for (int i = 0; i < message_type->field_count(); i++) {
             auto field = message_type->field(i);
 
-            if (field->is_optional()) {
+            if (is_native_field(field)) {
+                // Numbers go into the hash as they are
+                printer.Print(
+                    "if ($is_set$) {\n"
+                    "  rb_hash_aset(hash, sym_$cpp_field_name$, $value$);\n"
+                    "}\n\n",
+                    "is_set", has_presence_bit(field) ? "cpp_self->has_field_" + cpp_field_name(field) + "()" : "true",
+                    "cpp_field_name", cpp_field_name(field),
+                    "value", native_to_value(field, "cpp_self->field_" + cpp_field_name(field))
+                );
+            } else if (field->is_optional()) {
                 printer.Print(
-                    "if (cpp_self->has_field_$cpp_field_name$ && cpp_self->field_$cpp_field_name$ != Qnil) {\n"
-                    "  rb_hash_aset(hash, ID2SYM(rb_intern(\"$rb_field_name$\")), rb_funcall(cls_fastproto_message, rb_intern(\"to_hash\"), 1, cpp_self->field_$cpp_field_name$));\n"
+                    "if (cpp_self->has_field_$cpp_field_name$() && $field$ != Qnil) {\n"
+                    "  rb_hash_aset(hash, sym_$cpp_field_name$, rb_funcall(cls_fastproto_message, id_to_hash, 1, $field$));\n"
                     "}\n\n",
-                    "rb_field_name", field->name(),
-                    "cpp_field_name", cpp_field_name(field)
+                    "cpp_field_name", cpp_field_name(field),
+                    "field", field_expr(field, "cpp_self->")
                 );
             } else {
                 printer.Print(
-                    "if (cpp_self->field_$cpp_field_name$ != Qnil) {\n"
-                    "  rb_hash_aset(hash, ID2SYM(rb_intern(\"$rb_field_name$\")), rb_funcall(cls_fastproto_message, rb_intern(\"to_hash\"), 1, cpp_self->field_$cpp_field_name$));\n"
+                    "if ($field$ != Qnil) {\n"
+                    "  rb_hash_aset(hash, sym_$cpp_field_name$, rb_funcall(cls_fastproto_message, id_to_hash, 1, $field$));\n"
                     "}\n\n",
-                    "rb_field_name", field->name(),
-                    "cpp_field_name", cpp_field_name(field)
+                    "cpp_field_name", cpp_field_name(field),
+                    "field", field_expr(field, "cpp_self->")
                 );
             }
         }
@@ -1355,8 +2303,52 @@ namespace rb_fastproto {
     ) const {
         printer.Print(
             "VALUE $class_name$::singleton_parse(VALUE self, VALUE buffer) {\n"
-            "  VALUE msg = rb_funcall(rb_cls, rb_intern(\"new\"), 0);\n"
-            "  rb_funcall(msg, rb_intern(\"parse\"), 1, buffer);\n"
+            "  Check_Type(buffer, T_STRING);\n"
+            "  VALUE msg = new_for_parse();\n"
+            "  $class_name$* cpp_msg;\n"
+            "  TypedData_Get_Struct(msg, $class_name$, &rb_data_type, cpp_msg);\n"
+            "$parse_call$"
+            "  return msg;\n"
+            "}\n\n",
+            "class_name", class_name,
+            // storage=cpp has libprotobuf parse into a C++ message that we keep hold of
+            "parse_call", options.cpp_storage ?
+                "  cpp_msg->adopt_backing(parse_backing(buffer), RSTRING_LEN(buffer));\n" :
+                "  auto ptr = reinterpret_cast<const uint8_t*>(RSTRING_PTR(buffer));\n"
+                "  cpp_msg->parse_wire(ptr, ptr + RSTRING_LEN(buffer), 0, 0, Qnil);\n"
+        );
+
+        // parse_shared is parse for big string & bytes fields: they're made as substrings that
+        // share the (frozen) buffer's memory, rather than copies. The buffer is kept alive for as
+        // long as any of them are, so it suits parsing large blobs more than lots of small strings.
+        printer.Print(
+            "VALUE $class_name$::singleton_parse_shared(VALUE self, VALUE buffer) {\n"
+            "  Check_Type(buffer, T_STRING);\n"
+            "  VALUE source = rb_str_new_frozen(buffer);\n"
+            "  VALUE msg = new_for_parse();\n"
+            "  $class_name$* cpp_msg;\n"
+            "  TypedData_Get_Struct(msg, $class_name$, &rb_data_type, cpp_msg);\n"
+            "  auto ptr = reinterpret_cast<const uint8_t*>(RSTRING_PTR(source));\n"
+            "  cpp_msg->parse_wire(ptr, ptr + RSTRING_LEN(source), 0, 0, source);\n"
+            "  RB_GC_GUARD(source);\n"
+            "  return msg;\n"
+            "}\n\n",
+            "class_name", class_name
+        );
+
+        // parse_lazy goes one step further than parse_shared: message fields are only found, not
+        // decoded, until they're first read. Ones that are never read are written back out as the
+        // bytes they were parsed from, so passing most of a message on untouched is cheap.
+        printer.Print(
+            "VALUE $class_name$::singleton_parse_lazy(VALUE self, VALUE buffer) {\n"
+            "  Check_Type(buffer, T_STRING);\n"
+            "  VALUE source = rb_str_new_frozen(buffer);\n"
+            "  VALUE msg = new_for_parse();\n"
+            "  $class_name$* cpp_msg;\n"
+            "  TypedData_Get_Struct(msg, $class_name$, &rb_data_type, cpp_msg);\n"
+            "  auto ptr = reinterpret_cast<const uint8_t*>(RSTRING_PTR(source));\n"
+            "  cpp_msg->parse_lazy_wire(ptr, ptr + RSTRING_LEN(source), source);\n"
+            "  RB_GC_GUARD(source);\n"
             "  return msg;\n"
             "}\n\n",
             "class_name", class_name
@@ -1385,7 +2377,7 @@ namespace rb_fastproto {
         );
 
         printer.Print(
-            "auto fields = rb_funcall(rb_cls, rb_intern(\"fields\"), 0);\n\n"
+            "auto fields = rb_funcall(rb_cls, id_fields, 0);\n\n"
         );
 
         for (int i = 0; i < message_type->field_count(); i++) {
@@ -1444,8 +2436,28 @@ namespace rb_fastproto {
 
         printer.Print("fields = rb_hash_new();\n");
 
-        for(int i =  0; i < message_type->field_count(); i++) {
-            auto field = message_type->field(i);
+        // Adds the Fastproto::Field for field to the hash called fields. A map field's one is a
+        // FieldMap, which holds a Field each for its keys & values instead of an entry class.
+        std::function<void(const google::protobuf::FieldDescriptor*, const std::string&)> print_field = [&](
+            const google::protobuf::FieldDescriptor* field,
+            const std::string &fields
+        ) {
+            if (field->is_map()) {
+                printer.Print("{\n");
+                printer.Indent();
+                printer.Print("auto map_fields = rb_hash_new();\n");
+                print_field(field->message_type()->map_key(), "map_fields");
+                print_field(field->message_type()->map_value(), "map_fields");
+                printer.Print(
+                    "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_map, rb_intern(\"new\"), 5, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), Qtrue, rb_hash_aref(map_fields, LONG2FIX(1)), rb_hash_aref(map_fields, LONG2FIX(2))));\n",
+                    "fields", fields,
+                    "field_number", std::to_string(field->number()),
+                    "field_name", field->name()
+                );
+                printer.Outdent();
+                printer.Print("}\n");
+                return;
+            }
 
             switch (field->type()) {
                 case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
@@ -1459,7 +2471,8 @@ namespace rb_fastproto {
                 case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
                 case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_integer, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_integer, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
@@ -1468,7 +2481,8 @@ namespace rb_fastproto {
                 case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
                 case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_float, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_float, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
@@ -1476,7 +2490,8 @@ namespace rb_fastproto {
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_bool, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_bool, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
@@ -1484,7 +2499,8 @@ namespace rb_fastproto {
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_bytes, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_bytes, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
@@ -1492,7 +2508,8 @@ namespace rb_fastproto {
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_string, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_string, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
@@ -1526,7 +2543,8 @@ namespace rb_fastproto {
                     }
 
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_enum, rb_intern(\"new\"), 5, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$, enum_value_to_name, enum_name_to_value));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_enum, rb_intern(\"new\"), 5, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$, enum_value_to_name, enum_name_to_value));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
@@ -1538,7 +2556,8 @@ namespace rb_fastproto {
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_message, rb_intern(\"new\"), 4, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$, $proxy_class$::rb_cls));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_message, rb_intern(\"new\"), 4, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$, $proxy_class$::rb_cls));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse",
@@ -1547,7 +2566,8 @@ namespace rb_fastproto {
                     break;
                 case google::protobuf::FieldDescriptor::Type::TYPE_GROUP:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_group, rb_intern(\"new\"), 4, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$, $proxy_class$::rb_cls));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_group, rb_intern(\"new\"), 4, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$, $proxy_class$::rb_cls));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse",
@@ -1556,13 +2576,18 @@ namespace rb_fastproto {
                     break;
                 default:
                     printer.Print(
-                        "rb_hash_aset(fields, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_unknown, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "rb_hash_aset($fields$, LONG2FIX($field_number$), rb_funcall(cls_fastproto_field_unknown, rb_intern(\"new\"), 3, LONG2FIX($field_number$), rb_str_new2(\"$field_name$\"), $field_repeated$));\n",
+                        "fields", fields,
                         "field_number", std::to_string(field->number()),
                         "field_name", field->name(),
                         "field_repeated", field->is_repeated() ? "Qtrue" : "Qfalse"
                     );
                     break;
             }
+        };
+
+        for (int i = 0; i < message_type->field_count(); i++) {
+            print_field(message_type->field(i), "fields");
         }
 
         printer.Print(
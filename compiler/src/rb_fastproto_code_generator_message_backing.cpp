@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <map>
+
+#include "rb_fastproto_code_generator.h"
+
+// storage=cpp: messages that parse reads keep the libprotobuf message it read them into as their
+// backing, and a bit for each field that is still only in there. The first time a field is used
+// it is converted into its VALUE (or native value) like any other, and its bit cleared; from then
+// on the message struct's copy is the real one. Message fields of types in the same file take
+// their sub-message out of the backing rather than converting it, so they stay backed in turn.
+//
+// serialize_to_string writes the fields that have been used back over the backing (see
+// fill_proto_obj) and has libprotobuf encode it, so a message that is parsed, has a couple of
+// fields looked at and is then serialized again only ever converts those fields.
+namespace rb_fastproto {
+    static std::string backing_to_value(const google::protobuf::FieldDescriptor* field, const std::string &expr) {
+        switch (field->type()) {
+            case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                // Binary, the same as parse_wire makes them
+                return "rb_str_new(" + expr + ".data(), " + expr + ".size())";
+            case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                return "INT2NUM(static_cast<int32_t>(" + expr + "))";
+            default:
+                return native_to_value(field, expr);
+        }
+    }
+
+    void RBFastProtoCodeGenerator::write_header_message_struct_backing(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        int words = std::max(1, (message_type->field_count() + 31) / 32);
+        printer.Print(
+            "// The C++ message we were parsed into, or nullptr. The fields whose unread bit is set\n"
+            "// haven't been converted out of it yet.\n"
+            "$cpp_proto_class$* backing;\n"
+            "uint32_t unread_bits[$words$];\n"
+            "// How many serialize_to_string calls are reading backing with the GVL released\n"
+            "int serializing;\n"
+            "// The length of the buffer backing was parsed from, which stands in for its size in memory\n"
+            "size_t backing_size;\n"
+            "void adopt_backing($cpp_proto_class$* proto, size_t size);\n"
+            "void read_backing(int field_number);\n"
+            "static $cpp_proto_class$* parse_backing(VALUE buffer);\n"
+            "VALUE serialize_backing();\n",
+            "cpp_proto_class", cpp_proto_class_name(message_type),
+            "words", std::to_string(words)
+        );
+
+        for (int j = 0; j < message_type->field_count(); j++) {
+            printer.Print(
+                "bool unread_field_$field_name$() const { return (unread_bits[$word$] & $mask$) != 0; }\n"
+                "void clear_unread_field_$field_name$() { unread_bits[$word$] &= ~$mask$; }\n",
+                "field_name", cpp_field_name(message_type->field(j)),
+                "word", std::to_string(j / 32),
+                "mask", std::to_string(1u << (j % 32)) + "u"
+            );
+        }
+    }
+
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_backing(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        auto cpp_proto_class = cpp_proto_class_name(message_type);
+
+        // Takes ownership of proto, leaving every field unread. Unknown fields are taken out and
+        // kept as bytes like ours straight away, so there's only ever one copy of them to keep up
+        // to date. size is what gets reported to the GC for it; sub-messages taken out of a
+        // parent's backing report 0, since the parent's size already covers them.
+        printer.Print(
+            "void $class_name$::adopt_backing($cpp_proto_class$* proto, size_t size) {\n"
+            "    backing = proto;\n"
+            "    backing_size = size;\n"
+            "    delete unknown_fields;\n"
+            "    unknown_fields = nullptr;\n"
+            "    if (!proto->unknown_fields().empty()) {\n"
+            "        unknown_fields = new std::string();\n"
+            "        proto->unknown_fields().SerializeToString(unknown_fields);\n"
+            "        proto->mutable_unknown_fields()->Clear();\n"
+            "    }\n"
+            "    fixed_size_valid = false;\n",
+            "class_name", class_name,
+            "cpp_proto_class", cpp_proto_class
+        );
+        int words = std::max(1, (message_type->field_count() + 31) / 32);
+        for (int word = 0; word < words; word++) {
+            int bits = std::min(32, message_type->field_count() - word * 32);
+            printer.Print(
+                "    unread_bits[$word$] = $mask$;\n",
+                "word", std::to_string(word),
+                "mask", bits <= 0 ? "0u" : bits == 32 ? "0xffffffffu" : std::to_string((1u << bits) - 1) + "u"
+            );
+        }
+        printer.Print(
+            "    report_native_memory();\n"
+            "}\n\n"
+        );
+
+        // The buffer is parsed from a frozen copy, which nothing can change while the GVL is
+        // released. Nothing is reachable from ruby until it's done, so a failed parse just
+        // deletes what it made.
+        printer.Print(
+            "$cpp_proto_class$* $class_name$::parse_backing(VALUE buffer) {\n"
+            "    VALUE source = rb_str_new_frozen(buffer);\n"
+            "    auto proto = new $cpp_proto_class$();\n"
+            "    bool parsed = parse_backing_without_gvl(proto, RSTRING_PTR(source), RSTRING_LEN(source));\n"
+            "    RB_GC_GUARD(source);\n"
+            "    if (!parsed) {\n"
+            "        delete proto;\n"
+            "        raise_decode_error(\"$message_name$\");\n"
+            "    }\n"
+            "    return proto;\n"
+            "}\n\n",
+            "class_name", class_name,
+            "cpp_proto_class", cpp_proto_class,
+            "message_name", message_type->full_name()
+        );
+
+        // Brings the field out of backing, if it hasn't been already. 0 means every field.
+        printer.Print(
+            "void $class_name$::read_backing(int field_number) {\n"
+            "    fixed_size_valid = false;\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+
+        for (int j = 0; j < message_type->field_count(); j++) {
+            auto field = message_type->field(j);
+            std::map<std::string, std::string> vars;
+            vars["field_name"] = cpp_field_name(field);
+            vars["field_number"] = std::to_string(field->number());
+            vars["native_type"] = native_type_for_field(field);
+            vars["cpp_proto_class"] = cpp_proto_class;
+            vars["slot"] = field_slot_expr(field, "");
+
+            printer.Print(vars,
+                "if ((field_number == 0 || field_number == $field_number$) && unread_field_$field_name$()) {\n"
+                "    clear_unread_field_$field_name$();\n"
+            );
+            printer.Indent();
+
+            std::string set_has = has_presence_bit(field) ? "set_has_field_$field_name$(true);\n" : "";
+
+            if (field->is_map()) {
+                // The C++ map can't give its values up, so message values are copies
+                auto map_value = field->message_type()->map_value();
+                vars["convert_key"] = backing_to_value(field->message_type()->map_key(), "entry.first");
+                printer.Print(vars,
+                    "if (backing->$field_name$_size() > 0) {\n"
+                    "    VALUE hash = own_hash(rb_self, $slot$);\n"
+                    "    for (const auto &entry : backing->$field_name$()) {\n"
+                );
+                printer.Indent();
+                printer.Indent();
+                if (map_value->message_type() != nullptr) {
+                    vars["nested_message_type"] = cpp_proto_message_wrapper_struct_name(map_value->message_type());
+                    vars["nested_proto_class"] = cpp_proto_class_name(map_value->message_type());
+                    printer.Print(vars,
+                        "VALUE nested = $nested_message_type$::new_for_parse();\n"
+                        "$nested_message_type$* cpp_nested;\n"
+                        "TypedData_Get_Struct(nested, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                    );
+                    printer.Print(vars,
+                        map_value->message_type()->file() == file ?
+                            "cpp_nested->adopt_backing(new $nested_proto_class$(entry.second), 0);\n" :
+                            "VALUE bytes = backing_to_string(entry.second);\n"
+                            "auto ptr = reinterpret_cast<const uint8_t*>(RSTRING_PTR(bytes));\n"
+                            "cpp_nested->parse_wire(ptr, ptr + RSTRING_LEN(bytes), 0, 0, Qnil);\n"
+                            "RB_GC_GUARD(bytes);\n"
+                    );
+                    printer.Print(vars,
+                        "rb_hash_aset(hash, $convert_key$, nested);\n"
+                        "RB_GC_GUARD(nested);\n"
+                    );
+                } else {
+                    vars["convert_value"] = backing_to_value(map_value, "entry.second");
+                    printer.Print(vars, "rb_hash_aset(hash, $convert_key$, $convert_value$);\n");
+                }
+                printer.Outdent();
+                printer.Outdent();
+                printer.Print(
+                    "    }\n"
+                    "}\n"
+                );
+            } else if (field->message_type() != nullptr) {
+                vars["nested_message_type"] = cpp_proto_message_wrapper_struct_name(field->message_type());
+                vars["nested_proto_class"] = cpp_proto_class_name(field->message_type());
+
+                // Types from other files may not be backed, so they're handed the encoded message
+                // to parse instead. Ours take it over, unless serialize_to_string is reading backing
+                // with the GVL released: it can't be changed while it is, so they get a copy.
+                std::string adopt = field->message_type()->file() == file ?
+                    "cpp_nested->adopt_backing(serializing > 0 ? new $nested_proto_class$($element$) : $release$, 0);\n" :
+                    "VALUE bytes = backing_to_string($element$);\n"
+                    "auto ptr = reinterpret_cast<const uint8_t*>(RSTRING_PTR(bytes));\n"
+                    "cpp_nested->parse_wire(ptr, ptr + RSTRING_LEN(bytes), 0, 0, Qnil);\n"
+                    "RB_GC_GUARD(bytes);\n"
+                    "RB_GC_GUARD(nested);\n";
+
+                if (field->is_repeated()) {
+                    // Elements are released from the end, so each wrapper is made first
+                    vars["element"] = "backing->" + cpp_field_name(field) + "(i)";
+                    vars["release"] = "backing->mutable_" + cpp_field_name(field) + "()->ReleaseLast()";
+                    printer.Print(vars,
+                        "int count = backing->$field_name$_size();\n"
+                        "if (count > 0) {\n"
+                        "    VALUE array = own_array(rb_self, &field_$field_name$);\n"
+                        "    for (int i = 0; i < count; i++) {\n"
+                        "        rb_ary_push(array, $nested_message_type$::new_for_parse());\n"
+                        "    }\n"
+                        "    for (int i = count - 1; i >= 0; i--) {\n"
+                        "        VALUE nested = RARRAY_AREF(array, i);\n"
+                        "        $nested_message_type$* cpp_nested;\n"
+                        "        TypedData_Get_Struct(nested, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                    );
+                    printer.Indent();
+                    printer.Indent();
+                    printer.Print(vars, adopt.c_str());
+                    printer.Outdent();
+                    printer.Outdent();
+                    printer.Print(
+                        "    }\n"
+                        "}\n"
+                    );
+                } else {
+                    vars["element"] = "backing->" + cpp_field_name(field) + "()";
+                    vars["release"] = "backing->release_" + cpp_field_name(field) + "()";
+                    printer.Print(vars,
+                        "if (backing->has_$field_name$()) {\n"
+                        "    VALUE nested = $nested_message_type$::new_for_parse();\n"
+                        "    $nested_message_type$* cpp_nested;\n"
+                        "    TypedData_Get_Struct(nested, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                    );
+                    printer.Indent();
+                    printer.Print(vars, adopt.c_str());
+                    printer.Print(vars, ("RB_OBJ_WRITE(rb_self, $slot$, nested);\n" + set_has).c_str());
+                    printer.Outdent();
+                    printer.Print("}\n");
+                }
+            } else if (is_native_repeated(field)) {
+                printer.Print(vars,
+                    "if (backing->$field_name$_size() > 0) {\n"
+                    "    own_repeated_scalar<$native_type$>(rb_self, &field_$field_name$).assign(\n"
+                    "        backing->$field_name$().begin(), backing->$field_name$().end()\n"
+                    "    );\n"
+                    "}\n"
+                );
+            } else if (field->is_repeated()) {
+                vars["convert"] = backing_to_value(field, "element");
+                printer.Print(vars,
+                    "if (backing->$field_name$_size() > 0) {\n"
+                    "    VALUE array = own_array(rb_self, &field_$field_name$);\n"
+                    "    for (const auto &element : backing->$field_name$()) {\n"
+                    "        rb_ary_push(array, $convert$);\n"
+                    "    }\n"
+                    "}\n"
+                );
+            } else {
+                vars["convert"] = is_native_field(field) ?
+                    "static_cast<" + native_type_for_field(field) + ">(backing->" + cpp_field_name(field) + "())" :
+                    backing_to_value(field, "backing->" + cpp_field_name(field) + "()");
+                printer.Print(vars, (
+                    (field->has_presence() ? "if (backing->has_$field_name$()) {\n" : "if (true) {\n") +
+                    std::string(is_native_field(field) ?
+                        "    field_$field_name$ = $convert$;\n" :
+                        "    RB_OBJ_WRITE(rb_self, $slot$, $convert$);\n") +
+                    (set_has.empty() ? "" : "    " + set_has) +
+                    "}\n").c_str()
+                );
+            }
+
+            printer.Outdent();
+            printer.Print("}\n");
+        }
+
+        printer.Outdent();
+        printer.Print("}\n\n");
+
+        // Writes the fields that have been used back over backing, then has libprotobuf encode it.
+        // fill_proto_obj is called without to_proto_obj's rb_protect, which is fine here because
+        // nothing on the stack needs destructing if it raises.
+        printer.Print(
+            "VALUE $class_name$::serialize_backing() {\n"
+            "    fill_proto_obj(backing);\n"
+            "    size_t pb_size = backing->ByteSizeLong();\n"
+            "    VALUE rb_str = rb_str_new(nullptr, pb_size);\n"
+            "    serializing++;\n"
+            "    serialize_backing_without_gvl(backing, reinterpret_cast<uint8_t*>(RSTRING_PTR(rb_str)), pb_size);\n"
+            "    serializing--;\n"
+            "    return rb_str;\n"
+            "}\n\n",
+            "class_name", class_name
+        );
+    }
+}
@@ -0,0 +1,367 @@
+#include <cmath>
+#include <cstdio>
+
+#include <boost/algorithm/string.hpp>
+
+#include "rb_fastproto_code_generator.h"
+
+// Works out how each field is stored in the message struct. By default every field is a VALUE,
+// with its has status in a bitset. With the compact layout, singular numeric, bool & enum fields
+// are stored as the native C++ type instead, and only boxed into a VALUE when ruby reads them.
+//
+// A new message doesn't allocate anything: scalar fields start out pointing at a per-field static
+// default, repeated fields at a shared frozen empty array, and required messages at their type's
+// frozen default instance. The getters swap in a fresh array or message on first read.
+//
+// Sparse messages have no field_* members at all. Their fields live in a SparseFields, where one
+// that isn't there reads as the value it would have started out as; so field_expr() is how a
+// field is read, and field_slot_expr() how it's written.
+//
+// The fields of a oneof share a single oneof_<name> VALUE, with oneof_case_<name> saying which
+// of them (by field number) it belongs to. Any other field of the oneof reads as its template
+// value, and writing to one through its slot makes it the one that's set. Oneof fields are always
+// VALUEs, and their has status is the case rather than a bit, so they have no field_* member.
+namespace rb_fastproto {
+    bool parse_generator_options(const std::string &parameter, GeneratorOptions* options, std::string* error) {
+        std::vector<std::string> parts;
+        boost::split(parts, parameter, boost::is_any_of(","));
+
+        for (auto &part : parts) {
+            if (part.empty()) {
+                continue;
+            }
+            auto equals = part.find('=');
+            auto key = part.substr(0, equals);
+            auto value = equals == std::string::npos ? "" : part.substr(equals + 1);
+
+            if (key == "layout") {
+                if (value == "compact") {
+                    options->compact_layout = true;
+                } else if (value == "default") {
+                    options->compact_layout = false;
+                } else {
+                    *error = "Unknown layout: " + value;
+                    return false;
+                }
+            } else if (key == "repeated") {
+                if (value == "native") {
+                    options->native_repeated = true;
+                } else if (value == "array") {
+                    options->native_repeated = false;
+                } else {
+                    *error = "Unknown repeated storage: " + value;
+                    return false;
+                }
+            } else if (key == "sparse") {
+                if (value.empty()) {
+                    *error = "sparse needs a message name";
+                    return false;
+                }
+                options->sparse_messages.insert(value);
+            } else if (key == "map_order") {
+                if (value == "sorted") {
+                    options->sorted_maps = true;
+                } else if (value == "insertion") {
+                    options->sorted_maps = false;
+                } else {
+                    *error = "Unknown map order: " + value;
+                    return false;
+                }
+            } else if (key == "storage") {
+                if (value == "cpp") {
+                    options->cpp_storage = true;
+                } else if (value == "values") {
+                    options->cpp_storage = false;
+                } else {
+                    *error = "Unknown storage: " + value;
+                    return false;
+                }
+            } else {
+                *error = "Unknown option: " + key;
+                return false;
+            }
+        }
+        // Fields are read out of a backing C++ message into field_* members
+        if (options->cpp_storage && !options->sparse_messages.empty()) {
+            *error = "sparse can't be used with storage=cpp";
+            return false;
+        }
+        return true;
+    }
+
+    bool RBFastProtoCodeGenerator::is_sparse(const google::protobuf::Descriptor* message_type) const {
+        return options.sparse_messages.count(message_type->full_name()) > 0;
+    }
+
+    bool RBFastProtoCodeGenerator::is_native_field(const google::protobuf::FieldDescriptor* field) const {
+        if (!options.compact_layout || field->is_repeated() || !has_field_member(field)) {
+            return false;
+        }
+        return !native_type_for_field(field).empty();
+    }
+
+    // Repeated fields of the same types can be stored in a Fastproto::RepeatedScalar, holding a
+    // std::vector of the native type.
+    bool RBFastProtoCodeGenerator::is_native_repeated(const google::protobuf::FieldDescriptor* field) const {
+        if (!options.native_repeated || !field->is_repeated() || is_sparse(field->containing_type())) {
+            return false;
+        }
+        return !native_type_for_field(field).empty();
+    }
+
+    // Optional fields keep their has status in the bitset. Native enums also need a bit each,
+    // because they can be nil, which there is no native value for. Oneof fields have the
+    // has_field_* accessors too, but they go by their oneof's case instead of taking up a bit.
+    bool RBFastProtoCodeGenerator::has_presence_bit(const google::protobuf::FieldDescriptor* field) const {
+        return field->is_optional() ||
+            (is_native_field(field) && field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM);
+    }
+
+    int RBFastProtoCodeGenerator::presence_bit_index(const google::protobuf::FieldDescriptor* field) const {
+        auto message_type = field->containing_type();
+        int index = 0;
+        for (int i = 0; i < message_type->field_count(); i++) {
+            auto other = message_type->field(i);
+            if (other == field) {
+                return index;
+            }
+            if (has_presence_bit(other) && other->real_containing_oneof() == nullptr) {
+                index++;
+            }
+        }
+        return -1;
+    }
+
+    int RBFastProtoCodeGenerator::presence_bit_count(const google::protobuf::Descriptor* message_type) const {
+        int count = 0;
+        for (int i = 0; i < message_type->field_count(); i++) {
+            auto field = message_type->field(i);
+            if (has_presence_bit(field) && field->real_containing_oneof() == nullptr) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // Whether the field is stored in a field_* member of its own, rather than in sparse_fields or
+    // its oneof's shared VALUE.
+    bool RBFastProtoCodeGenerator::has_field_member(const google::protobuf::FieldDescriptor* field) const {
+        return !is_sparse(field->containing_type()) && field->real_containing_oneof() == nullptr;
+    }
+
+    // An expression for what the field holds (native or VALUE), where prefix gets to the message
+    // struct (e.g. "cpp_self->").
+    std::string RBFastProtoCodeGenerator::field_expr(
+        const google::protobuf::FieldDescriptor* field,
+        const std::string &prefix
+    ) const {
+        auto oneof = field->real_containing_oneof();
+        if (oneof != nullptr) {
+            return "(" + prefix + "oneof_case_" + oneof->name() + " == " + std::to_string(field->number()) + " ? " +
+                prefix + "oneof_" + oneof->name() + " : " + template_value_expr(field) + ")";
+        } else if (!is_sparse(field->containing_type())) {
+            return prefix + "field_" + cpp_field_name(field);
+        }
+        return prefix + "sparse_fields.get(" + std::to_string(field->number()) + ", " + template_value_expr(field) + ")";
+    }
+
+    // A pointer to where the field is stored, for writing to. Sparse messages add the field if
+    // they don't have it yet, and a oneof switches over to it if it has another one set.
+    std::string RBFastProtoCodeGenerator::field_slot_expr(
+        const google::protobuf::FieldDescriptor* field,
+        const std::string &prefix
+    ) const {
+        auto oneof = field->real_containing_oneof();
+        if (oneof != nullptr) {
+            return prefix + "select_oneof_" + oneof->name() + "(" + std::to_string(field->number()) + ", " + template_value_expr(field) + ")";
+        } else if (!is_sparse(field->containing_type())) {
+            return "&" + prefix + "field_" + cpp_field_name(field);
+        }
+        return prefix + "sparse_fields.slot(" + std::to_string(field->number()) + ", " + template_value_expr(field) + ")";
+    }
+
+    // An expression for the field's value as a VALUE, where prefix gets to the message struct
+    // (e.g. "cpp_self->").
+    std::string RBFastProtoCodeGenerator::field_value_expr(
+        const google::protobuf::FieldDescriptor* field,
+        const std::string &prefix
+    ) const {
+        auto member = field_expr(field, prefix);
+        if (!is_native_field(field)) {
+            return member;
+        }
+        auto boxed = native_to_value(field, member);
+        if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM && !field->has_default_value()) {
+            return "(" + prefix + "has_field_" + cpp_field_name(field) + "() ? " + boxed + " : Qnil)";
+        }
+        return boxed;
+    }
+
+    // What a field holds in a newly constructed message, or after it has been reset with nil.
+    std::string RBFastProtoCodeGenerator::template_value_expr(const google::protobuf::FieldDescriptor* field) const {
+        if (field->is_map()) {
+            return "default_empty_hash";
+        } else if (field->is_repeated()) {
+            return "default_empty_array";
+        } else if (field->message_type()) {
+            // Optional messages are faulted in when they're read, and required ones are replaced
+            // with their own copy then.
+            return field->is_required() ?
+                cpp_proto_message_wrapper_struct_name(field->message_type()) + "::default_instance()" :
+                "Qnil";
+        } else {
+            return "default_" + cpp_field_name(field);
+        }
+    }
+
+    // The C++ type a field is stored as in the compact layout, or "" if it is always a VALUE.
+    std::string native_type_for_field(const google::protobuf::FieldDescriptor* field) {
+        switch (field->type()) {
+            case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
+            case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
+            case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
+            case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                return "int32_t";
+            case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
+            case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
+                return "uint32_t";
+            case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
+            case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
+            case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
+                return "int64_t";
+            case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
+            case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
+                return "uint64_t";
+            case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
+                return "float";
+            case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
+                return "double";
+            case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
+                return "bool";
+            default:
+                return "";
+        }
+    }
+
+    // Used to order the native fields largest first, so the struct has no padding between them.
+    size_t native_size_for_field(const google::protobuf::FieldDescriptor* field) {
+        auto type = native_type_for_field(field);
+        if (type == "int64_t" || type == "uint64_t" || type == "double") {
+            return 8;
+        } else if (type == "bool") {
+            return 1;
+        } else {
+            return 4;
+        }
+    }
+
+    std::string native_to_value(const google::protobuf::FieldDescriptor* field, const std::string &native) {
+        auto type = native_type_for_field(field);
+        if (type == "int32_t") {
+            return "INT2NUM(" + native + ")";
+        } else if (type == "uint32_t") {
+            return "UINT2NUM(" + native + ")";
+        } else if (type == "int64_t") {
+            return "LL2NUM(" + native + ")";
+        } else if (type == "uint64_t") {
+            return "ULL2NUM(" + native + ")";
+        } else if (type == "float" || type == "double") {
+            return "DBL2NUM(" + native + ")";
+        } else {
+            return "BOOL2VAL_S(" + native + ")";
+        }
+    }
+
+    // The numeric _S conversions raise a TypeError for anything that isn't the right kind of
+    // number, without calling back into ruby.
+    std::string value_to_native(const google::protobuf::FieldDescriptor* field, const std::string &value) {
+        auto type = native_type_for_field(field);
+        if (type == "int32_t") {
+            return "NUM2INT_S(" + value + ")";
+        } else if (type == "uint32_t") {
+            return "NUM2UINT_S(" + value + ")";
+        } else if (type == "int64_t") {
+            return "NUM2LONG_S(" + value + ")";
+        } else if (type == "uint64_t") {
+            return "NUM2ULONG_S(" + value + ")";
+        } else if (type == "float") {
+            return "static_cast<float>(NUM2DBL_S(" + value + "))";
+        } else if (type == "double") {
+            return "NUM2DBL_S(" + value + ")";
+        } else {
+            return "VAL2BOOL_S(" + value + ")";
+        }
+    }
+
+    // Fields whose default lives in a static default_<field> member, built in initialize_class().
+    bool has_static_default(const google::protobuf::FieldDescriptor* field) {
+        return !field->is_repeated() && !field->message_type();
+    }
+
+    static std::string c_string_literal(const std::string &str) {
+        std::string literal = "\"";
+        for (unsigned char c : str) {
+            if (c == '"' || c == '\\' || c == '?') {
+                literal += '\\';
+                literal += c;
+            } else if (c < 0x20 || c >= 0x7f) {
+                char escaped[5];
+                std::snprintf(escaped, sizeof(escaped), "\\%03o", c);
+                literal += escaped;
+            } else {
+                literal += c;
+            }
+        }
+        return literal + "\"";
+    }
+
+    static std::string double_literal(double value) {
+        if (std::isnan(value)) {
+            return "std::numeric_limits<double>::quiet_NaN()";
+        } else if (std::isinf(value)) {
+            return value > 0 ? "std::numeric_limits<double>::infinity()" : "-std::numeric_limits<double>::infinity()";
+        }
+        char literal[32];
+        std::snprintf(literal, sizeof(literal), "%.17g", value);
+        return literal;
+    }
+
+    // An expression for the field's default as a VALUE, honouring [default = ...]. Integers go
+    // through rb_cstr2inum so that 64 bit defaults don't need a literal suffix.
+    std::string declared_default_value(const google::protobuf::FieldDescriptor* field) {
+        switch (field->cpp_type()) {
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_INT32:
+                return "rb_cstr2inum(\"" + std::to_string(field->default_value_int32()) + "\", 10)";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_INT64:
+                return "rb_cstr2inum(\"" + std::to_string(field->default_value_int64()) + "\", 10)";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_UINT32:
+                return "rb_cstr2inum(\"" + std::to_string(field->default_value_uint32()) + "\", 10)";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_UINT64:
+                return "rb_cstr2inum(\"" + std::to_string(field->default_value_uint64()) + "\", 10)";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_FLOAT:
+                return "DBL2NUM(" + double_literal(field->default_value_float()) + ")";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+                return "DBL2NUM(" + double_literal(field->default_value_double()) + ")";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_BOOL:
+                return field->default_value_bool() ? "Qtrue" : "Qfalse";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_ENUM:
+                // Enums without a declared default are nil until they are set. Native ones
+                // still need a number to hold, so they get the first value.
+                if (field->has_default_value() || !native_type_for_field(field).empty()) {
+                    return "INT2FIX(" + std::to_string(field->default_value_enum()->number()) + ")";
+                }
+                return "Qnil";
+            case google::protobuf::FieldDescriptor::CppType::CPPTYPE_STRING: {
+                auto &str = field->default_value_string();
+                auto length = std::to_string(str.size());
+                // Every message shares this string, so it has to be frozen.
+                if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_BYTES) {
+                    return "rb_obj_freeze(rb_str_new(" + c_string_literal(str) + ", " + length + "))";
+                }
+                return "rb_obj_freeze(rb_enc_str_new(" + c_string_literal(str) + ", " + length + ", rb_utf8_encoding()))";
+            }
+            default:
+                return "Qnil";
+        }
+    }
+}
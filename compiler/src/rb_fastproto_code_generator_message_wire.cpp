@@ -0,0 +1,1388 @@
+#include <algorithm>
+#include <iostream>
+#include <functional>
+#include <map>
+#include <set>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+#include "rb_fastproto_code_generator.h"
+
+// Generates the direct wire format encoder for messages. Rather than copying every VALUE into a
+// libprotobuf object and asking it to serialize itself, each message gets a compute_wire_size()
+// and a write_wire() that work straight off the field_* VALUEs.
+namespace rb_fastproto {
+    namespace {
+        // How to convert, size & write a single scalar value. $value$ is the VALUE being converted
+        // in convert, and the converted native value in size and write.
+        struct ScalarWireOps {
+            std::string convert;
+            std::string size;
+            std::string write;
+        };
+
+        ScalarWireOps scalar_wire_ops(const google::protobuf::FieldDescriptor* field) {
+            switch (field->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
+                case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                    return { "NUM2INT_S($value$)", "varint_size_int32($value$)", "write_varint_int32(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
+                    return { "NUM2INT_S($value$)", "varint_size(zigzag_encode32($value$))", "write_varint(target, zigzag_encode32($value$))" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
+                    return { "NUM2INT_S($value$)", "fixed32_size($value$)", "write_fixed32(target, static_cast<uint32_t>($value$))" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
+                    return { "NUM2UINT_S($value$)", "varint_size($value$)", "write_varint(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
+                    return { "NUM2UINT_S($value$)", "fixed32_size($value$)", "write_fixed32(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
+                    return { "NUM2LONG_S($value$)", "varint_size(static_cast<uint64_t>($value$))", "write_varint(target, static_cast<uint64_t>($value$))" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
+                    return { "NUM2LONG_S($value$)", "varint_size(zigzag_encode64($value$))", "write_varint(target, zigzag_encode64($value$))" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
+                    return { "NUM2LONG_S($value$)", "fixed64_size($value$)", "write_fixed64(target, static_cast<uint64_t>($value$))" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
+                    return { "NUM2ULONG_S($value$)", "varint_size($value$)", "write_varint(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
+                    return { "NUM2ULONG_S($value$)", "fixed64_size($value$)", "write_fixed64(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
+                    return { "static_cast<float>(NUM2DBL_S($value$))", "float_size($value$)", "write_float(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
+                    return { "NUM2DBL_S($value$)", "double_size($value$)", "write_double(target, $value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
+                    return { "VAL2BOOL_S($value$)", "bool_size($value$)", "write_varint(target, $value$ ? 1 : 0)" };
+                default:
+                    return { "", "", "" };
+            }
+        }
+
+        // How to read a single scalar value off the wire, and turn it into the native type for
+        // the field (see native_type_for_field). $value$ is the raw value read, of type raw_type.
+        struct ScalarDecodeOps {
+            std::string raw_type;
+            std::string read;
+            std::string to_native;
+        };
+
+        ScalarDecodeOps scalar_decode_ops(const google::protobuf::FieldDescriptor* field) {
+            switch (field->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
+                case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                    return { "uint64_t", "read_varint", "static_cast<int32_t>($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
+                    return { "uint64_t", "read_varint", "zigzag_decode32(static_cast<uint32_t>($value$))" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
+                    return { "uint64_t", "read_varint", "static_cast<uint32_t>($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
+                    return { "uint64_t", "read_varint", "static_cast<int64_t>($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
+                    return { "uint64_t", "read_varint", "zigzag_decode64($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
+                    return { "uint64_t", "read_varint", "$value$" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_BOOL:
+                    return { "uint64_t", "read_varint", "$value$ != 0" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
+                    return { "uint32_t", "read_fixed32", "$value$" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
+                    return { "uint32_t", "read_fixed32", "static_cast<int32_t>($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
+                    return { "uint32_t", "read_fixed32", "bits_to_float($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
+                    return { "uint64_t", "read_fixed64", "$value$" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
+                    return { "uint64_t", "read_fixed64", "static_cast<int64_t>($value$)" };
+                case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
+                    return { "uint64_t", "read_fixed64", "bits_to_double($value$)" };
+                default:
+                    return { "", "", "" };
+            }
+        }
+
+        // Which of the bulk varint kernels (see rb_fastproto_varint_kernels.h) handles the values
+        // of a native repeated field, or "" if it isn't a varint type they cover.
+        std::string varint_kernel_for_field(const google::protobuf::FieldDescriptor* field) {
+            switch (field->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_INT32:
+                case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                    return "int32";
+                case google::protobuf::FieldDescriptor::Type::TYPE_SINT32:
+                    return "sint32";
+                case google::protobuf::FieldDescriptor::Type::TYPE_UINT32:
+                    return "uint32";
+                case google::protobuf::FieldDescriptor::Type::TYPE_INT64:
+                    return "int64";
+                case google::protobuf::FieldDescriptor::Type::TYPE_SINT64:
+                    return "sint64";
+                case google::protobuf::FieldDescriptor::Type::TYPE_UINT64:
+                    return "uint64";
+                default:
+                    return "";
+            }
+        }
+
+        // proto2 enums are closed, so values we don't know about go to the unknown fields, the
+        // same as libprotobuf does it.
+        std::string enum_value_check(const google::protobuf::EnumDescriptor* enum_type) {
+            std::vector<int> numbers;
+            for (int i = 0; i < enum_type->value_count(); i++) {
+                numbers.push_back(enum_type->value(i)->number());
+            }
+            std::sort(numbers.begin(), numbers.end());
+            numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+
+            std::vector<std::string> comparisons;
+            for (auto number : numbers) {
+                comparisons.push_back("enum_value == " + std::to_string(number));
+            }
+            return boost::algorithm::join(comparisons, " || ");
+        }
+
+        // Substitutes the VALUE (or native value) expression into one of the ScalarWireOps
+        std::string with_value(std::string op, const std::string &value) {
+            boost::replace_all(op, "$value$", value);
+            return op;
+        }
+
+        // Indents every line of statements by spaces, for statements that go inside a block
+        // printed in one go
+        std::string indent_lines(const std::string &statements, int spaces) {
+            std::string indented;
+            std::string indent(spaces, ' ');
+            size_t start = 0;
+            while (start < statements.size()) {
+                size_t end = statements.find('\n', start);
+                end = end == std::string::npos ? statements.size() : end + 1;
+                indented += indent + statements.substr(start, end - start);
+                start = end;
+            }
+            return indented;
+        }
+
+        // Fields get written in field number order, the same as libprotobuf does it.
+        std::vector<const google::protobuf::FieldDescriptor*> fields_in_number_order(
+            const google::protobuf::Descriptor* message_type
+        ) {
+            std::vector<const google::protobuf::FieldDescriptor*> fields;
+            for (int i = 0; i < message_type->field_count(); i++) {
+                fields.push_back(message_type->field(i));
+            }
+            std::sort(fields.begin(), fields.end(), [](
+                const google::protobuf::FieldDescriptor* a,
+                const google::protobuf::FieldDescriptor* b
+            ) {
+                return a->number() < b->number();
+            });
+            return fields;
+        }
+
+        // Prints print_field for each of fields (in field number order). Sparse messages only go
+        // through the fields they hold instead, which are already in that order, with each one's
+        // value in a local of the same name as the member a dense message would have. Oneof fields
+        // are only printed for when they're the one their oneof has set, likewise with a local;
+        // in sparse messages they come after the rest.
+        void print_each_field(
+            bool sparse,
+            const std::vector<const google::protobuf::FieldDescriptor*> &fields,
+            google::protobuf::io::Printer &printer,
+            const std::function<void(const google::protobuf::FieldDescriptor*)> &print_field
+        ) {
+            auto print_oneof_field = [&](const google::protobuf::FieldDescriptor* field) {
+                printer.Print(
+                    "if (oneof_case_$oneof_name$ == $field_number$) {\n"
+                    "    VALUE field_$field_name$ = oneof_$oneof_name$;\n",
+                    "oneof_name", field->real_containing_oneof()->name(),
+                    "field_number", std::to_string(field->number()),
+                    "field_name", cpp_field_name(field)
+                );
+                printer.Indent();
+                print_field(field);
+                printer.Outdent();
+                printer.Print("}\n");
+            };
+
+            std::vector<const google::protobuf::FieldDescriptor*> sparse_fields;
+            for (auto field : fields) {
+                if (field->real_containing_oneof() != nullptr) {
+                    if (!sparse) {
+                        print_oneof_field(field);
+                    }
+                } else if (sparse) {
+                    sparse_fields.push_back(field);
+                } else {
+                    print_field(field);
+                }
+            }
+            if (!sparse) {
+                return;
+            }
+
+            if (!sparse_fields.empty()) {
+                printer.Print(
+                    "for (const auto &entry : sparse_fields) {\n"
+                    "    switch (entry.number) {\n"
+                );
+                printer.Indent();
+                printer.Indent();
+            }
+            for (auto field : sparse_fields) {
+                printer.Print(
+                    "case $field_number$: {\n"
+                    "    VALUE field_$field_name$ = entry.value;\n",
+                    "field_number", std::to_string(field->number()),
+                    "field_name", cpp_field_name(field)
+                );
+                printer.Indent();
+                print_field(field);
+                printer.Print("break;\n");
+                printer.Outdent();
+                printer.Print("}\n");
+            }
+            if (!sparse_fields.empty()) {
+                printer.Outdent();
+                printer.Outdent();
+                printer.Print(
+                    "    }\n"
+                    "}\n"
+                );
+            }
+            for (auto field : fields) {
+                if (field->real_containing_oneof() != nullptr) {
+                    print_oneof_field(field);
+                }
+            }
+        }
+
+        std::string tag_write_statements(int field_number, int wire_type) {
+            std::string statements;
+            for (auto byte : wire_tag_bytes(field_number, wire_type)) {
+                statements += boost::str(boost::format("*target++ = 0x%02X;\n") % static_cast<int>(byte));
+            }
+            return statements;
+        }
+
+        std::map<std::string, std::string> field_vars(const google::protobuf::FieldDescriptor* field) {
+            std::map<std::string, std::string> vars;
+            vars["field_name"] = cpp_field_name(field);
+            vars["field_number"] = std::to_string(field->number());
+            vars["tag_size"] = std::to_string(wire_tag_bytes(field->number(), wire_type_for_field(field)).size());
+            vars["write_tag"] = tag_write_statements(field->number(), wire_type_for_field(field));
+            vars["native_type"] = native_type_for_field(field);
+            if (field->message_type() != nullptr) {
+                vars["nested_message_type"] = cpp_proto_message_wrapper_struct_name(field->message_type());
+                vars["rb_message_class_name"] = ruby_proto_message_class_name(field->message_type());
+                vars["write_end_tag"] = tag_write_statements(field->number(), 4);
+            }
+            return vars;
+        }
+
+        // How the key or value of a map entry is sized and written, which are fields 1 & 2 of
+        // the entry message. $name$ is the element's VALUE: prepare checks it (when check is
+        // set) and converts it, size is the bytes it takes up with its tag, and write writes it.
+        // Message values are sized by prepare in the first pass, and use their cached_size in
+        // the second.
+        struct MapElementOps {
+            std::string prepare;
+            std::string size;
+            std::string write;
+        };
+
+        MapElementOps map_element_ops(const google::protobuf::FieldDescriptor* element, const std::string &name, bool check) {
+            auto tag = tag_write_statements(element->number(), element_wire_type_for_field(element));
+            MapElementOps ops;
+            switch (element->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                    ops.prepare = check ? "Check_Type(" + name + ", T_STRING);\n" : "";
+                    ops.size = "1 + varint_size(RSTRING_LEN(" + name + ")) + RSTRING_LEN(" + name + ")";
+                    ops.write = tag +
+                        "target = write_varint(target, RSTRING_LEN(" + name + "));\n"
+                        "target = write_string(target, " + name + ");\n";
+                    break;
+                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE: {
+                    auto nested_message_type = cpp_proto_message_wrapper_struct_name(element->message_type());
+                    if (check) {
+                        ops.prepare =
+                            "if (CLASS_OF(" + name + ") != " + nested_message_type + "::rb_cls) {\n"
+                            "    rb_raise(rb_eTypeError, \"$field_name$ not a " + ruby_proto_message_class_name(element->message_type()) + "\");\n"
+                            "}\n";
+                    }
+                    ops.prepare +=
+                        nested_message_type + "* cpp_" + name + ";\n"
+                        "TypedData_Get_Struct(" + name + ", " + nested_message_type + ", &" + nested_message_type + "::rb_data_type, cpp_" + name + ");\n"
+                        "size_t " + name + "_size = " + (check ? "cpp_" + name + "->compute_wire_size()" : "cpp_" + name + "->cached_size") + ";\n";
+                    ops.size = "1 + varint_size(" + name + "_size) + " + name + "_size";
+                    ops.write = tag +
+                        "target = write_varint(target, " + name + "_size);\n"
+                        "target = cpp_" + name + "->write_wire(target);\n";
+                    break;
+                }
+                default: {
+                    auto scalar = scalar_wire_ops(element);
+                    ops.prepare = "auto " + name + "_native = " + with_value(scalar.convert, name) + ";\n";
+                    ops.size = "1 + " + with_value(scalar.size, name + "_native");
+                    ops.write = tag + "target = " + with_value(scalar.write, name + "_native") + ";\n";
+                    break;
+                }
+            }
+            return ops;
+        }
+
+        // Map fields go through their Hash directly, sizing or writing each pair as the entry
+        // message the wire format has for it. libprotobuf always writes both the key and the
+        // value, even when they're defaults, and so do we.
+        void print_map_size(const google::protobuf::FieldDescriptor* field, google::protobuf::io::Printer &printer) {
+            auto key = map_element_ops(field->message_type()->map_key(), "key", true);
+            auto value = map_element_ops(field->message_type()->map_value(), "value", true);
+            printer.Print(field_vars(field),
+                ("{\n"
+                "    Check_Type(field_$field_name$, T_HASH);\n"
+                "    auto size_entry = [&](VALUE key, VALUE value) {\n" +
+                indent_lines(key.prepare + value.prepare, 8) +
+                "        size_t entry_size = " + key.size + " + " + value.size + ";\n"
+                "        size += $tag_size$ + varint_size(entry_size) + entry_size;\n"
+                "    };\n"
+                "    each_map_entry(field_$field_name$, size_entry);\n"
+                "}\n").c_str()
+            );
+        }
+
+        // With sorted, entries are written in key order (see map_order)
+        void print_map_write(const google::protobuf::FieldDescriptor* field, bool sorted, google::protobuf::io::Printer &printer) {
+            auto map_key = field->message_type()->map_key();
+            auto key = map_element_ops(map_key, "key", false);
+            auto value = map_element_ops(field->message_type()->map_value(), "value", false);
+            auto vars = field_vars(field);
+            printer.Print(vars,
+                ("{\n"
+                "    auto write_entry = [&](VALUE key, VALUE value) {\n" +
+                indent_lines(key.prepare + value.prepare, 8) +
+                "        size_t entry_size = " + key.size + " + " + value.size + ";\n" +
+                indent_lines(vars["write_tag"], 8) +
+                "        target = write_varint(target, entry_size);\n" +
+                indent_lines(key.write + value.write, 8) +
+                "    };\n").c_str()
+            );
+            if (sorted) {
+                auto less = map_key->type() == google::protobuf::FieldDescriptor::Type::TYPE_STRING ?
+                    std::string("string_key_less(a, b)") :
+                    with_value(scalar_wire_ops(map_key).convert, "a") + " < " + with_value(scalar_wire_ops(map_key).convert, "b");
+                printer.Print(vars,
+                    ("    for (const auto &entry : sorted_map_entries(field_$field_name$, [](VALUE a, VALUE b) { return " + less + "; })) {\n"
+                    "        write_entry(entry.key, entry.value);\n"
+                    "    }\n").c_str()
+                );
+            } else {
+                printer.Print(vars, "    each_map_entry(field_$field_name$, write_entry);\n");
+            }
+            printer.Print("}\n");
+        }
+
+        // Reads one element of a map entry into the VALUE called name. It's read as often as it
+        // turns up, with the last one winning, except message values, which are merged.
+        std::string map_element_read(const google::protobuf::FieldDescriptor* element, const std::string &name) {
+            auto tag = std::to_string((element->number() << 3) | element_wire_type_for_field(element));
+            switch (element->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                    return
+                        "case " + tag + ": {\n"
+                        "    size_t length;\n"
+                        "    ptr = read_length(ptr, entry_end, &length);\n"
+                        "    if (ptr == nullptr) {\n"
+                        "        raise_decode_error(\"$message_name$\");\n"
+                        "    }\n"
+                        "    " + name + " = source == Qnil ?\n"
+                        "        rb_str_new(reinterpret_cast<const char*>(ptr), length) :\n"
+                        "        shared_substring(source, ptr, length);\n"
+                        "    ptr += length;\n"
+                        "    break;\n"
+                        "}\n";
+                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE: {
+                    auto nested_message_type = cpp_proto_message_wrapper_struct_name(element->message_type());
+                    return
+                        "case " + tag + ": {\n"
+                        "    size_t length;\n"
+                        "    ptr = read_length(ptr, entry_end, &length);\n"
+                        "    if (ptr == nullptr) {\n"
+                        "        raise_decode_error(\"$message_name$\");\n"
+                        "    }\n"
+                        "    if (" + name + " == Qundef) {\n"
+                        "        " + name + " = " + nested_message_type + "::new_for_parse();\n"
+                        "    }\n"
+                        "    " + nested_message_type + "* cpp_nested;\n"
+                        "    TypedData_Get_Struct(" + name + ", " + nested_message_type + ", &" + nested_message_type + "::rb_data_type, cpp_nested);\n"
+                        "    cpp_nested->parse_wire(ptr, ptr + length, 0, depth + 1, source);\n"
+                        "    ptr += length;\n"
+                        "    break;\n"
+                        "}\n";
+                }
+                default: {
+                    auto ops = scalar_decode_ops(element);
+                    std::string store = element->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM ?
+                        "    int32_t enum_value = static_cast<int32_t>(raw);\n"
+                        "    known_value = " + enum_value_check(element->enum_type()) + ";\n"
+                        "    " + name + " = INT2NUM(enum_value);\n" :
+                        "    " + name + " = " + native_to_value(element, with_value(ops.to_native, "raw")) + ";\n";
+                    return
+                        "case " + tag + ": {\n"
+                        "    " + ops.raw_type + " raw;\n"
+                        "    ptr = " + ops.read + "(ptr, entry_end, &raw);\n"
+                        "    if (ptr == nullptr) {\n"
+                        "        raise_decode_error(\"$message_name$\");\n"
+                        "    }\n" +
+                        store +
+                        "    break;\n"
+                        "}\n";
+                }
+            }
+        }
+
+        // What a key or value missing from its entry reads as
+        std::string map_element_default(const google::protobuf::FieldDescriptor* element) {
+            switch (element->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                    return "rb_str_new(nullptr, 0)";
+                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
+                    return cpp_proto_message_wrapper_struct_name(element->message_type()) + "::new_for_parse()";
+                case google::protobuf::FieldDescriptor::Type::TYPE_ENUM:
+                    return "INT2FIX(" + std::to_string(element->default_value_enum()->number()) + ")";
+                default:
+                    return declared_default_value(element);
+            }
+        }
+
+        // An entry whose enum value we don't know goes to the unknown fields whole, as
+        // libprotobuf does with it.
+        void print_map_parse(const google::protobuf::FieldDescriptor* field, std::map<std::string, std::string> vars, google::protobuf::io::Printer &printer) {
+            auto map_key = field->message_type()->map_key();
+            auto map_value = field->message_type()->map_value();
+            bool enum_value = map_value->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM;
+            vars["map_tag"] = std::to_string((field->number() << 3) | 2);
+            vars["key_default"] = map_element_default(map_key);
+            vars["value_default"] = map_element_default(map_value);
+
+            printer.Print(vars,
+                "case $map_tag$: {\n"
+                "    size_t length;\n"
+                "    ptr = read_length(ptr, end, &length);\n"
+                "    if (ptr == nullptr || depth >= MAX_PARSE_DEPTH) {\n"
+                "        raise_decode_error(\"$message_name$\");\n"
+                "    }\n"
+                "    const uint8_t* entry_end = ptr + length;\n"
+                "    VALUE key = Qundef;\n"
+                "    VALUE value = Qundef;\n"
+            );
+            if (enum_value) {
+                printer.Print("    bool known_value = true;\n");
+            }
+            printer.Print(vars,
+                "    while (ptr < entry_end) {\n"
+                "        uint32_t entry_tag;\n"
+                "        ptr = read_tag(ptr, entry_end, &entry_tag);\n"
+                "        if (ptr == nullptr || entry_tag == 0) {\n"
+                "            raise_decode_error(\"$message_name$\");\n"
+                "        }\n"
+                "        switch (entry_tag) {\n"
+            );
+            printer.Indent();
+            printer.Indent();
+            printer.Indent();
+            printer.Print(vars, map_element_read(map_key, "key").c_str());
+            printer.Print(vars, map_element_read(map_value, "value").c_str());
+            printer.Print(vars,
+                "default:\n"
+                "    ptr = skip_field(ptr, entry_end, entry_tag, depth + 1);\n"
+                "    if (ptr == nullptr) {\n"
+                "        raise_decode_error(\"$message_name$\");\n"
+                "    }\n"
+                "    break;\n"
+            );
+            printer.Outdent();
+            printer.Outdent();
+            printer.Outdent();
+            printer.Print(vars,
+                "        }\n"
+                "    }\n"
+                "    if (key == Qundef) {\n"
+                "        key = $key_default$;\n"
+                "    }\n"
+                "    if (value == Qundef) {\n"
+                "        value = $value_default$;\n"
+                "    }\n"
+            );
+            printer.Print(vars, enum_value ?
+                "    if (known_value) {\n"
+                "        rb_hash_aset(own_hash(rb_self, $field_slot$), key, value);\n"
+                "    } else {\n"
+                "        append_unknown(&unknown_fields, tag_start, entry_end);\n"
+                "    }\n" :
+                "    rb_hash_aset(own_hash(rb_self, $field_slot$), key, value);\n"
+            );
+            printer.Print(
+                "    RB_GC_GUARD(key);\n"
+                "    RB_GC_GUARD(value);\n"
+                "    break;\n"
+                "}\n"
+            );
+        }
+    }
+
+    int wire_type_for_field(const google::protobuf::FieldDescriptor* field) {
+        return field->is_packed() ? 2 : element_wire_type_for_field(field);
+    }
+
+    int element_wire_type_for_field(const google::protobuf::FieldDescriptor* field) {
+        switch (field->type()) {
+            case google::protobuf::FieldDescriptor::Type::TYPE_FIXED64:
+            case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED64:
+            case google::protobuf::FieldDescriptor::Type::TYPE_DOUBLE:
+                return 1;
+            case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+            case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
+                return 2;
+            case google::protobuf::FieldDescriptor::Type::TYPE_GROUP:
+                return 3;
+            case google::protobuf::FieldDescriptor::Type::TYPE_FIXED32:
+            case google::protobuf::FieldDescriptor::Type::TYPE_SFIXED32:
+            case google::protobuf::FieldDescriptor::Type::TYPE_FLOAT:
+                return 5;
+            default:
+                return 0;
+        }
+    }
+
+    bool has_fixed_wire_size(const google::protobuf::FieldDescriptor* field) {
+        if (field->is_repeated()) {
+            return false;
+        }
+        switch (field->type()) {
+            case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+            case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
+            case google::protobuf::FieldDescriptor::Type::TYPE_GROUP:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    bool is_lazy_field(const google::protobuf::FieldDescriptor* field) {
+        // Groups are left out, since finding where one ends means parsing all of it anyway. So are
+        // oneof fields: a later field of the oneof has to replace one that's still undecoded.
+        // Map fields are read straight into their Hash.
+        return field->type() == google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE &&
+            field->real_containing_oneof() == nullptr && !field->is_map();
+    }
+
+    bool has_lazy_fields(const google::protobuf::Descriptor* message_type) {
+        for (int i = 0; i < message_type->field_count(); i++) {
+            if (is_lazy_field(message_type->field(i))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether a message of this type, or any message inside it, can hold a map field. Writing
+    // one goes through its Hash, which can only be done on a ruby thread.
+    bool has_map_fields(const google::protobuf::Descriptor* message_type) {
+        std::set<const google::protobuf::Descriptor*> seen;
+        std::vector<const google::protobuf::Descriptor*> pending = { message_type };
+        while (!pending.empty()) {
+            auto type = pending.back();
+            pending.pop_back();
+            if (!seen.insert(type).second) {
+                continue;
+            }
+            for (int i = 0; i < type->field_count(); i++) {
+                auto field = type->field(i);
+                if (field->is_map()) {
+                    return true;
+                }
+                if (field->message_type() != nullptr) {
+                    pending.push_back(field->message_type());
+                }
+            }
+        }
+        return false;
+    }
+
+    std::vector<uint8_t> wire_tag_bytes(int field_number, int wire_type) {
+        std::vector<uint8_t> bytes;
+        uint32_t tag = (static_cast<uint32_t>(field_number) << 3) | static_cast<uint32_t>(wire_type);
+        while (tag >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(tag | 0x80));
+            tag >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(tag));
+        return bytes;
+    }
+
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_wire_size(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        // compute_wire_size() is the first pass of encoding. It does all of the type checking,
+        // raising straight to ruby if something is wrong (there is nothing on the stack that needs
+        // a destructor), and stashes the size of every nested message in its cached_size so
+        // write_wire() can emit length prefixes without walking the tree again.
+        // Sizes one field, adding it to size
+        auto print_field_size = [&](const google::protobuf::FieldDescriptor* field) {
+            if (field->is_map()) {
+                print_map_size(field, printer);
+                return;
+            }
+            auto vars = field_vars(field);
+            vars["varint_kernel"] = is_native_repeated(field) ? varint_kernel_for_field(field) : "";
+            auto ops = scalar_wire_ops(field);
+            // The i'th element of a repeated scalar field, as a native value
+            auto element = is_native_repeated(field) ? std::string("values[i]") : with_value(ops.convert, "array_els[i]");
+
+            // Anything parse_lazy hasn't decoded goes back out as it came in
+            if (is_lazy_field(field)) {
+                printer.Print(vars,
+                    "if (lazy_fields != nullptr && lazy_fields->pending($field_number$)) {\n"
+                    "    size += lazy_fields->size($field_number$);\n"
+                    "} else "
+                );
+            }
+
+            if (is_native_repeated(field)) {
+                printer.Print(vars,
+                    "{\n"
+                    "    const auto &values = repeated_scalar_values<$native_type$>(field_$field_name$);\n"
+                    "    long array_len = static_cast<long>(values.size());\n"
+                );
+            } else if (field->is_repeated()) {
+                printer.Print(vars,
+                    "{\n"
+                    "    Check_Type(field_$field_name$, T_ARRAY);\n"
+                    "    const VALUE* array_els = RARRAY_CONST_PTR(field_$field_name$);\n"
+                    "    long array_len = RARRAY_LEN(field_$field_name$);\n"
+                );
+            } else if (has_presence_bit(field)) {
+                // Optional fields, and native enums, which use their bit to say they aren't nil
+                printer.Print(vars, "if (has_field_$field_name$()) {\n");
+            } else if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                // Enums without a value have nothing to write
+                printer.Print(vars, "if (field_$field_name$ != Qnil) {\n");
+            } else {
+                printer.Print("{\n");
+            }
+            printer.Indent();
+
+            switch (field->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                    if (field->is_repeated()) {
+                        printer.Print(vars,
+                            "size += $tag_size$ * array_len;\n"
+                            "for (long i = 0; i < array_len; i++) {\n"
+                            "    Check_Type(array_els[i], T_STRING);\n"
+                            "    size += varint_size(RSTRING_LEN(array_els[i])) + RSTRING_LEN(array_els[i]);\n"
+                            "}\n"
+                        );
+                    } else {
+                        printer.Print(vars,
+                            "Check_Type(field_$field_name$, T_STRING);\n"
+                            "size += $tag_size$ + varint_size(RSTRING_LEN(field_$field_name$)) + RSTRING_LEN(field_$field_name$);\n"
+                        );
+                    }
+                    break;
+                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
+                case google::protobuf::FieldDescriptor::Type::TYPE_GROUP: {
+                    // Groups are bracketed by a start and end tag instead of being length prefixed
+                    std::string nested_size_op = field->type() == google::protobuf::FieldDescriptor::Type::TYPE_GROUP ?
+                        "size += 2 * $tag_size$ + cpp_nested->compute_wire_size();\n" :
+                        "{\n"
+                        "    size_t nested_size = cpp_nested->compute_wire_size();\n"
+                        "    size += $tag_size$ + varint_size(nested_size) + nested_size;\n"
+                        "}\n";
+                    if (field->is_repeated()) {
+                        printer.Print(vars,
+                            "for (long i = 0; i < array_len; i++) {\n"
+                            "    if (CLASS_OF(array_els[i]) != $nested_message_type$::rb_cls) {\n"
+                            "        rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
+                            "    }\n"
+                            "    $nested_message_type$* cpp_nested;\n"
+                            "    TypedData_Get_Struct(array_els[i], $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        );
+                        printer.Indent();
+                        printer.Print(vars, nested_size_op.c_str());
+                        printer.Outdent();
+                        printer.Print("}\n");
+                    } else {
+                        printer.Print(vars,
+                            "if (CLASS_OF(field_$field_name$) != $nested_message_type$::rb_cls) {\n"
+                            "    rb_raise(rb_eTypeError, \"$field_name$ not a $rb_message_class_name$\");\n"
+                            "}\n"
+                            "$nested_message_type$* cpp_nested;\n"
+                            "TypedData_Get_Struct(field_$field_name$, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        );
+                        printer.Print(vars, nested_size_op.c_str());
+                    }
+                    break;
+                }
+                default:
+                    if (!vars["varint_kernel"].empty()) {
+                        // The whole run of values gets sized in one go
+                        printer.Print(vars,
+                            "size_t data_size = varint_kernels().$varint_kernel$.size(values.data(), values.size());\n"
+                        );
+                        if (field->is_packed()) {
+                            printer.Print(vars,
+                                "if (array_len > 0) {\n"
+                                "    size += $tag_size$ + varint_size(data_size) + data_size;\n"
+                                "}\n"
+                            );
+                        } else {
+                            printer.Print(vars, "size += $tag_size$ * array_len + data_size;\n");
+                        }
+                    } else if (field->is_packed()) {
+                        // Packed fields are a single length-delimited run of values, which is
+                        // left out entirely when there are no values.
+                        printer.Print(vars,
+                            ("size_t data_size = 0;\n"
+                            "for (long i = 0; i < array_len; i++) {\n"
+                            "    auto value = " + element + ";\n"
+                            "    data_size += " + with_value(ops.size, "value") + ";\n"
+                            "}\n"
+                            "if (array_len > 0) {\n"
+                            "    size += $tag_size$ + varint_size(data_size) + data_size;\n"
+                            "}\n").c_str()
+                        );
+                    } else if (field->is_repeated()) {
+                        printer.Print(vars,
+                            ("size += $tag_size$ * array_len;\n"
+                            "for (long i = 0; i < array_len; i++) {\n"
+                            "    auto value = " + element + ";\n"
+                            "    size += " + with_value(ops.size, "value") + ";\n"
+                            "}\n").c_str()
+                        );
+                    } else {
+                        auto convert = is_native_field(field) ? "field_" + cpp_field_name(field) : with_value(ops.convert, "field_" + cpp_field_name(field));
+                        printer.Print(vars,
+                            ("auto value = " + convert + ";\n"
+                            "size += $tag_size$ + " + with_value(ops.size, "value") + ";\n").c_str()
+                        );
+                    }
+                    break;
+            }
+
+            printer.Outdent();
+            printer.Print("}\n");
+        };
+
+        // fixed_wire_size() covers the fields that can only change through a setter, which
+        // invalidates it, so it is only worked out again after one of them has changed. Oneof
+        // fields are left to compute_wire_size(), since setting another field of the oneof unsets
+        // them.
+        printer.Print(
+            "size_t $class_name$::fixed_wire_size() {\n"
+            "    if (fixed_size_valid) {\n"
+            "        return fixed_size;\n"
+            "    }\n"
+            "    size_t size = 0;\n"
+            "\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+        std::vector<const google::protobuf::FieldDescriptor*> fixed_fields;
+        std::vector<const google::protobuf::FieldDescriptor*> other_fields;
+        for (auto field : fields_in_number_order(message_type)) {
+            bool fixed = has_fixed_wire_size(field) && field->real_containing_oneof() == nullptr;
+            (fixed ? fixed_fields : other_fields).push_back(field);
+        }
+        print_each_field(is_sparse(message_type), fixed_fields, printer, print_field_size);
+        // Unknown fields only change when we are parsed into
+        printer.Print(
+            "if (unknown_fields != nullptr) {\n"
+            "    size += unknown_fields->size();\n"
+            "}\n"
+            "\n"
+            "fixed_size = size;\n"
+            "fixed_size_valid = true;\n"
+            "return size;\n"
+        );
+        printer.Outdent();
+        printer.Print("}\n\n");
+
+        // Strings, repeated fields & messages can all be changed in place without us knowing, so
+        // they are always sized again; nested messages bring their own fixed_wire_size() along.
+        printer.Print(
+            "size_t $class_name$::compute_wire_size() {\n"
+            "    if (encoded != Qnil) {\n"
+            "        cached_size = RSTRING_LEN(encoded);\n"
+            "        return cached_size;\n"
+            "    }\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+        if (options.cpp_storage) {
+            // Our own encoder only sees our fields, so anything still in a backing C++ message
+            // (when it's busy, or we're inside a message that isn't backed) is read out first
+            printer.Print(
+                "if (backing != nullptr) {\n"
+                "    read_backing(0);\n"
+                "}\n"
+            );
+        }
+        printer.Print(
+            "size_t size = fixed_wire_size();\n"
+            "\n"
+        );
+        print_each_field(is_sparse(message_type), other_fields, printer, print_field_size);
+        printer.Print(
+            "cached_size = size;\n"
+            "return size;\n"
+        );
+        printer.Outdent();
+        printer.Print("}\n\n");
+    }
+
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_wire_writer(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        // write_wire() is the second pass of encoding. compute_wire_size() has already checked
+        // every value, so nothing in here can raise, and the target buffer is exactly big enough.
+        // Strings go through write_string, which leaves long ones for serialize_many's workers.
+        printer.Print(
+            "uint8_t* $class_name$::write_wire(uint8_t* target) {\n",
+            "class_name", class_name
+        );
+        printer.Indent();
+
+        // A deep frozen message that has been serialized before just copies its old encoding in
+        printer.Print(
+            "if (encoded != Qnil) {\n"
+            "    return write_string(target, encoded);\n"
+            "}\n"
+        );
+
+        print_each_field(is_sparse(message_type), fields_in_number_order(message_type), printer, [&](const google::protobuf::FieldDescriptor* field) {
+            if (field->is_map()) {
+                print_map_write(field, options.sorted_maps, printer);
+                return;
+            }
+            auto vars = field_vars(field);
+            vars["varint_kernel"] = is_native_repeated(field) ? varint_kernel_for_field(field) : "";
+            auto ops = scalar_wire_ops(field);
+            // The i'th element of a repeated scalar field, as a native value
+            auto element = is_native_repeated(field) ? std::string("values[i]") : with_value(ops.convert, "array_els[i]");
+
+            if (is_lazy_field(field)) {
+                printer.Print(vars,
+                    "if (lazy_fields != nullptr && lazy_fields->pending($field_number$)) {\n"
+                    "    target = lazy_fields->write(target, $field_number$);\n"
+                    "} else "
+                );
+            }
+
+            if (is_native_repeated(field)) {
+                printer.Print(vars,
+                    "{\n"
+                    "    const auto &values = repeated_scalar_values<$native_type$>(field_$field_name$);\n"
+                    "    long array_len = static_cast<long>(values.size());\n"
+                );
+            } else if (field->is_repeated()) {
+                printer.Print(vars,
+                    "{\n"
+                    "    const VALUE* array_els = RARRAY_CONST_PTR(field_$field_name$);\n"
+                    "    long array_len = RARRAY_LEN(field_$field_name$);\n"
+                );
+            } else if (has_presence_bit(field)) {
+                // Optional fields, and native enums, which use their bit to say they aren't nil
+                printer.Print(vars, "if (has_field_$field_name$()) {\n");
+            } else if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                printer.Print(vars, "if (field_$field_name$ != Qnil) {\n");
+            } else {
+                printer.Print("{\n");
+            }
+            printer.Indent();
+
+            switch (field->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                    if (field->is_repeated()) {
+                        printer.Print(vars,
+                            "for (long i = 0; i < array_len; i++) {\n"
+                            "    $write_tag$"
+                            "    target = write_varint(target, RSTRING_LEN(array_els[i]));\n"
+                            "    target = write_string(target, array_els[i]);\n"
+                            "}\n"
+                        );
+                    } else {
+                        printer.Print(vars,
+                            "$write_tag$"
+                            "target = write_varint(target, RSTRING_LEN(field_$field_name$));\n"
+                            "target = write_string(target, field_$field_name$);\n"
+                        );
+                    }
+                    break;
+                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
+                case google::protobuf::FieldDescriptor::Type::TYPE_GROUP: {
+                    std::string nested_write_op = field->type() == google::protobuf::FieldDescriptor::Type::TYPE_GROUP ?
+                        "$write_tag$"
+                        "target = cpp_nested->write_wire(target);\n"
+                        "$write_end_tag$" :
+                        "$write_tag$"
+                        "target = write_varint(target, cpp_nested->cached_size);\n"
+                        "target = cpp_nested->write_wire(target);\n";
+                    if (field->is_repeated()) {
+                        printer.Print(vars,
+                            "for (long i = 0; i < array_len; i++) {\n"
+                            "    $nested_message_type$* cpp_nested;\n"
+                            "    TypedData_Get_Struct(array_els[i], $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        );
+                        printer.Indent();
+                        printer.Print(vars, nested_write_op.c_str());
+                        printer.Outdent();
+                        printer.Print("}\n");
+                    } else {
+                        printer.Print(vars,
+                            "$nested_message_type$* cpp_nested;\n"
+                            "TypedData_Get_Struct(field_$field_name$, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                        );
+                        printer.Print(vars, nested_write_op.c_str());
+                    }
+                    break;
+                }
+                default:
+                    if (!vars["varint_kernel"].empty() && field->is_packed()) {
+                        printer.Print(vars,
+                            "if (array_len > 0) {\n"
+                            "    size_t data_size = varint_kernels().$varint_kernel$.size(values.data(), values.size());\n"
+                            "    $write_tag$"
+                            "    target = write_varint(target, data_size);\n"
+                            "    target = varint_kernels().$varint_kernel$.write(target, values.data(), values.size());\n"
+                            "}\n"
+                        );
+                    } else if (field->is_packed()) {
+                        printer.Print(vars,
+                            ("if (array_len > 0) {\n"
+                            "    size_t data_size = 0;\n"
+                            "    for (long i = 0; i < array_len; i++) {\n"
+                            "        auto value = " + element + ";\n"
+                            "        data_size += " + with_value(ops.size, "value") + ";\n"
+                            "    }\n"
+                            "    $write_tag$"
+                            "    target = write_varint(target, data_size);\n"
+                            "    for (long i = 0; i < array_len; i++) {\n"
+                            "        auto value = " + element + ";\n"
+                            "        target = " + with_value(ops.write, "value") + ";\n"
+                            "    }\n"
+                            "}\n").c_str()
+                        );
+                    } else if (field->is_repeated()) {
+                        printer.Print(vars,
+                            ("for (long i = 0; i < array_len; i++) {\n"
+                            "    auto value = " + element + ";\n"
+                            "    $write_tag$"
+                            "    target = " + with_value(ops.write, "value") + ";\n"
+                            "}\n").c_str()
+                        );
+                    } else {
+                        auto convert = is_native_field(field) ? "field_" + cpp_field_name(field) : with_value(ops.convert, "field_" + cpp_field_name(field));
+                        printer.Print(vars,
+                            ("auto value = " + convert + ";\n"
+                            "$write_tag$"
+                            "target = " + with_value(ops.write, "value") + ";\n").c_str()
+                        );
+                    }
+                    break;
+            }
+
+            printer.Outdent();
+            printer.Print("}\n");
+        });
+
+        printer.Print(
+            "if (unknown_fields != nullptr) {\n"
+            "    target = write_raw(target, unknown_fields->data(), unknown_fields->size());\n"
+            "}\n"
+            "return target;\n"
+        );
+
+        printer.Outdent();
+        printer.Print("}\n\n");
+    }
+
+    void RBFastProtoCodeGenerator::write_cpp_message_struct_wire_parser(
+        const google::protobuf::FileDescriptor* file,
+        const google::protobuf::Descriptor* message_type,
+        const std::string &class_name,
+        google::protobuf::io::Printer &printer
+    ) const {
+        // Messages made while parsing skip initialize, since there are no attributes to set.
+        printer.Print(
+            "VALUE $class_name$::new_for_parse() {\n"
+            "    VALUE obj = alloc(rb_cls);\n"
+            "    void* memory;\n"
+            "    TypedData_Get_Struct(obj, void, &rb_data_type, memory);\n"
+            "    new(memory) $class_name$(obj);\n"
+            "    return obj;\n"
+            "}\n\n",
+            "class_name", class_name
+        );
+
+        // parse_wire() reads fields into this message until it gets to end, or end_group_tag if this
+        // is a group. Nothing on its stack needs a destructor, so it can raise wherever it finds a
+        // problem with the input. source is the frozen String being parsed by parse_shared or
+        // parse_lazy, which string & bytes fields share instead of copying, or Qnil to copy them.
+        printer.Print(
+            "const uint8_t* $class_name$::parse_wire(const uint8_t* ptr, const uint8_t* end, uint32_t end_group_tag, int depth, VALUE source) {\n"
+            "    fixed_size_valid = false;\n"
+            "    while (ptr < end) {\n",
+            "class_name", class_name
+        );
+        printer.Print(
+            "        const uint8_t* tag_start = ptr;\n"
+            "        uint32_t tag;\n"
+            "        ptr = read_tag(ptr, end, &tag);\n"
+            "        if (ptr == nullptr || tag == 0) {\n"
+            "            raise_decode_error(\"$message_name$\");\n"
+            "        }\n"
+            "        if (tag == end_group_tag) {\n"
+            "            report_native_memory();\n"
+            "            return ptr;\n"
+            "        }\n"
+            "\n"
+            "        switch (tag) {\n",
+            "class_name", class_name,
+            "message_name", message_type->full_name()
+        );
+        printer.Indent();
+        printer.Indent();
+        printer.Indent();
+
+        for (auto field : fields_in_number_order(message_type)) {
+            auto vars = field_vars(field);
+            vars["varint_kernel"] = is_native_repeated(field) ? varint_kernel_for_field(field) : "";
+            vars["message_name"] = message_type->full_name();
+            vars["tag"] = std::to_string((field->number() << 3) | element_wire_type_for_field(field));
+            vars["field"] = field_expr(field, "");
+            vars["field_slot"] = field_slot_expr(field, "");
+            if (field->is_map()) {
+                print_map_parse(field, vars, printer);
+                continue;
+            }
+
+            // Where a freshly read VALUE called value (or for native fields, a native value called
+            // native) goes
+            bool stores_native = is_native_field(field) || is_native_repeated(field);
+            std::string store_op = is_native_repeated(field) ?
+                "own_repeated_scalar<$native_type$>(rb_self, &field_$field_name$).push_back(native);\n" :
+                field->is_repeated() ?
+                    "rb_ary_push(own_array(rb_self, $field_slot$), value);\n" :
+                    is_native_field(field) ?
+                        "field_$field_name$ = native;\n" :
+                        "RB_OBJ_WRITE(rb_self, $field_slot$, value);\n";
+            if (has_presence_bit(field)) {
+                store_op += "set_has_field_$field_name$(true);\n";
+            }
+
+            switch (field->type()) {
+                case google::protobuf::FieldDescriptor::Type::TYPE_STRING:
+                case google::protobuf::FieldDescriptor::Type::TYPE_BYTES:
+                    printer.Print(vars,
+                        "case $tag$: {\n"
+                        "    size_t length;\n"
+                        "    ptr = read_length(ptr, end, &length);\n"
+                        "    if (ptr == nullptr) {\n"
+                        "        raise_decode_error(\"$message_name$\");\n"
+                        "    }\n"
+                        "    VALUE value = source == Qnil ?\n"
+                        "        rb_str_new(reinterpret_cast<const char*>(ptr), length) :\n"
+                        "        shared_substring(source, ptr, length);\n"
+                        "    ptr += length;\n"
+                    );
+                    printer.Indent();
+                    printer.Print(vars, store_op.c_str());
+                    printer.Outdent();
+                    printer.Print(
+                        "    break;\n"
+                        "}\n"
+                    );
+                    break;
+                case google::protobuf::FieldDescriptor::Type::TYPE_MESSAGE:
+                case google::protobuf::FieldDescriptor::Type::TYPE_GROUP: {
+                    bool is_group = field->type() == google::protobuf::FieldDescriptor::Type::TYPE_GROUP;
+                    vars["end_tag"] = std::to_string((field->number() << 3) | 4);
+
+                    printer.Print(vars, "case $tag$: {\n");
+                    printer.Indent();
+                    if (is_group) {
+                        printer.Print(vars,
+                            "if (depth >= MAX_PARSE_DEPTH) {\n"
+                            "    raise_decode_error(\"$message_name$\");\n"
+                            "}\n"
+                        );
+                    } else {
+                        printer.Print(vars,
+                            "size_t length;\n"
+                            "ptr = read_length(ptr, end, &length);\n"
+                            "if (ptr == nullptr || depth >= MAX_PARSE_DEPTH) {\n"
+                            "    raise_decode_error(\"$message_name$\");\n"
+                            "}\n"
+                        );
+                        // parse_lazy just notes where the field is, leaving it for its getter
+                        printer.Print(vars,
+                            "if (lazy_fields != nullptr && lazy_fields->indexing) {\n"
+                            "    lazy_fields->add($field_number$, tag_start, ptr + length);\n"
+                        );
+                        if (is_sparse(message_type)) {
+                            // Serializing only goes through the fields we hold
+                            printer.Print(vars, "    $field_slot$;\n");
+                        }
+                        if (field->is_optional()) {
+                            printer.Print(vars, "    set_has_field_$field_name$(true);\n");
+                        }
+                        printer.Print(
+                            "    ptr += length;\n"
+                            "    break;\n"
+                            "}\n"
+                        );
+                    }
+
+                    // Repeated fields get a new message for each element. A singular field that
+                    // shows up more than once gets merged, as per the protobuf spec.
+                    if (field->is_repeated()) {
+                        printer.Print(vars,
+                            "VALUE nested = $nested_message_type$::new_for_parse();\n"
+                            "rb_ary_push(own_array(rb_self, $field_slot$), nested);\n"
+                        );
+                    } else if (field->is_optional()) {
+                        printer.Print(vars,
+                            "if (!has_field_$field_name$() || $field$ == Qnil) {\n"
+                            "    RB_OBJ_WRITE(rb_self, $field_slot$, $nested_message_type$::new_for_parse());\n"
+                            "    set_has_field_$field_name$(true);\n"
+                            "}\n"
+                            "VALUE nested = $field$;\n"
+                        );
+                    } else {
+                        printer.Print(vars,
+                            "if ($field$ == $nested_message_type$::shared_default) {\n"
+                            "    RB_OBJ_WRITE(rb_self, $field_slot$, $nested_message_type$::new_for_parse());\n"
+                            "}\n"
+                            "VALUE nested = $field$;\n"
+                        );
+                    }
+
+                    printer.Print(vars,
+                        "$nested_message_type$* cpp_nested;\n"
+                        "TypedData_Get_Struct(nested, $nested_message_type$, &$nested_message_type$::rb_data_type, cpp_nested);\n"
+                    );
+                    if (is_group) {
+                        printer.Print(vars, "ptr = cpp_nested->parse_wire(ptr, end, $end_tag$, depth + 1, source);\n");
+                    } else {
+                        // Decoding one of our lazy fields leaves the nested message's own fields lazy
+                        printer.Print(vars,
+                            "if (lazy_fields != nullptr) {\n"
+                            "    cpp_nested->parse_lazy_wire(ptr, ptr + length, source);\n"
+                            "} else {\n"
+                            "    cpp_nested->parse_wire(ptr, ptr + length, 0, depth + 1, source);\n"
+                            "}\n"
+                            "ptr += length;\n"
+                        );
+                    }
+                    // Keeps nested where it is while its struct is being parsed into: one embedded
+                    // in its object would otherwise be free to move if parsing set off compaction
+                    printer.Print(
+                        "RB_GC_GUARD(nested);\n"
+                        "break;\n"
+                    );
+                    printer.Outdent();
+                    printer.Print("}\n");
+                    break;
+                }
+                default: {
+                    auto ops = scalar_decode_ops(field);
+                    vars["raw_type"] = ops.raw_type;
+                    vars["read"] = ops.read;
+
+                    // Converts raw to a VALUE (or native value) and stores it. Out of range enum
+                    // values are kept as unknown fields instead.
+                    auto native = with_value(ops.to_native, "raw");
+                    auto print_convert_and_store = [&]() {
+                        if (field->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                            printer.Print(vars,
+                                ("int32_t enum_value = static_cast<int32_t>(raw);\n"
+                                "if (" + enum_value_check(field->enum_type()) + ") {\n" +
+                                (stores_native ?
+                                    "    int32_t native = enum_value;\n" :
+                                    "    VALUE value = INT2NUM(enum_value);\n")).c_str()
+                            );
+                            printer.Indent();
+                            printer.Print(vars, store_op.c_str());
+                            printer.Outdent();
+                            printer.Print(vars,
+                                "} else {\n"
+                                "    append_unknown_varint(&unknown_fields, $field_number$, raw);\n"
+                                "}\n"
+                            );
+                        } else if (stores_native) {
+                            printer.Print(vars, ("auto native = " + native + ";\n").c_str());
+                            printer.Print(vars, store_op.c_str());
+                        } else {
+                            printer.Print(vars, ("VALUE value = " + native_to_value(field, native) + ";\n").c_str());
+                            printer.Print(vars, store_op.c_str());
+                        }
+                    };
+
+                    printer.Print(vars,
+                        "case $tag$: {\n"
+                        "    $raw_type$ raw;\n"
+                        "    ptr = $read$(ptr, end, &raw);\n"
+                        "    if (ptr == nullptr) {\n"
+                        "        raise_decode_error(\"$message_name$\");\n"
+                        "    }\n"
+                    );
+                    printer.Indent();
+                    print_convert_and_store();
+                    printer.Outdent();
+                    printer.Print(
+                        "    break;\n"
+                        "}\n"
+                    );
+
+                    // Repeated scalars can always be read packed or not, whichever way they were
+                    // declared.
+                    if (!vars["varint_kernel"].empty() && field->type() != google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+                        // Native integer fields read the whole run in one go. Enums still go a
+                        // value at a time, so unknown values can be set aside.
+                        vars["packed_tag"] = std::to_string((field->number() << 3) | 2);
+                        printer.Print(vars,
+                            "case $packed_tag$: {\n"
+                            "    size_t length;\n"
+                            "    ptr = read_length(ptr, end, &length);\n"
+                            "    if (ptr == nullptr) {\n"
+                            "        raise_decode_error(\"$message_name$\");\n"
+                            "    }\n"
+                            "    if (length > 0) {\n"
+                            "        ptr = varint_kernels().$varint_kernel$.read(ptr, ptr + length, &own_repeated_scalar<$native_type$>(rb_self, &field_$field_name$));\n"
+                            "        if (ptr == nullptr) {\n"
+                            "            raise_decode_error(\"$message_name$\");\n"
+                            "        }\n"
+                            "    }\n"
+                            "    break;\n"
+                            "}\n"
+                        );
+                    } else if (field->is_repeated()) {
+                        vars["packed_tag"] = std::to_string((field->number() << 3) | 2);
+                        printer.Print(vars,
+                            "case $packed_tag$: {\n"
+                            "    size_t length;\n"
+                            "    ptr = read_length(ptr, end, &length);\n"
+                            "    if (ptr == nullptr) {\n"
+                            "        raise_decode_error(\"$message_name$\");\n"
+                            "    }\n"
+                            "    const uint8_t* packed_end = ptr + length;\n"
+                            "    while (ptr < packed_end) {\n"
+                            "        $raw_type$ raw;\n"
+                            "        ptr = $read$(ptr, packed_end, &raw);\n"
+                            "        if (ptr == nullptr) {\n"
+                            "            raise_decode_error(\"$message_name$\");\n"
+                            "        }\n"
+                        );
+                        printer.Indent();
+                        printer.Indent();
+                        print_convert_and_store();
+                        printer.Outdent();
+                        printer.Outdent();
+                        printer.Print(
+                            "    }\n"
+                            "    break;\n"
+                            "}\n"
+                        );
+                    }
+                    break;
+                }
+            }
+        }
+
+        printer.Print(
+            "default:\n"
+            "    ptr = skip_field(ptr, end, tag, depth);\n"
+            "    if (ptr == nullptr) {\n"
+            "        raise_decode_error(\"$message_name$\");\n"
+            "    }\n"
+            "    append_unknown(&unknown_fields, tag_start, ptr);\n"
+            "    break;\n",
+            "message_name", message_type->full_name()
+        );
+
+        printer.Outdent();
+        printer.Outdent();
+        printer.Outdent();
+        printer.Print(
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    // A group has to finish with its end tag\n"
+            "    if (end_group_tag != 0) {\n"
+            "        raise_decode_error(\"$message_name$\");\n"
+            "    }\n"
+            "    // Unknown fields and lazy spans are native memory, which the GC should know about\n"
+            "    report_native_memory();\n"
+            "    return ptr;\n"
+            "}\n\n",
+            "message_name", message_type->full_name()
+        );
+
+        // parse_lazy_wire() is parse_wire() for parse_lazy, which indexes our message fields into
+        // lazy_fields instead of decoding them. decode_lazy() decodes the spans of one field (or
+        // of every field, for 0) by parsing them again, this time for real, and drop_lazy() forgets
+        // them when the field has been set to something else. Each span is marked as done before
+        // it is decoded, so one that turns out to be malformed can't be read twice.
+        printer.Print(
+            "void $class_name$::parse_lazy_wire(const uint8_t* ptr, const uint8_t* end, VALUE source) {\n"
+            "    if (lazy_fields == nullptr) {\n"
+            "        lazy_fields = new LazyFields(source);\n"
+            "        RB_OBJ_WRITTEN(rb_self, Qundef, source);\n"
+            "    }\n"
+            "    lazy_fields->indexing = true;\n"
+            "    parse_wire(ptr, end, 0, 0, source);\n"
+            "    lazy_fields->indexing = false;\n"
+            "    if (lazy_fields->done()) {\n"
+            "        delete lazy_fields;\n"
+            "        lazy_fields = nullptr;\n"
+            "    }\n"
+            "    report_native_memory();\n"
+            "}\n\n"
+            "void $class_name$::decode_lazy(int field_number) {\n"
+            "    lazy_fields->indexing = false;\n"
+            "    for (size_t i = 0; i < lazy_fields->spans.size(); i++) {\n"
+            "        auto span = lazy_fields->spans[i];\n"
+            "        if (span.field_number == 0 || (field_number != 0 && span.field_number != field_number)) {\n"
+            "            continue;\n"
+            "        }\n"
+            "        lazy_fields->spans[i].field_number = 0;\n"
+            "        parse_wire(lazy_fields->base() + span.start, lazy_fields->base() + span.end, 0, 0, lazy_fields->source);\n"
+            "    }\n"
+            "    if (lazy_fields->done()) {\n"
+            "        delete lazy_fields;\n"
+            "        lazy_fields = nullptr;\n"
+            "    }\n"
+            "    report_native_memory();\n"
+            "}\n\n"
+            "void $class_name$::drop_lazy(int field_number) {\n"
+            "    lazy_fields->drop(field_number);\n"
+            "    if (lazy_fields->done()) {\n"
+            "        delete lazy_fields;\n"
+            "        lazy_fields = nullptr;\n"
+            "    }\n"
+            "    report_native_memory();\n"
+            "}\n\n",
+            "class_name", class_name
+        );
+    }
+}
@@ -23,6 +23,7 @@ namespace rb_fastproto {
 
         printer.Print(
             "static VALUE rb_cls;\n"
+            "static const rb_data_type_t rb_data_type;\n"
             "\n"
             "bool have_initialized;\n"
             "\n"
@@ -33,8 +34,7 @@ namespace rb_fastproto {
             "static VALUE alloc(VALUE self);\n"
             "static VALUE alloc();\n"
             "static VALUE initialize(VALUE self);\n"
-            "static void free(char* memory);\n"
-            "static void mark(char* memory);\n"
+            "static void free(void* memory);\n"
             "\n"
             "static VALUE name(VALUE self);\n"
             "static VALUE proto_name(VALUE self);\n"
@@ -70,7 +70,18 @@ namespace rb_fastproto {
         write_cpp_method_struct_name(file, method, class_name, printer);
         write_cpp_method_struct_classes(file, method, class_name, printer);
 
-        printer.Print("VALUE $class_name$::rb_cls = Qnil;\n", "class_name", class_name);
+        printer.Print(
+            "VALUE $class_name$::rb_cls = Qnil;\n"
+            "// Holds no references, so there's nothing to mark or to update after compaction\n"
+            "const rb_data_type_t $class_name$::rb_data_type = {\n"
+            "    \"$full_name$\",\n"
+            "    { nullptr, &free, nullptr },\n"
+            "    nullptr, nullptr,\n"
+            "    RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED\n"
+            "};\n",
+            "class_name", class_name,
+            "full_name", method->full_name()
+        );
 
         printer.Print(
             "\n"
@@ -108,6 +119,7 @@ namespace rb_fastproto {
 
         printer.Print(
             "rb_cls = rb_define_class_under(package_rb_module, \"$ruby_class_name$\", cls_fastproto_method);\n"
+            "rb_gc_register_address(&rb_cls);\n"
             "rb_define_alloc_func(rb_cls, &alloc);\n"
             "rb_define_method(rb_cls, \"initialize\", RUBY_METHOD_FUNC(&initialize), 0);\n"
             "rb_define_singleton_method(rb_cls, \"name\", RUBY_METHOD_FUNC(&name), 0);\n"
@@ -134,23 +146,22 @@ namespace rb_fastproto {
             "VALUE $class_name$::alloc(VALUE self) {\n"
             "  auto memory = ruby_xmalloc(sizeof($class_name$));\n"
             "  std::memset(memory, 0, sizeof($class_name$));\n"
-            "  return Data_Wrap_Struct(self, &mark, &free, memory);\n"
+            "  return TypedData_Wrap_Struct(self, &rb_data_type, memory);\n"
             "}\n\n",
             "class_name", class_name
         );
 
         printer.Print(
             "VALUE $class_name$::alloc() {\n"
-            "  return alloc(rb_path2class(\"$rb_class_name$\"));\n"
+            "  return alloc(rb_cls);\n"
             "}\n\n",
-            "class_name", class_name,
-            "rb_class_name", ruby_proto_method_class_name(method)
+            "class_name", class_name
         );
 
         printer.Print(
             "VALUE $class_name$::initialize(VALUE self) {\n"
             "  void* memory;\n"
-            "  Data_Get_Struct(self, void*, memory);\n"
+            "  TypedData_Get_Struct(self, void, &rb_data_type, memory);\n"
             "  new(memory) $class_name$(self);\n"
             "  return self;\n"
             "}\n\n",
@@ -158,7 +169,7 @@ namespace rb_fastproto {
         );
 
         printer.Print(
-            "void $class_name$::free(char* memory) {\n"
+            "void $class_name$::free(void* memory) {\n"
             "  auto obj = reinterpret_cast<$class_name$*>(memory);\n"
             "  if (obj->have_initialized) {\n"
             "    obj->~$destructor_name$();\n"
@@ -168,11 +179,6 @@ namespace rb_fastproto {
             "class_name", class_name,
             "destructor_name", cpp_proto_method_wrapper_struct_name_no_ns(method)
         );
-
-        printer.Print(
-            "void $class_name$::mark(char* memory) {}\n\n",
-            "class_name", class_name
-        );
     }
 
     void RBFastProtoCodeGenerator::write_cpp_method_struct_name(
@@ -65,6 +65,14 @@ namespace rb_fastproto {
         return cpp_proto_ns;
     }
 
+    // Enums nested in a message are named after it, the same as nested messages are
+    std::string cpp_proto_enum_class_name(const google::protobuf::EnumDescriptor* enum_type) {
+        if (enum_type->containing_type() != nullptr) {
+            return cpp_proto_class_name(enum_type->containing_type()) + "_" + enum_type->name();
+        }
+        return boost::replace_all_copy(enum_type->file()->package(), ".", "::") + "::" + enum_type->name();
+    }
+
     std::string cpp_proto_descriptor_name(const google::protobuf::Descriptor* message_type) {
         return boost::str(boost::format("%s_descriptor_") % cpp_proto_class_name(message_type));
     }
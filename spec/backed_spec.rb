@@ -0,0 +1,132 @@
+require 'spec_helper'
+
+describe 'C++ backed storage' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    let(:envelope) do
+        ::Fastproto::Backed::Envelope.new(
+            id: 'e1', destination: 'west', priority: 1,
+            hops: [
+                ::Fastproto::Backed::Hop.new(host: 'a', latency_ms: 3),
+                ::Fastproto::Backed::Hop.new(host: 'b', latency_ms: 4)
+            ],
+            origin: ::Fastproto::Backed::Hop.new(host: 'o'),
+            tags: ['x', 'y'], payload: "\x00\xff".b, offsets: [-1, 2**40],
+            reading: ::Fastproto::Compact::Reading.new(value: 2.5),
+            weight: 0.25, urgent: true, history: [0, 1, 1]
+        )
+    end
+
+    let(:bytes) { envelope.serialize_to_string }
+
+    it 'reads every field back out of a parsed message' do
+        m = ::Fastproto::Backed::Envelope.parse(bytes)
+        expect(m.id).to eql('e1')
+        expect(m.destination).to eql('west')
+        expect(m.priority).to eql(1)
+        expect(m.hops.map(&:host)).to eql(['a', 'b'])
+        expect(m.hops.map(&:latency_ms)).to eql([3, 4])
+        expect(m.origin.host).to eql('o')
+        expect(m.has_origin?).to eql(true)
+        expect(m.tags).to eql(['x', 'y'])
+        expect(m.payload).to eql("\x00\xff".b)
+        expect(m.offsets).to eql([-1, 2**40])
+        expect(m.reading.value).to eql(2.5)
+        expect(m.weight).to eql(0.25)
+        expect(m.urgent).to eql(true)
+        expect(m.history).to eql([0, 1, 1])
+        expect(m.to_hash).to eql(envelope.to_hash)
+    end
+
+    it 'leaves fields that were not in the buffer unset' do
+        m = ::Fastproto::Backed::Envelope.parse(::Fastproto::Backed::Envelope.new(id: 'e2').serialize_to_string)
+        expect(m.has_destination?).to eql(false)
+        expect(m.has_origin?).to eql(false)
+        expect(m.has_priority?).to eql(false)
+        expect(m.hops).to eql([])
+    end
+
+    it 'serializes an untouched message to the bytes it was parsed from' do
+        m = ::Fastproto::Backed::Envelope.parse(bytes)
+        expect(m.serialize_to_string).to eql(bytes)
+        expect(m.byte_size).to eql(bytes.bytesize)
+    end
+
+    it 'writes back the fields that were changed' do
+        m = ::Fastproto::Backed::Envelope.parse(bytes)
+        m.destination = 'east'
+        m.tags << 'z'
+        m.hops[1].host = 'c'
+        m.origin = nil
+        m.priority = nil
+
+        reparsed = ::Fastproto::Backed::Envelope.parse(m.serialize_to_string)
+        expect(reparsed.destination).to eql('east')
+        expect(reparsed.tags).to eql(['x', 'y', 'z'])
+        expect(reparsed.hops.map(&:host)).to eql(['a', 'c'])
+        expect(reparsed.has_origin?).to eql(false)
+        expect(reparsed.has_priority?).to eql(false)
+        expect(reparsed.payload).to eql("\x00\xff".b)
+        expect(reparsed.reading.value).to eql(2.5)
+    end
+
+    it 'keeps unknown fields and enum values it does not know' do
+        unknown = [0xf8, 0x01, 0x07].pack('C*')
+        m = ::Fastproto::Backed::Envelope.parse(bytes + unknown)
+        expect(m.serialize_to_string.end_with?(unknown)).to eql(true)
+
+        # The C++ message can't hold it, so it's written out with the unknown fields
+        m.priority = 7
+        expect(m.serialize_to_string.end_with?(unknown + [0x18, 0x07].pack('C*'))).to eql(true)
+    end
+
+    it 'keeps one field of a oneof' do
+        m = ::Fastproto::Backed::Envelope.parse(::Fastproto::Backed::Envelope.new(id: 'e', relay: 'r').serialize_to_string)
+        expect(m.which_route).to eql(:relay)
+        m.via = ::Fastproto::Backed::Hop.new(host: 'v')
+        expect(m.relay).to eql('')
+
+        reparsed = ::Fastproto::Backed::Envelope.parse(m.serialize_to_string)
+        expect(reparsed.which_route).to eql(:via)
+        expect(reparsed.via.host).to eql('v')
+        expect(reparsed.has_relay?).to eql(false)
+    end
+
+    it 'reads and writes back map fields' do
+        m = ::Fastproto::Backed::Envelope.parse(::Fastproto::Backed::Envelope.new(
+            id: 'e', stops: { 'a' => ::Fastproto::Backed::Hop.new(host: 'h') }, labels: { 1 => 'one' }
+        ).serialize_to_string)
+        expect(m.stops['a'].host).to eql('h')
+        m.labels[2] = 'two'
+        m.stops['b'] = ::Fastproto::Backed::Hop.new(latency_ms: 9)
+
+        reparsed = ::Fastproto::Backed::Envelope.parse(m.serialize_to_string)
+        expect(reparsed.labels).to eql({ 1 => 'one', 2 => 'two' })
+        expect(reparsed.stops.keys.sort).to eql(['a', 'b'])
+        expect(reparsed.stops['b'].latency_ms).to eql(9)
+    end
+
+    it 'parses into an existing message' do
+        m = ::Fastproto::Backed::Envelope.new(id: 'old', destination: 'gone')
+        m.parse(::Fastproto::Backed::Envelope.new(id: 'new').serialize_to_string)
+        expect(m.id).to eql('new')
+        expect(m.has_destination?).to eql(false)
+    end
+
+    it 'raises a DecodeError for a malformed buffer' do
+        expect { ::Fastproto::Backed::Envelope.parse("\x0a\x05ab".b) }.to raise_error(::Fastproto::DecodeError)
+    end
+
+    it 'serializes a large message from several threads at once' do
+        big = ::Fastproto::Backed::Envelope.new(id: 'big', payload: 'p' * 100_000, hops: 200.times.map { |i| ::Fastproto::Backed::Hop.new(host: "h#{i}") })
+        encoded = big.serialize_to_string
+        m = ::Fastproto::Backed::Envelope.parse(encoded)
+        results = 4.times.map do
+            Thread.new { 20.times.map { m.serialize_to_string } }
+        end.flat_map(&:value)
+        expect(results.all? { |r| r == encoded }).to eql(true)
+        expect(m.hops.size).to eql(200)
+    end
+end
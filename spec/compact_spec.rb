@@ -0,0 +1,104 @@
+require 'spec_helper'
+
+describe 'The compact layout' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    let(:full_message) do
+        ::Fastproto::Compact::Telemetry.new(
+            timestamp: -5, i32: -7, s32: -9, u32: 4000000000, f32: 7, sf32: -8,
+            s64: -(2**40), u64: 2**63 + 5, f64: 2**64 - 1, sf64: -1,
+            fl: 1.5, db: 2.25, flag: true, status: 2, required_status: 1,
+            host: 'h', samples: [1, 2, 3],
+            reading: ::Fastproto::Compact::Reading.new(value: 3.5)
+        )
+    end
+
+    it 'starts with default values' do
+        m = ::Fastproto::Compact::Telemetry.new
+        expect(m.timestamp).to eql(0)
+        expect(m.i32).to eql(0)
+        expect(m.u64).to eql(0)
+        expect(m.db).to eql(0.0)
+        expect(m.flag).to eql(false)
+        expect(m.status).to eql(nil)
+        expect(m.required_status).to eql(nil)
+        expect(m.has_i32?).to eql(false)
+        expect(m.has_status?).to eql(false)
+    end
+
+    it 'reads back every scalar type it was given' do
+        m = full_message
+        expect(m.timestamp).to eql(-5)
+        expect(m.i32).to eql(-7)
+        expect(m.s32).to eql(-9)
+        expect(m.u32).to eql(4000000000)
+        expect(m.f32).to eql(7)
+        expect(m.sf32).to eql(-8)
+        expect(m.s64).to eql(-(2**40))
+        expect(m.u64).to eql(2**63 + 5)
+        expect(m.f64).to eql(2**64 - 1)
+        expect(m.sf64).to eql(-1)
+        expect(m.fl).to eql(1.5)
+        expect(m.db).to eql(2.25)
+        expect(m.flag).to eql(true)
+        expect(m.status).to eql(2)
+        expect(m.required_status).to eql(1)
+    end
+
+    it 'raises a TypeError when a field is assigned the wrong type' do
+        m = ::Fastproto::Compact::Telemetry.new
+        expect { m.i32 = 1.5 }.to raise_error(TypeError)
+        expect { m.i32 = 'x' }.to raise_error(TypeError)
+        expect { m.flag = 1 }.to raise_error(TypeError)
+        expect(m.has_i32?).to eql(false)
+    end
+
+    it 'tracks whether optional fields are set' do
+        m = ::Fastproto::Compact::Telemetry.new
+        m.i32 = 3
+        m.status = 1
+        expect(m.has_i32?).to eql(true)
+        expect(m.has_status?).to eql(true)
+
+        m.i32 = nil
+        m.status = nil
+        expect(m.has_i32?).to eql(false)
+        expect(m.i32).to eql(0)
+        expect(m.status).to eql(nil)
+    end
+
+    it 'serializes to the same bytes as the protobuf library' do
+        m = ::Fastproto::Compact::Telemetry.new(timestamp: 1, i32: -1, flag: true, status: 2)
+        expect(m.serialize_to_string.bytes).to eql(
+            [0x08, 0x01, 0x10] + [0xff] * 9 + [0x01, 0x68, 0x01, 0x70, 0x02]
+        )
+    end
+
+    it 'round trips through serialize and parse' do
+        m = full_message
+        parsed = ::Fastproto::Compact::Telemetry.parse(m.serialize_to_string)
+        expect(parsed).to eq(m)
+        expect(parsed.to_hash).to eql(m.to_hash)
+        expect(parsed.has_sf64?).to eql(true)
+        expect(parsed.has_fl?).to eql(true)
+        expect(parsed.reading.value).to eql(3.5)
+    end
+
+    it 'compares enums by whether they are set' do
+        a = ::Fastproto::Compact::Telemetry.new(timestamp: 1)
+        b = ::Fastproto::Compact::Telemetry.new(timestamp: 1, status: 0)
+        expect(a).to_not eq(b)
+        b.status = nil
+        expect(a).to eq(b)
+    end
+
+    it 'includes native fields in to_hash and inspect' do
+        m = ::Fastproto::Compact::Telemetry.new(timestamp: 9, db: 0.5)
+        expect(m.to_hash[:timestamp]).to eql(9)
+        expect(m.to_hash[:db]).to eql(0.5)
+        expect(m.to_hash[:status]).to eql(nil)
+        expect(m.inspect.include?('timestamp=9')).to eql(true)
+    end
+end
@@ -132,6 +132,21 @@ describe 'Generated code' do
             end
         end
 
+        describe 'a string field' do
+            it 'throws when not a string' do
+                m = ::Fastproto::TestProtos::TestMessageTwo.new
+                m.str_field = 3
+                expect { m.validate! }.to raise_error(TypeError)
+            end
+
+            it 'throws when deep in a repeated message' do
+                m = ::Featureful::A.new
+                m.sub1 = 100.times.map { ::Featureful::A::Sub.new }
+                m.sub1[50].payload = 3
+                expect { m.validate! }.to raise_error(TypeError)
+            end
+        end
+
         describe 'a message field' do
             it 'works with an appropriately typed message' do
                 m = ::Fastproto::NestedTests::ParentTestMessage.new
@@ -165,6 +180,21 @@ describe 'Generated code' do
                 expect { m.validate! }.to raise_error(TypeError)
             end
 
+            it 'works whatever the arena high water mark is' do
+                old_high_water_mark = ::Fastproto.arena_high_water_mark
+                begin
+                    [0, 16, 1024 * 1024].each do |high_water_mark|
+                        ::Fastproto.arena_high_water_mark = high_water_mark
+                        m = ::Fastproto::NestedTests::ParentTestMessage.new
+                        m.id = 1
+                        m.box.box_me = "ohai" * 100
+                        expect { m.validate! }.to_not raise_error
+                    end
+                ensure
+                    ::Fastproto.arena_high_water_mark = old_high_water_mark
+                end
+            end
+
             xit 'the default value is frozen' do
                 m = ::Fastproto::NestedTests::ParentTestMessage.new
                 expect(m.box.frozen?).to eql(true)
@@ -196,6 +226,42 @@ describe 'Generated code' do
             expect(m.numbers).to be_a(Array)
             expect(m.numbers.size).to eql(0)
         end
+
+        it 'honours declared defaults' do
+            m = ::Featureful::ABitOfEverything.new
+            expect(m.int64_field).to eql(15)
+            expect(m.string_field).to eql("zomgkittenz")
+            expect(m.has_int64_field?).to eql(false)
+            expect(::Featureful::A::Sub.new.payload_type).to eql(0)
+
+            m.int64_field = 3
+            m.int64_field = nil
+            expect(m.int64_field).to eql(15)
+        end
+
+        it 'shares frozen default strings' do
+            a = ::Fastproto::TestProtos::TestMessageTwo.new
+            b = ::Fastproto::TestProtos::TestMessageTwo.new
+            expect(a.str_field.frozen?).to eql(true)
+            expect(a.str_field.equal?(b.str_field)).to eql(true)
+        end
+
+        it 'gives each message its own repeated fields' do
+            a = ::Fastproto::TestProtos::TestMessageFour.new
+            a.numbers << 5
+            expect(a.numbers).to eql([5])
+            expect(::Fastproto::TestProtos::TestMessageFour.new.numbers).to eql([])
+        end
+
+        it 'gives each message its own required submessages' do
+            a = ::Featureful::A.new
+            b = ::Featureful::A.new
+            expect(a).to eq(b)
+            a.sub3.payload = "ohai"
+            expect(b.sub3.payload).to eql("")
+            expect(a).to_not eq(b)
+            expect(::Featureful::A.parse(a.serialize_to_string).sub3.payload).to eql("ohai")
+        end
     end
 
     describe 'has_field?' do
@@ -299,6 +365,112 @@ describe 'Generated code' do
                 expect(m.serialize_to_string).to eql("\x08\x01\x12\x12\x0A\x10\x62\x6F\x78\x69\x6E\x67\x20\x6B\x61\x6E\x67\x61\x72\x6F\x6F\x21".force_encoding(Encoding::ASCII_8BIT))
 
             end
+
+            it 'does not work with a different protobuf type' do
+                m = ::Featureful::A.new
+                m.sub2 = ::Featureful::B.new
+                expect { m.serialize_to_string }.to raise_error(TypeError)
+            end
+        end
+
+        describe 'an enum field' do
+            it 'serializes properly' do
+                m = ::Featureful::A::Sub.new
+                m.payload_type = 1
+                expect(m.serialize_to_string).to eql("\x10\x01".force_encoding(Encoding::ASCII_8BIT))
+            end
+        end
+
+        describe 'negative ints' do
+            it 'serializes them sign extended, zigzagged or fixed as appropriate' do
+                m = ::Featureful::ABitOfEverything.new
+                m.int32_field = -1
+                m.sint32_field = -1
+                m.fixed32_field = 1
+                expect(m.serialize_to_string).to eql("\x18\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01\x38\x01\x4D\x01\x00\x00\x00".force_encoding(Encoding::ASCII_8BIT))
+            end
+        end
+
+        describe 'a group' do
+            it 'serializes properly' do
+                m = ::Featureful::A.new
+                m.i3 = 1
+                m.sub3.payload_type = 0
+                m.group3.i1 = 2
+                subgroup = ::Featureful::A::Group3::Subgroup.new
+                subgroup.i1 = 3
+                m.group3.subgroup = [subgroup]
+                expect(m.serialize_to_string).to eql("\x18\x01\x32\x02\x10\x00\x4B\x08\x02\x13\x08\x03\x14\x4C".force_encoding(Encoding::ASCII_8BIT))
+            end
+        end
+    end
+
+    describe 'byte_size' do
+        it 'is the length of serialize_to_string' do
+            m = ::Featureful::A.new(i2: 300, i3: -1, sub1: [::Featureful::A::Sub.new(payload: 'x')])
+            expect(m.byte_size).to eql(m.serialize_to_string.bytesize)
+            expect(::Featureful::A.new.byte_size).to eql(::Featureful::A.new.serialize_to_string.bytesize)
+        end
+
+        it 'follows changes made through setters, in place, and to sub-messages' do
+            m = ::Featureful::A.new(i3: 1)
+            m.byte_size
+            m.i3 = 2**30
+            expect(m.byte_size).to eql(m.serialize_to_string.bytesize)
+
+            m.sub2.payload = 'p'
+            m.sub2.payload << 'ayload'
+            m.i1 << 300
+            expect(m.byte_size).to eql(m.serialize_to_string.bytesize)
+
+            sub = ::Featureful::A::Sub.new
+            m.sub1 = [sub]
+            m.byte_size
+            sub.payload_type = 1
+            expect(m.byte_size).to eql(m.serialize_to_string.bytesize)
+        end
+
+        it 'counts unknown fields, and raises for bad values' do
+            m = ::Fastproto::TestProtos::TestMessageOne.parse("\x08\x01\xF8\x01\x05".force_encoding(Encoding::ASCII_8BIT))
+            expect(m.byte_size).to eql(5)
+            m.id = 'not a number'
+            expect { m.byte_size }.to raise_error(TypeError)
+        end
+    end
+
+    describe 'deep_freeze' do
+        let(:message) do
+            ::Featureful::A.new(i1: [1, 2], i3: 1, sub1: [::Featureful::A::Sub.new(payload: 'one')], sub2: ::Featureful::A::Sub.new(payload: 'two'))
+        end
+
+        it 'freezes the message and everything in it' do
+            expect(message.deep_freeze.equal?(message)).to eql(true)
+            expect(message.frozen?).to eql(true)
+            expect(message.i1.frozen?).to eql(true)
+            expect(message.sub1.frozen?).to eql(true)
+            expect(message.sub1[0].payload.frozen?).to eql(true)
+            expect(message.sub2.frozen?).to eql(true)
+            expect(message.sub2.payload.frozen?).to eql(true)
+            expect { message.sub2.payload = 'three' }.to raise_error(RuntimeError)
+            expect { message.sub2.parse('') }.to raise_error(RuntimeError)
+        end
+
+        it 'gives the same bytes every time, in strings the caller can change' do
+            expected = message.serialize_to_string
+            message.deep_freeze
+            first = message.serialize_to_string
+            first << 'x'
+            expect(first.frozen?).to eql(false)
+            expect(message.serialize_to_string).to eql(expected)
+            expect(message.byte_size).to eql(expected.bytesize)
+        end
+
+        it 'lets a parent reuse the bytes of a frozen child' do
+            message.deep_freeze
+            child_bytes = message.serialize_to_string
+            parent = ::Featureful::B.new(a: [message, message])
+            expect(parent.serialize_to_string).to eql(("\x0A" + child_bytes.bytesize.chr + child_bytes) * 2)
+            expect(::Featureful::B.parse(parent.serialize_to_string).a[1]).to eq(message)
         end
     end
 
@@ -362,6 +534,196 @@ describe 'Generated code' do
                 expect(m.has_box?).to eql(true)
                 expect(m.box.box_me).to eql("boxing kangaroo!")
             end
+
+            it 'parses repeated messages' do
+                m = ::Featureful::A.parse("\x22\x03\x0A\x01\x78\x22\x02\x10\x01".force_encoding(Encoding::ASCII_8BIT))
+                expect(m.sub1.size).to eql(2)
+                expect(m.sub1[0].payload).to eql("x")
+                expect(m.sub1[1].payload_type).to eql(1)
+            end
+        end
+
+        describe 'repeated ints' do
+            it 'parses them packed or not' do
+                m = ::Featureful::A.parse("\x08\x07\x0A\x04\x01\x02\xAC\x02".force_encoding(Encoding::ASCII_8BIT))
+                expect(m.i1).to eql([7, 1, 2, 300])
+            end
+        end
+
+        describe 'a group' do
+            it 'round trips' do
+                bytes = "\x18\x01\x32\x02\x10\x00\x4B\x08\x02\x13\x08\x03\x14\x4C".force_encoding(Encoding::ASCII_8BIT)
+                m = ::Featureful::A.parse(bytes)
+                expect(m.group3.i1).to eql(2)
+                expect(m.group3.subgroup[0].i1).to eql(3)
+                expect(m.serialize_to_string).to eql(bytes)
+            end
+        end
+
+        describe 'malformed data' do
+            it 'raises a DecodeError' do
+                expect { ::Featureful::A.parse("\x22\x7F".force_encoding(Encoding::ASCII_8BIT)) }.to raise_error(::Fastproto::DecodeError)
+                expect { ::Featureful::A.parse("\x08".force_encoding(Encoding::ASCII_8BIT)) }.to raise_error(::Fastproto::DecodeError)
+                expect { ::Featureful::A.parse("\x4B\x08\x02".force_encoding(Encoding::ASCII_8BIT)) }.to raise_error(::Fastproto::DecodeError)
+            end
+        end
+    end
+
+    describe 'parse_shared' do
+        it 'shares the buffer for big string and bytes fields' do
+            require 'objspace'
+            blob = Random.new(7).bytes(100_000)
+            bytes = ::Fastproto::TestProtos::TestMessageTwo.new(str_field: 'short', byte_field: blob).serialize_to_string
+            m = ::Fastproto::TestProtos::TestMessageTwo.parse_shared(bytes)
+            expect(m).to eq(::Fastproto::TestProtos::TestMessageTwo.parse(bytes))
+            expect(m.byte_field).to eql(blob)
+            expect(ObjectSpace.memsize_of(m.byte_field) < 1000).to eql(true)
+            expect(bytes.frozen?).to eql(false)
+        end
+
+        it 'gives back strings that can be changed without touching the buffer' do
+            bytes = ::Featureful::D.new(f: [::Featureful::F.new(s: 'a' * 200), ::Featureful::F.new(s: 'b' * 200)]).serialize_to_string
+            m = ::Featureful::D.parse_shared(bytes.dup.force_encoding(Encoding::UTF_8))
+            expect(m.f[0].s.encoding).to eql(Encoding::ASCII_8BIT)
+            m.f[0].s << 'c'
+            m.f[1].s.replace('d')
+            expect(m.f[0].s).to eql('a' * 200 + 'c')
+            expect(::Featureful::D.parse(bytes).f[1].s).to eql('b' * 200)
+        end
+
+        it 'raises a DecodeError for malformed data' do
+            expect { ::Featureful::A.parse_shared("\x22\x7F".force_encoding(Encoding::ASCII_8BIT)) }.to raise_error(::Fastproto::DecodeError)
+        end
+    end
+
+    describe 'parse_lazy' do
+        # A::Sub with payload_type as an overlong varint, which an eager parse wouldn't write back
+        # out the same way
+        let(:sub_bytes) { "\x10\x81\x00\x1A\x03\x0A\x01x".force_encoding(Encoding::ASCII_8BIT) }
+        let(:a_bytes) do
+            ("\x18\x01" + "\x22\x03\x0A\x01a" * 2 + "\x2A" + sub_bytes.bytesize.chr + sub_bytes).force_encoding(Encoding::ASCII_8BIT)
+        end
+
+        it 'copies messages that are never read back out as they were' do
+            b_bytes = ("\x0A" + a_bytes.bytesize.chr + a_bytes).force_encoding(Encoding::ASCII_8BIT)
+            m = ::Featureful::B.parse_lazy(b_bytes)
+            expect(m.serialize_to_string).to eql(b_bytes)
+            expect(m.byte_size).to eql(b_bytes.bytesize)
+            expect(::Featureful::B.parse(b_bytes).serialize_to_string == b_bytes).to eql(false)
+        end
+
+        it 'decodes message fields when they are read' do
+            m = ::Featureful::A.parse_lazy(a_bytes)
+            expect(m.has_sub2?).to eql(true)
+            expect(m.sub2.payload_type).to eql(1)
+            expect(m.sub2.subsub1.subsub_payload).to eql('x')
+            expect(m.sub1.map(&:payload)).to eql(%w(a a))
+            expect(m.to_hash).to eql(::Featureful::A.parse(a_bytes).to_hash)
+        end
+
+        it 'writes out changes to fields that have been read or set' do
+            m = ::Featureful::A.parse_lazy(a_bytes)
+            m.sub2.subsub1.subsub_payload = 'y'
+            m.sub1 = []
+            parsed = ::Featureful::A.parse(m.serialize_to_string)
+            expect(parsed.sub2.subsub1.subsub_payload).to eql('y')
+            expect(parsed.sub1.size).to eql(0)
+
+            m = ::Featureful::A.parse_lazy(a_bytes)
+            m.sub2 = nil
+            expect(m.has_sub2?).to eql(false)
+            expect(::Featureful::A.parse(m.serialize_to_string).has_sub2?).to eql(false)
+        end
+
+        it 'raises a DecodeError for a malformed message field when it is read' do
+            m = ::Featureful::A.parse_lazy("\x18\x01\x2A\x02\x0A\x7F".force_encoding(Encoding::ASCII_8BIT))
+            expect(m.i3).to eql(1)
+            expect { m.sub2 }.to raise_error(::Fastproto::DecodeError)
+            expect { ::Featureful::A.parse_lazy("\x2A\x7F".force_encoding(Encoding::ASCII_8BIT)) }.to raise_error(::Fastproto::DecodeError)
+        end
+    end
+
+    describe 'garbage collection' do
+        # Long enough that GC.start promotes the message before anything else is stored in it
+        def make_old(obj)
+            4.times { GC.start(full_mark: false) }
+            obj
+        end
+
+        # Allocates in a frame of its own and returns only the stats, so no stale reference to the
+        # messages is left on the caller's stack for the GC to find conservatively
+        def memory_stats_with_subs(count)
+            subs = count.times.map { ::Featureful::A::Sub.new }
+            stats = Fastproto.memory_stats[::Featureful::A::Sub]
+            subs.clear
+            stats
+        end
+
+        it 'wraps messages as write barrier protected objects' do
+            require 'objspace'
+            m = make_old(::Featureful::A.new)
+            expect(ObjectSpace.dump(m).include?('"wb_protected":true')).to eql(true)
+            expect(ObjectSpace.dump(m).include?('"old":true')).to eql(true)
+        end
+
+        it 'allocates small messages inside their object' do
+            require 'objspace'
+            skip 'needs embeddable TypedData' if RUBY_VERSION < '3.3'
+            m = ::Featureful::A.new
+            expect(ObjectSpace.dump(m)[/"slot_size":(\d+)/, 1].to_i > 40).to eql(true)
+            expect(ObjectSpace.memsize_of(m) <= ObjectSpace.dump(m)[/"slot_size":(\d+)/, 1].to_i).to eql(true)
+        end
+
+        it 'keeps what is stored in an old message by setters and parse' do
+            m = make_old(::Featureful::A.new)
+            m.sub1 << ::Featureful::A::Sub.new(payload: 'p' * 40)
+            m.sub2.payload = 's' * 40
+            m.i3 = 7
+            GC.verify_internal_consistency
+
+            parsed = make_old(::Featureful::A.new)
+            parsed.parse(m.serialize_to_string)
+            GC.verify_internal_consistency
+            3.times { GC.start(full_mark: false) }
+            expect(m.sub1.map(&:payload)).to eql(['p' * 40])
+            expect(parsed.sub2.payload).to eql('s' * 40)
+            expect(parsed.sub1.map(&:payload)).to eql(['p' * 40])
+        end
+
+        it 'counts unknown fields in the memory size of a message' do
+            require 'objspace'
+            plain = ::Featureful::A.parse(::Featureful::A.new(i3: 1).serialize_to_string)
+            unknown = ::Featureful::A.parse(("\xF8\x01\x07" * 100).force_encoding(Encoding::ASCII_8BIT))
+            expect(ObjectSpace.memsize_of(unknown) > ObjectSpace.memsize_of(plain) + 100 * 3).to eql(true)
+        end
+
+        it 'reports live messages and their bytes per class' do
+            GC.start
+            before = Fastproto.memory_stats[::Featureful::A::Sub] || { count: 0, bytes: 0 }
+            stats = memory_stats_with_subs(10)
+            expect(stats[:count]).to eql(before[:count] + 10)
+            expect(stats[:bytes] > before[:bytes]).to eql(true)
+
+            GC.start(full_mark: true, immediate_sweep: true)
+            after = Fastproto.memory_stats[::Featureful::A::Sub] || { count: 0, bytes: 0 }
+            expect(after[:count] < before[:count] + 10).to eql(true)
+        end
+
+        it 'lets compaction move what messages refer to' do
+            m = ::Featureful::A.new
+            m.sub1 << ::Featureful::A::Sub.new(payload: 'p' * 40)
+            m.sub2.payload = 's'
+            lazy = ::Featureful::A.parse_lazy(m.serialize_to_string)
+            frozen = ::Featureful::A.parse(m.serialize_to_string).deep_freeze
+            frozen.serialize_to_string
+
+            GC.verify_compaction_references(expand_heap: true, toward: :empty)
+            expect(m.sub1.map(&:payload)).to eql(['p' * 40])
+            expect(m.sub2.payload).to eql('s')
+            expect(lazy.sub2.payload).to eql('s')
+            expect(frozen.serialize_to_string).to eql(m.serialize_to_string)
+            m.sub2.payload = 't'
+            expect(m.sub2.payload).to eql('t')
         end
     end
 
@@ -375,5 +737,27 @@ describe 'Generated code' do
             m.id = 2
             expect(m.serialize_to_string).to eql("\x08\x02\x1A\x10\x0A\x0E\x68\x69\x64\x64\x65\x6E\x20\x6D\x65\x73\x73\x61\x67\x65".force_encoding(Encoding::ASCII_8BIT))
         end
+
+        it 'writes them back out exactly as they were read' do
+            # An overlong varint, a fixed64, a group holding a fixed32 and a nested group, and a
+            # length-delimited field, none of which the message has.
+            unknown = [
+                0x28, 0x85, 0x80, 0x00,
+                0x31, 1, 2, 3, 4, 5, 6, 7, 8,
+                0x3B, 0x0D, 9, 8, 7, 6, 0x13, 0x08, 0x01, 0x14, 0x3C,
+                0x42, 0x02, 0xAB, 0xCD
+            ].pack('C*')
+            bytes = ::Fastproto::NestedTests::ParentTestMessage.new(id: 7).serialize_to_string + unknown
+            m = ::Fastproto::NestedTests::ParentTestMessage.parse(bytes)
+            expect(m.id).to eql(7)
+            expect(m.serialize_to_string).to eql(bytes)
+            expect(m.byte_size).to eql(bytes.bytesize)
+        end
+
+        it 'raises a DecodeError for a group that is never ended' do
+            expect {
+                ::Fastproto::NestedTests::ParentTestMessage.parse([0x3B, 0x08, 0x01].pack('C*'))
+            }.to raise_error(::Fastproto::DecodeError)
+        end
     end
 end
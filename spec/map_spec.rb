@@ -0,0 +1,99 @@
+require 'spec_helper'
+
+describe 'Map fields' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    let(:table) do
+        ::Fastproto::Map::Table.new(
+            name: 't',
+            counts: { 'b' => 2, 'a' => 1 },
+            labels: { 7 => 'seven', -(2**40) => 'big' },
+            cells: { 'c1' => ::Fastproto::Map::Cell.new(text: 'x', width: 3) },
+            flags: { true => 1 }
+        )
+    end
+
+    let(:flat) do
+        ::Fastproto::Map::Flat.new(
+            name: 't',
+            counts: [{ key: 'b', value: 2 }, { key: 'a', value: 1 }].map { |e| ::Fastproto::Map::Flat::CountsEntry.new(e) },
+            labels: [{ key: 7, value: 'seven' }, { key: -(2**40), value: 'big' }].map { |e| ::Fastproto::Map::Flat::LabelsEntry.new(e) },
+            cells: [::Fastproto::Map::Flat::CellsEntry.new(key: 'c1', value: ::Fastproto::Map::Cell.new(text: 'x', width: 3))],
+            flags: [::Fastproto::Map::Flat::FlagsEntry.new(key: true, value: 1)]
+        )
+    end
+
+    it 'starts out as an empty Hash' do
+        m = ::Fastproto::Map::Table.new
+        expect(m.counts).to eql({})
+        m.counts['z'] = 26
+        expect(m.counts).to eql({ 'z' => 26 })
+        expect(::Fastproto::Map::Table.new.counts).to eql({})
+        expect(::Fastproto::Map::Table.fields[2].class).to eql(::Fastproto::FieldMap)
+        expect(::Fastproto::Map::Table.fields[2].value_field.class).to eql(::Fastproto::FieldInteger)
+    end
+
+    it 'serializes each pair as an entry message' do
+        expect(table.serialize_to_string).to eql(flat.serialize_to_string)
+        expect(table.byte_size).to eql(flat.byte_size)
+    end
+
+    it 'reads back what it parses' do
+        m = ::Fastproto::Map::Table.parse(flat.serialize_to_string)
+        expect(m.counts).to eql({ 'b' => 2, 'a' => 1 })
+        expect(m.labels).to eql({ 7 => 'seven', -(2**40) => 'big' })
+        expect(m.cells['c1'].width).to eql(3)
+        expect(m.flags).to eql({ true => 1 })
+        expect(m.to_hash).to eql(table.to_hash)
+        expect(m).to eql(table)
+    end
+
+    it 'keeps the last value for a key and fills in missing keys and values' do
+        entries = [
+            ::Fastproto::Map::Flat::CountsEntry.new(key: 'a', value: 1),
+            ::Fastproto::Map::Flat::CountsEntry.new(key: 'a', value: 5),
+            ::Fastproto::Map::Flat::CountsEntry.new(value: 9),
+            ::Fastproto::Map::Flat::CountsEntry.new(key: 'n')
+        ]
+        m = ::Fastproto::Map::Table.parse(::Fastproto::Map::Flat.new(counts: entries).serialize_to_string)
+        expect(m.counts).to eql({ 'a' => 5, '' => 9, 'n' => 0 })
+    end
+
+    it 'keeps entries with enum values it does not know as unknown fields' do
+        bytes = ::Fastproto::Map::Flat.new(flags: [::Fastproto::Map::Flat::FlagsEntry.new(key: false, value: 1)]).serialize_to_string
+        unknown = [0x2a, 0x04, 0x08, 0x01, 0x10, 0x07].pack('C*')
+        m = ::Fastproto::Map::Table.parse(bytes + unknown)
+        expect(m.flags).to eql({ false => 1 })
+        expect(m.serialize_to_string).to eql(bytes + unknown)
+    end
+
+    it 'type checks keys and values when it serializes' do
+        expect { ::Fastproto::Map::Table.new(counts: { 1 => 1 }).serialize_to_string }.to raise_error(TypeError)
+        expect { ::Fastproto::Map::Table.new(counts: { 'a' => 'b' }).serialize_to_string }.to raise_error(TypeError)
+        expect { ::Fastproto::Map::Table.new(cells: { 'a' => 1 }).serialize_to_string }.to raise_error(TypeError)
+        expect { ::Fastproto::Map::Table.new(counts: []).serialize_to_string }.to raise_error(TypeError)
+    end
+
+    it 'writes keys in order with map_order=sorted' do
+        m = ::Fastproto::SortedMap::Index.new(words: { 'b' => 2, 'ab' => 3, 'a' => 1 }, positions: { 5 => 'e', -3 => 'm', 0 => 'z' })
+        flat = ::Fastproto::SortedMap::Flat.new(
+            words: [['a', 1], ['ab', 3], ['b', 2]].map { |k, v| ::Fastproto::SortedMap::Flat::WordsEntry.new(key: k, value: v) },
+            positions: [[-3, 'm'], [0, 'z'], [5, 'e']].map { |k, v| ::Fastproto::SortedMap::Flat::PositionsEntry.new(key: k, value: v) }
+        )
+        expect(m.serialize_to_string).to eql(flat.serialize_to_string)
+        expect(::Fastproto::SortedMap::Index.parse(m.serialize_to_string)).to eql(m)
+    end
+
+    it 'keeps its entries through compaction and deep_freeze' do
+        m = ::Fastproto::Map::Table.parse(table.serialize_to_string)
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+        expect(m.cells['c1'].text).to eql('x')
+        m.deep_freeze
+        expect(m.counts.frozen?).to eql(true)
+        expect(m.labels[7].frozen?).to eql(true)
+        expect(m.cells['c1'].frozen?).to eql(true)
+        expect(m.serialize_to_string).to eql(flat.serialize_to_string)
+    end
+end
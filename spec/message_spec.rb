@@ -16,6 +16,17 @@ describe ::Fastproto, "message" do
     a.value_for_tag?(5).should == true
   end
 
+  it "gets and sets fields by tag" do
+    a = Featureful::A.new
+    a.set_value_for_tag(2, 5)
+    a.i2.should == 5
+    a.value_for_tag(2).should == 5
+    a.value_for_tag?(2).should == true
+    expect { a.value_for_tag(100) }.to raise_error(KeyError)
+    expect { a.set_value_for_tag(100, 1) }.to raise_error(KeyError)
+    expect { a.value_for_tag?(100) }.to raise_error(KeyError)
+  end
+
   it "correctly handles value_for_tag? when a MessageField is set to the same object in two locations within the same proto and set in the constructor" do
     d = Featureful::D.new(
       :f => [1, 2, 3].map do |num|
@@ -103,6 +114,40 @@ describe ::Fastproto, "message" do
     c.value_for_tag?(1).should == true
   end
 
+  it "marks a faulted-in submessage as set when one of its fields changes" do
+    a = Featureful::A.new
+    a.has_sub2?.should == false
+    a.sub2.subsub1.subsub_payload = "nested"
+    a.has_sub2?.should == true
+    a.sub2.has_subsub1?.should == true
+    a.sub2.instance_variables.should == []
+  end
+
+  it "still marks a faulted-in submessage as set after parsing into it" do
+    a = Featureful::A.new
+    sub = a.sub2
+    sub.parse(Featureful::A::Sub.new.serialize_to_string)
+    a.has_sub2?.should == false
+    sub.payload = "parsed"
+    a.has_sub2?.should == true
+  end
+
+  it "reads unset sub-messages of a frozen message from a shared frozen default" do
+    a1 = Featureful::A.new.freeze
+    a2 = Featureful::A.new.freeze
+    a1.sub2.equal?(a2.sub2).should == true
+    a1.sub2.frozen?.should == true
+    a1.sub2.subsub1.subsub_payload.should == ""
+    a1.has_sub2?.should == false
+    proc { a1.sub2.payload = "ohai" }.should raise_error(RuntimeError)
+
+    messages = 100.times.map { Featureful::A.new.freeze }
+    messages.each { |m| m.sub2.subsub1.subsub_payload }
+    before = GC.stat(:total_allocated_objects)
+    messages.each { |m| m.sub2.subsub1.subsub_payload }
+    (GC.stat(:total_allocated_objects) - before < 10).should == true
+  end
+
   it "correctly handles get" do
     f = Featureful::A.new
     f.i3 = 4
@@ -0,0 +1,97 @@
+require 'spec_helper'
+
+describe 'Oneof fields' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    it 'starts with nothing set' do
+        m = ::Fastproto::Oneof::Event.new
+        expect(m.which_body).to eql(nil)
+        expect(m.which_target).to eql(nil)
+        expect(m.has_logout?).to eql(false)
+        expect(m.logout).to eql('')
+        expect(m.heartbeat).to eql(0)
+        expect(m.severity).to eql(0)
+    end
+
+    it 'only keeps the last field that was set' do
+        m = ::Fastproto::Oneof::Event.new(id: 'e', logout: 'bye', sequence: 3, host: 'h')
+        expect(m.which_body).to eql(:logout)
+        m.heartbeat = 7
+        expect(m.which_body).to eql(:heartbeat)
+        expect(m.has_logout?).to eql(false)
+        expect(m.logout).to eql('')
+        expect(m.heartbeat).to eql(7)
+        expect(m.which_target).to eql(:host)
+        expect(m.sequence).to eql(3)
+
+        m.port = 80
+        expect(m.which_target).to eql(:port)
+        expect(m.host).to eql('')
+        expect(m.which_body).to eql(:heartbeat)
+    end
+
+    it 'only clears the oneof for the field it has set' do
+        m = ::Fastproto::Oneof::Event.new(load: 0.5)
+        m.logout = nil
+        expect(m.which_body).to eql(:load)
+        m.load = nil
+        expect(m.which_body).to eql(nil)
+        expect(m.load).to eql(0.0)
+    end
+
+    it 'serializes only the field that is set' do
+        m = ::Fastproto::Oneof::Event.new(id: 'e', logout: 'bye', heartbeat: 9, sequence: 2, port: 443)
+        flat = ::Fastproto::Oneof::Flat.new(id: 'e', heartbeat: 9, sequence: 2, port: 443)
+        expect(m.serialize_to_string).to eql(flat.serialize_to_string)
+        expect(m.byte_size).to eql(flat.byte_size)
+
+        m.severity = 1
+        expect(m.serialize_to_string).to eql(::Fastproto::Oneof::Flat.new(id: 'e', severity: 1, sequence: 2, port: 443).serialize_to_string)
+    end
+
+    it 'keeps the last field of a oneof that it parses' do
+        both = ::Fastproto::Oneof::Flat.new(id: 'e', logout: 'bye', load: 1.5, host: 'h').serialize_to_string
+        m = ::Fastproto::Oneof::Event.parse(both)
+        expect(m.which_body).to eql(:load)
+        expect(m.load).to eql(1.5)
+        expect(m.has_logout?).to eql(false)
+        expect(m.host).to eql('h')
+        expect(m.to_hash).to eql({ id: 'e', load: 1.5, host: 'h' })
+        expect(m).to eql(::Fastproto::Oneof::Event.new(id: 'e', load: 1.5, host: 'h'))
+
+        lazy = ::Fastproto::Oneof::Event.parse_lazy(::Fastproto::Oneof::Flat.new(id: 'e', login: ::Fastproto::Oneof::Login.new(user: 'u'), heartbeat: 1).serialize_to_string)
+        expect(lazy.which_body).to eql(:heartbeat)
+        expect(lazy.has_login?).to eql(false)
+    end
+
+    it 'sets a message field when the message it read is changed' do
+        m = ::Fastproto::Oneof::Event.new(id: 'e')
+        login = m.login
+        expect(m.which_body).to eql(nil)
+        login.user = 'u'
+        expect(m.which_body).to eql(:login)
+        expect(m.login.user).to eql('u')
+
+        # Another field has been set since, so it stays set
+        m.logout = 'bye'
+        stray = ::Fastproto::Oneof::Event.new(id: 'e', heartbeat: 1).login
+        stray.user = 'x'
+        expect(m.which_body).to eql(:logout)
+
+        parsed = ::Fastproto::Oneof::Event.parse(::Fastproto::Oneof::Event.new(login: login).serialize_to_string)
+        expect(parsed.which_body).to eql(:login)
+        expect(parsed.login.user).to eql('u')
+    end
+
+    it 'keeps its value through compaction and deep_freeze' do
+        m = ::Fastproto::Oneof::Event.new(id: 'e', logout: 'b' * 40)
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+        expect(m.logout).to eql('b' * 40)
+        m.deep_freeze
+        expect(m.logout.frozen?).to eql(true)
+        expect(m.login.user).to eql('')
+        expect { m.heartbeat = 1 }.to raise_error(RuntimeError)
+    end
+end
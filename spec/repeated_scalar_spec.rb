@@ -0,0 +1,92 @@
+require 'spec_helper'
+
+describe 'Native repeated scalar fields' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    let(:series) do
+        ::Fastproto::Metrics::Series.new(
+            name: 'n', some_big_ints: [2**40, -3], deltas: [-1, 2, -300],
+            values: [1.5, 2.0], ratios: [0.5], flags: [true, false],
+            ids: [2**64 - 1], stamps: [7], kinds: [1, 0], labels: ['a']
+        )
+    end
+
+    it 'stores numeric, bool & enum fields in a RepeatedScalar' do
+        m = ::Fastproto::Metrics::Series.new
+        expect(m.some_big_ints).to be_a(::Fastproto::RepeatedScalar)
+        expect(m.kinds).to be_a(::Fastproto::RepeatedScalar)
+        expect(m.labels).to be_a(Array)
+        expect(m.some_big_ints.size).to eql(0)
+    end
+
+    it 'behaves like an Array' do
+        m = ::Fastproto::Metrics::Series.new
+        m.deltas << 3 << -4
+        m.deltas.push(5)
+        expect(m.deltas).to eq([3, -4, 5])
+        expect(m.deltas.to_a).to eql([3, -4, 5])
+        expect(m.deltas.map { |d| d * 2 }).to eql([6, -8, 10])
+        expect(m.deltas[-1]).to eql(5)
+        expect(m.deltas[0..1]).to eql([3, -4])
+        expect(m.deltas.last).to eql(5)
+        expect(m.deltas.inspect).to eql('[3, -4, 5]')
+        m.deltas[0] = 9
+        expect(m.deltas.first).to eql(9)
+    end
+
+    it 'type checks elements when they are added' do
+        m = ::Fastproto::Metrics::Series.new
+        expect { m.deltas = [1.5] }.to raise_error(TypeError)
+        expect { m.flags << 1 }.to raise_error(TypeError)
+        expect { m.values = 'not an array' }.to raise_error(TypeError)
+        expect(m.deltas.size).to eql(0)
+    end
+
+    it 'keeps an assigned RepeatedScalar by reference' do
+        a = ::Fastproto::Metrics::Series.new(deltas: [1, 2])
+        b = ::Fastproto::Metrics::Series.new
+        b.deltas = a.deltas
+        a.deltas << 3
+        expect(b.deltas).to eq([1, 2, 3])
+
+        copy = a.deltas.dup
+        copy << 4
+        expect(a.deltas).to eq([1, 2, 3])
+    end
+
+    it 'copies into a field in place, and only from the same element type' do
+        m = ::Fastproto::Metrics::Series.new(deltas: [1, 2])
+        field = m.deltas
+        field.send(:initialize_copy, ::Fastproto::Metrics::Series.new(deltas: [3]).deltas)
+        expect(m.deltas.equal?(field)).to eql(true)
+        expect(m.deltas).to eq([3])
+        expect { field.send(:initialize_copy, ::Fastproto::Metrics::Series.new(values: [1.5]).values) }.to raise_error(TypeError)
+        expect(m.serialize_to_string).to eql(::Fastproto::Metrics::Series.new(deltas: [3]).serialize_to_string)
+    end
+
+    it 'is only eql? to the same element type with the same values' do
+        ints = ::Fastproto::Metrics::Series.new(deltas: [1, 2]).deltas
+        expect(ints.eql?(::Fastproto::Metrics::Series.new(deltas: [1, 2]).deltas)).to eql(true)
+        expect(ints.eql?(::Fastproto::Metrics::Series.new(some_big_ints: [1, 2]).some_big_ints)).to eql(false)
+        expect(ints.eql?([1, 2])).to eql(false)
+        expect(ints == [1.0, 2.0]).to eql(true)
+        expect([ints, ::Fastproto::Metrics::Series.new(deltas: [1, 2]).deltas].uniq.size).to eql(1)
+    end
+
+    it 'serializes to the same bytes as an Array field would' do
+        m = ::Fastproto::Metrics::Series.new(deltas: [-1, 1], some_big_ints: [300])
+        expect(m.serialize_to_string.bytes).to eql([0x10, 0xAC, 0x02, 0x1A, 0x02, 0x01, 0x02])
+    end
+
+    it 'round trips through serialize and parse' do
+        parsed = ::Fastproto::Metrics::Series.parse(series.serialize_to_string)
+        expect(parsed).to eq(series)
+        expect(parsed.ids).to eq([2**64 - 1])
+        expect(parsed.values).to eq([1.5, 2.0])
+        expect(parsed.to_hash).to eql(series.to_hash)
+        expect(parsed.to_hash[:deltas]).to eql([-1, 2, -300])
+        expect { parsed.validate! }.to_not raise_error
+    end
+end
@@ -0,0 +1,180 @@
+require 'spec_helper'
+
+describe 'Batch serialization' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    def delimited(strings)
+        strings.map do |s|
+            size = s.bytesize
+            prefix = []
+            loop do
+                byte = size & 0x7f
+                size >>= 7
+                prefix << (size > 0 ? byte | 0x80 : byte)
+                break if size == 0
+            end
+            prefix.pack('C*') + s
+        end.join.b
+    end
+
+    let(:envelopes) do
+        2000.times.map do |i|
+            ::Fastproto::Backed::Envelope.new(
+                id: "e#{i}", payload: 'p' * (i % 300), tags: ['x'] * (i % 5),
+                hops: (i % 3).times.map { |j| ::Fastproto::Backed::Hop.new(host: "h#{j}") }
+            )
+        end
+    end
+
+    it 'serializes each message to the bytes it would on its own' do
+        expected = envelopes.map(&:serialize_to_string)
+        expect(::Fastproto::Backed::Envelope.serialize_many(envelopes)).to eql(expected)
+        expect(::Fastproto::Backed::Envelope.serialize_many([])).to eql([])
+    end
+
+    it 'serializes into one length delimited string' do
+        expected = delimited(envelopes.map(&:serialize_to_string))
+        expect(::Fastproto::Backed::Envelope.serialize_many_delimited(envelopes)).to eql(expected)
+        expect(::Fastproto::Backed::Envelope.serialize_many_delimited([])).to eql(''.b)
+    end
+
+    it 'serializes parsed, lazy and frozen messages' do
+        parsed = envelopes.first(50).map { |m| ::Fastproto::Backed::Envelope.parse(m.serialize_to_string) }
+        parsed[1].destination = 'east'
+        frozen = ::Fastproto::Backed::Envelope.new(id: 'f', payload: 'p' * 40).deep_freeze
+        frozen.serialize_to_string
+        batch = parsed + [frozen]
+        expect(::Fastproto::Backed::Envelope.serialize_many(batch)).to eql(batch.map(&:serialize_to_string))
+
+        lazy = 100.times.map { |i| ::Fastproto::Oneof::Event.parse_lazy(::Fastproto::Oneof::Event.new(id: "#{i}", logout: 'b').serialize_to_string) }
+        expect(::Fastproto::Oneof::Event.serialize_many_delimited(lazy)).to eql(delimited(lazy.map(&:serialize_to_string)))
+    end
+
+    it 'serializes messages with map fields' do
+        tables = 2000.times.map do |i|
+            ::Fastproto::Map::Table.new(
+                name: "t#{i}", counts: { 'a' => i, 'b' => -i }, labels: { i => 'l' * (i % 100) },
+                cells: { 'c' => ::Fastproto::Map::Cell.new(text: 'x' * (i % 50), width: i) }
+            )
+        end
+        expected = tables.map(&:serialize_to_string)
+        expect(::Fastproto::Map::Table.serialize_many(tables)).to eql(expected)
+        expect(::Fastproto::Map::Table.serialize_many_delimited(tables)).to eql(delimited(expected))
+
+        tables[0].counts['c'] = 3
+        tables[1].cells['c'].width = 0
+        expect(::Fastproto::Map::Table.serialize_many(tables.first(2))).to eql(tables.first(2).map(&:serialize_to_string))
+    end
+
+    it 'lets messages be changed again once their batch is written' do
+        threads = 4.times.map do
+            Thread.new { 5.times.map { ::Fastproto::Backed::Envelope.serialize_many(envelopes) } }
+        end
+        expected = envelopes.map(&:serialize_to_string)
+        threads.each do |thread|
+            thread.value.each { |batch| expect(batch).to eql(expected) }
+        end
+
+        envelopes[0].payload = 'changed'
+        envelopes[1].hops[0].host = 'changed'
+        envelopes[2].deep_freeze
+        expect(::Fastproto::Backed::Envelope.serialize_many(envelopes.first(3))).to eql(envelopes.first(3).map(&:serialize_to_string))
+    end
+
+    it 'serializes messages with sorted map fields' do
+        indexes = 500.times.map do |i|
+            ::Fastproto::SortedMap::Index.new(words: { 'b' * 5000 => i, 'a' => -i }, positions: { 3 => 'x' * 5000, -1 => 'y' })
+        end
+        expected = indexes.map(&:serialize_to_string)
+        expect(::Fastproto::SortedMap::Index.serialize_many(indexes)).to eql(expected)
+        expect(::Fastproto::SortedMap::Index.serialize_many_delimited(indexes)).to eql(delimited(expected))
+    end
+
+    # Big enough that serialize_many releases the GVL to copy the strings in
+    def big_series
+        200.times.map do |i|
+            ::Fastproto::Metrics::Series.new(
+                name: "s#{i}" + 'n' * 8000, labels: ['l' * 6000, 'short'], values: [1.0, i.to_f], ids: [i]
+            )
+        end
+    end
+
+    it 'writes each message as it was when its batch started while other threads change it' do
+        series = big_series
+        series.each { |s| s.name = 'a' * 8000 }
+        done = false
+        changer = Thread.new do
+            until done
+                series.each do |s|
+                    s.name.tr!('ab', 'ba')
+                    s.labels[0].tr!('lm', 'ml')
+                    s.labels.size > 4 ? s.labels.pop : s.labels.push('x' * 5000)
+                    s.values.push(2.0)
+                    s.ids.clear
+                end
+                Thread.pass
+            end
+        end
+        batches = 20.times.map { ::Fastproto::Metrics::Series.serialize_many(series) }
+        done = true
+        changer.join
+
+        batches.flatten.each do |bytes|
+            parsed = ::Fastproto::Metrics::Series.parse(bytes)
+            expect(parsed.name.squeeze.size).to eql(1)
+            expect(parsed.labels[0].squeeze.size).to eql(1)
+            expect(parsed.serialize_to_string).to eql(bytes)
+        end
+    end
+
+    it 'writes while another thread compacts the heap' do
+        next unless GC.respond_to?(:compact)
+        series = big_series
+        nested = envelopes.each { |e| e.payload = 'p' * 5000 }
+        expected_series = series.map(&:serialize_to_string)
+        expected_nested = delimited(nested.map(&:serialize_to_string))
+        done = false
+        compactor = Thread.new do
+            until done
+                GC.compact
+                Thread.pass
+            end
+        end
+        10.times do
+            expect(::Fastproto::Metrics::Series.serialize_many(series)).to eql(expected_series)
+            expect(::Fastproto::Backed::Envelope.serialize_many_delimited(nested)).to eql(expected_nested)
+        end
+        done = true
+        compactor.join
+    end
+
+    it 'lets go of messages that are taken out of a batch while it is written' do
+        envelopes.each { |e| e.payload = 'p' * 5000 }
+        removed = []
+        done = false
+        remover = Thread.new do
+            until done
+                envelopes.each do |e|
+                    hop = e.hops.pop
+                    removed << hop if hop
+                end
+                Thread.pass
+            end
+        end
+        5.times { ::Fastproto::Backed::Envelope.serialize_many(envelopes) }
+        done = true
+        remover.join
+
+        removed.each { |hop| hop.host = 'changed' }
+        envelopes.each { |e| e.payload = 'changed' }
+        expect(::Fastproto::Backed::Envelope.serialize_many(envelopes)).to eql(envelopes.map(&:serialize_to_string))
+    end
+
+    it 'raises before writing anything when a message is the wrong type or invalid' do
+        expect { ::Fastproto::Backed::Envelope.serialize_many(envelopes + [::Fastproto::Backed::Hop.new]) }.to raise_error(TypeError)
+        expect { ::Fastproto::Backed::Envelope.serialize_many(::Fastproto::Backed::Hop.new) }.to raise_error(TypeError)
+        expect { ::Fastproto::Sparse::Wide.serialize_many([::Fastproto::Sparse::Wide.new(count: 'x')]) }.to raise_error(TypeError)
+    end
+end
@@ -0,0 +1,108 @@
+require 'spec_helper'
+require 'objspace'
+
+describe 'Sparse field storage' do
+    after(:each) do
+        GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    let(:attributes) do
+        {
+            id: 'w1', count: -3, delta: -(2**40), mask: 7, ratio: 0.5, flag: true, colour: 1,
+            blob: "\x00\xff".b, part: { name: 'p' }, names: ['a', 'b'], samples: [1, 300, -1],
+            spare_41: 'x', spare_58: 2.5, early: 'e'
+        }
+    end
+
+    def build(cls, attributes)
+        cls.new(attributes.merge(
+            part: ::Fastproto::Sparse::Part.new(attributes[:part]),
+            parts: [::Fastproto::Sparse::Part.new(name: 'q'), ::Fastproto::Sparse::Part.new]
+        ))
+    end
+
+    let(:wide) { build(::Fastproto::Sparse::Wide, attributes) }
+    let(:dense) { build(::Fastproto::Sparse::Dense, attributes) }
+
+    it 'starts with default values' do
+        m = ::Fastproto::Sparse::Wide.new
+        expect(m.id).to eql('')
+        expect(m.count).to eql(0)
+        expect(m.label).to eql('none')
+        expect(m.colour).to eql(0)
+        expect(m.names).to eql([])
+        expect(m.has_count?).to eql(false)
+        expect(m.has_part?).to eql(false)
+        expect(m.part.name).to eql('')
+        expect(m.has_part?).to eql(false)
+    end
+
+    it 'serializes to the same bytes as the dense layout' do
+        expect(wide.serialize_to_string).to eql(dense.serialize_to_string)
+        expect(wide.byte_size).to eql(dense.byte_size)
+        expect(::Fastproto::Sparse::Wide.new.serialize_to_string).to eql(::Fastproto::Sparse::Dense.new.serialize_to_string)
+    end
+
+    it 'reads back what it parses' do
+        m = ::Fastproto::Sparse::Wide.parse(dense.serialize_to_string)
+        expect(m.to_hash).to eql(dense.to_hash)
+        expect(m.has_spare_41?).to eql(true)
+        expect(m.has_spare_42?).to eql(false)
+        expect(m.parts.map(&:name)).to eql(['q', ''])
+        expect(m).to eql(::Fastproto::Sparse::Wide.parse(wide.serialize_to_string))
+
+        lazy = ::Fastproto::Sparse::Wide.parse_lazy(dense.serialize_to_string)
+        expect(lazy.serialize_to_string).to eql(dense.serialize_to_string)
+        expect(lazy.part.name).to eql('p')
+    end
+
+    it 'forgets fields that are set back to nil' do
+        m = wide
+        m.spare_41 = nil
+        m.part = nil
+        m.id = nil
+        expect(m.has_spare_41?).to eql(false)
+        expect(m.spare_41).to eql('')
+        expect(m.id).to eql('')
+
+        d = dense
+        d.spare_41 = nil
+        d.part = nil
+        d.id = nil
+        expect(m.serialize_to_string).to eql(d.serialize_to_string)
+    end
+
+    it 'serializes the field its oneof has set' do
+        m = wide
+        d = dense
+        m.pick_name = 'n'
+        d.pick_name = 'n'
+        m.pick_part = ::Fastproto::Sparse::Part.new(name: 'p')
+        d.pick_part = ::Fastproto::Sparse::Part.new(name: 'p')
+        expect(m.which_pick).to eql(:pick_part)
+        expect(m.serialize_to_string).to eql(d.serialize_to_string)
+        expect(::Fastproto::Sparse::Wide.parse(m.serialize_to_string).pick_part.name).to eql('p')
+    end
+
+    it 'type checks fields when it serializes' do
+        m = ::Fastproto::Sparse::Wide.new(count: 'x')
+        expect { m.serialize_to_string }.to raise_error(TypeError)
+        expect { m.validate! }.to raise_error(TypeError)
+    end
+
+    it 'takes up less memory than the dense layout' do
+        expect(ObjectSpace.memsize_of(::Fastproto::Sparse::Wide.new) < ObjectSpace.memsize_of(::Fastproto::Sparse::Dense.new)).to eql(true)
+    end
+
+    it 'keeps its fields through garbage collection and compaction' do
+        m = ::Fastproto::Sparse::Wide.parse(dense.serialize_to_string)
+        GC.start(full_mark: true, immediate_sweep: true)
+        m.spare_45 = 'y' * 40
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+        expect(m.spare_45).to eql('y' * 40)
+        expect(m.names).to eql(['a', 'b'])
+        expect(m.part.name).to eql('p')
+        m.deep_freeze
+        expect(m.serialize_to_string).to eql(::Fastproto::Sparse::Wide.parse(m.serialize_to_string).serialize_to_string)
+    end
+end
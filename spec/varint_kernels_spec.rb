@@ -0,0 +1,68 @@
+require 'spec_helper'
+
+describe 'Bulk varint kernels' do
+    before(:each) do
+        @original_kernels = ::Fastproto.varint_kernels
+    end
+
+    after(:each) do
+        ::Fastproto.varint_kernels = @original_kernels
+    end
+
+    # Long runs of single byte values, for the vector paths, broken up by values at the edges of
+    # each type's range, so every vector has to fall back part way through.
+    def values(small_range, edges)
+        random = Random.new(42)
+        (0...500).map do |i|
+            i % 37 == 36 ? edges[random.rand(edges.size)] : random.rand(small_range)
+        end
+    end
+
+    let(:counters) do
+        ::Fastproto::Metrics::PackedCounters.new(
+            int32s: values(0..127, [0, 127, 128, -1, -2**31, 2**31 - 1]),
+            sint32s: values(-64..63, [64, -65, -1, -2**31, 2**31 - 1]),
+            uint32s: values(0..127, [128, 16_384, 2**32 - 1]),
+            int64s: values(0..127, [-1, 128, -2**63, 2**63 - 1]),
+            sint64s: values(-64..63, [64, -65, -2**63, 2**63 - 1]),
+            uint64s: values(0..127, [128, 2**35, 2**64 - 1]),
+            kinds: values(0..1, [1])
+        )
+    end
+
+    it 'picks the best kernels the CPU supports' do
+        expect(::Fastproto.available_varint_kernels.last).to eql('scalar')
+        expect(::Fastproto.varint_kernels).to eql(::Fastproto.available_varint_kernels.first)
+        expect { ::Fastproto.varint_kernels = 'mmx' }.to raise_error(ArgumentError)
+    end
+
+    it 'encodes a run of small values the same as one at a time' do
+        m = ::Fastproto::Metrics::PackedCounters.new(sint32s: [0, -1, 1, -2, 2, -3, 3, -4, 4])
+        expect(m.serialize_to_string.bytes).to eql([0x12, 0x09, 0, 1, 2, 3, 4, 5, 6, 7, 8])
+    end
+
+    it 'gives the same bytes and values whichever kernels are used' do
+        ::Fastproto.varint_kernels = 'scalar'
+        expected = counters.serialize_to_string
+
+        ::Fastproto.available_varint_kernels.each do |name|
+            ::Fastproto.varint_kernels = name
+            encoded = counters.serialize_to_string
+            expect(encoded).to eql(expected)
+
+            parsed = ::Fastproto::Metrics::PackedCounters.parse(encoded)
+            expect(parsed).to eq(counters)
+            expect(parsed.int32s.to_a).to eql(counters.int32s.to_a)
+            expect(parsed.sint64s.to_a).to eql(counters.sint64s.to_a)
+            expect(parsed.uint64s.to_a).to eql(counters.uint64s.to_a)
+        end
+    end
+
+    it 'rejects a truncated run of values' do
+        ::Fastproto.available_varint_kernels.each do |name|
+            ::Fastproto.varint_kernels = name
+            bytes = [0x22, 40] + [1] * 39 + [0x80]
+            expect { ::Fastproto::Metrics::PackedCounters.parse(bytes.pack('C*')) }.to raise_error(::Fastproto::DecodeError)
+        end
+    end
+end